@@ -0,0 +1,374 @@
+/**
+ * AF_PACKET backend (Linux): each router interface is attached to a
+ * local device through a packet socket with TPACKET_V3 rings mapped in
+ * the router. Received frames are handled where the kernel wrote them, a
+ * block at a time, and sent frames are written to free tx slots, which one
+ * send hands to the kernel at the end of the burst.
+ */
+#ifdef _LINUX_
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_io.h"
+
+#define IO_RX_LEN (IO_RX_BLOCK_SIZE * IO_RX_BLOCKS)
+#define IO_TX_LEN (IO_TX_BLOCK_SIZE * IO_TX_BLOCKS)
+#define IO_TX_FRAMES (IO_TX_LEN / IO_FRAME_SIZE)
+
+/** offset of the frame in a tx slot */
+#define IO_TX_DATA TPACKET_ALIGN (sizeof (struct tpacket3_hdr))
+
+/** the socket of a port */
+#define IO_FD(port) ((port)->q[0].ev.fd)
+
+/** filled tx slots handed to the kernel at once, before the burst ends */
+#define IO_TX_KICK 64
+
+/**
+ * Open the packet socket of port, map its rings and bind it to the device
+ */
+static int
+sr_afpacket_open_port (struct sr_io_port *port)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct ifreq ifr;
+  struct packet_mreq mr;
+  int fd, v = TPACKET_V3;
+
+  if ((fd = socket (AF_PACKET, SOCK_RAW, htons (ETH_P_ALL))) == -1)
+    {
+      perror ("socket(AF_PACKET)");
+      return -1;
+    }
+  IO_FD (port) = fd;
+  if (setsockopt (fd, SOL_PACKET, PACKET_VERSION, &v, sizeof (v)))
+    {
+      perror ("setsockopt(PACKET_VERSION)");
+      return -1;
+    }
+
+  memset (&req, 0, sizeof (req));
+  req.tp_block_size = IO_RX_BLOCK_SIZE;
+  req.tp_block_nr = IO_RX_BLOCKS;
+  req.tp_frame_size = IO_FRAME_SIZE;
+  req.tp_frame_nr = IO_RX_LEN / IO_FRAME_SIZE;
+  req.tp_retire_blk_tov = IO_RX_TIMEOUT;
+  if (setsockopt (fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof (req)))
+    {
+      perror ("setsockopt(PACKET_RX_RING)");
+      return -1;
+    }
+  memset (&req, 0, sizeof (req));
+  req.tp_block_size = IO_TX_BLOCK_SIZE;
+  req.tp_block_nr = IO_TX_BLOCKS;
+  req.tp_frame_size = IO_FRAME_SIZE;
+  req.tp_frame_nr = IO_TX_FRAMES;
+  if (setsockopt (fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof (req)))
+    {
+      perror ("setsockopt(PACKET_TX_RING)");
+      return -1;
+    }
+
+  port->ring_len = IO_RX_LEN + IO_TX_LEN;
+  port->ring = mmap (0, port->ring_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_LOCKED | MAP_POPULATE, fd, 0);
+  if (port->ring == MAP_FAILED)
+    port->ring = mmap (0, port->ring_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+  if (port->ring == MAP_FAILED)
+    {
+      perror ("mmap(..):sr_afpacket_open_port");
+      port->ring = 0;
+      return -1;
+    }
+
+  memset (&sll, 0, sizeof (sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons (ETH_P_ALL);
+  if (!(sll.sll_ifindex = if_nametoindex (port->dev)))
+    {
+      perror (port->dev);
+      return -1;
+    }
+  if (bind (fd, (struct sockaddr *) &sll, sizeof (sll)))
+    {
+      perror ("bind(..):sr_afpacket_open_port");
+      return -1;
+    }
+#ifdef PACKET_IGNORE_OUTGOING
+  v = 1;
+  setsockopt (fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &v, sizeof (v));
+#endif
+
+  /* -- the device's address, unless the interface has its own -- */
+  memset (&ifr, 0, sizeof (ifr));
+  snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", port->dev);
+  if (ioctl (fd, SIOCGIFHWADDR, &ifr))
+    {
+      perror ("ioctl(SIOCGIFHWADDR)");
+      return -1;
+    }
+  if (!memcmp (port->iface->addr, "\0\0\0\0\0\0", ETHER_ADDR_LEN))
+    memcpy (port->iface->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+  else if (memcmp (port->iface->addr, ifr.ifr_hwaddr.sa_data,
+		   ETHER_ADDR_LEN))
+    {
+      memset (&mr, 0, sizeof (mr));
+      mr.mr_ifindex = sll.sll_ifindex;
+      mr.mr_type = PACKET_MR_PROMISC;
+      if (setsockopt (fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr,
+		      sizeof (mr)))
+	{
+	  perror ("setsockopt(PACKET_ADD_MEMBERSHIP)");
+	  return -1;
+	}
+    }
+  return 0;
+}
+
+/**
+ * Open the ports of all interfaces
+ */
+static int
+sr_afpacket_open (struct sr_instance *sr)
+{
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i] && sr_afpacket_open_port (sr->io.ports[i]))
+      {
+	fprintf (stderr, "Cannot attach %s to %s\n",
+		 sr->io.ports[i]->iface->name, sr->io.ports[i]->dev);
+	return -1;
+      }
+  return 0;
+}
+
+/**
+ * Hand the filled tx slots of port to the kernel
+ */
+static void
+sr_afpacket_kick (struct sr_io_port *port)
+{
+  if (!port->tx_pending)
+    return;
+  if (sendto (IO_FD (port), 0, 0, MSG_DONTWAIT, 0, 0) == -1
+      && errno != EAGAIN && errno != ENOBUFS)
+    perror ("sendto(..):sr_afpacket_kick");
+  port->tx_pending = 0;
+}
+
+/**
+ * Frames of port are readable: handle every block the kernel returned,
+ * then send what they produced
+ */
+static void
+sr_afpacket_event (struct sr_instance *sr, struct sr_event *ev)
+{
+  struct sr_io_port *port = ((struct sr_io_queue *) ev)->port;
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *hdr;
+  struct sockaddr_ll *sll;
+  uint8_t *frame;
+  uint32_t i, len;
+
+  for (;;)
+    {
+      bd = (struct tpacket_block_desc *) (port->ring
+					  + port->rx_block *
+					  IO_RX_BLOCK_SIZE);
+      if (!(__atomic_load_n (&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+	    & TP_STATUS_USER))
+	break;
+
+      hdr = (struct tpacket3_hdr *) ((uint8_t *) bd
+				     + bd->hdr.bh1.offset_to_first_pkt);
+      for (i = 0; i < bd->hdr.bh1.num_pkts; i++,
+	   hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr
+					  + hdr->tp_next_offset))
+	{
+	  sll = (struct sockaddr_ll *) ((uint8_t *) hdr
+					+ TPACKET_ALIGN (sizeof (*hdr)));
+	  frame = (uint8_t *) hdr + hdr->tp_mac;
+	  len = hdr->tp_snaplen;
+
+	  /* -- our own frames, and frames for other hosts (promiscuous) -- */
+	  if (sll->sll_pkttype == PACKET_OUTGOING
+	      || len < sizeof (struct sr_ethernet_hdr)
+	      || (!(frame[0] & 1)
+		  && memcmp (frame, port->iface->addr, ETHER_ADDR_LEN)))
+	    continue;
+	  port->rx++;
+
+	  sr_log_packet (sr, frame, len);
+	  sr_burst_add (sr, frame, len, port->iface->name);
+	}
+
+      /* -- the frames of the block are handled before it is released -- */
+      sr_burst_handle (sr);
+      __atomic_store_n (&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			__ATOMIC_RELEASE);
+      port->rx_block = (port->rx_block + 1) % IO_RX_BLOCKS;
+    }
+  sr_io_flush (sr);
+}
+
+/**
+ * Watch the sockets of all ports
+ */
+static int
+sr_afpacket_start (struct sr_instance *sr)
+{
+  struct sr_io_port *port;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if ((port = sr->io.ports[i])
+	&& sr_event_add (sr, &port->q[0].ev, IO_FD (port), sr_afpacket_event))
+      return -1;
+  return 0;
+}
+
+/**
+ * Write a frame to the next tx slot of the port of iface; the kernel
+ * sends it at the next flush. Frames larger than a slot are dropped:
+ * with a tx ring, send() only transmits the ring, never its buffer.
+ */
+static int
+sr_afpacket_send (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+		  const char *iface, int headroom)
+{
+  struct sr_io_port *port = sr->io.ports[sr_name_index (iface)];
+  struct tpacket3_hdr *hdr;
+
+  if (!port || IO_FD (port) == -1)
+    {
+      fprintf (stderr, "** Error, interface %s, does not exist\n", iface);
+      return -1;
+    }
+  sr_log_packet (sr, buf, len);
+
+  if (len > IO_FRAME_SIZE - IO_TX_DATA)
+    {
+      port->oversize++;
+      return -1;
+    }
+
+  hdr = (struct tpacket3_hdr *) (port->ring + IO_RX_LEN
+				 + port->tx_frame * IO_FRAME_SIZE);
+  if (__atomic_load_n (&hdr->tp_status, __ATOMIC_ACQUIRE)
+      & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+    {
+      /* -- ring full: give the kernel what is pending, then look again -- */
+      sr_afpacket_kick (port);
+      if (__atomic_load_n (&hdr->tp_status, __ATOMIC_ACQUIRE)
+	  & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+	{
+	  port->drops++;
+	  return -1;
+	}
+    }
+
+  memcpy ((uint8_t *) hdr + IO_TX_DATA, buf, len);
+  hdr->tp_len = len;
+  hdr->tp_snaplen = len;
+  hdr->tp_next_offset = 0;
+  __atomic_store_n (&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+		    __ATOMIC_RELEASE);
+  port->tx_frame = (port->tx_frame + 1) % IO_TX_FRAMES;
+  port->tx++;
+
+  if (++port->tx_pending >= IO_TX_KICK)
+    sr_afpacket_kick (port);
+  return 0;
+}
+
+/**
+ * Send the frames written to the tx rings
+ */
+static int
+sr_afpacket_flush (struct sr_instance *sr)
+{
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i])
+      sr_afpacket_kick (sr->io.ports[i]);
+  return 0;
+}
+
+/**
+ * Print the frames received, sent and dropped per port (SIGUSR1)
+ */
+static void
+sr_afpacket_print_stats (struct sr_instance *sr)
+{
+  struct tpacket_stats_v3 st;
+  struct sr_io_port *port;
+  socklen_t len;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    {
+      if (!(port = sr->io.ports[i]) || IO_FD (port) == -1)
+	continue;
+      len = sizeof (st);
+      if (!getsockopt (IO_FD (port), SOL_PACKET, PACKET_STATISTICS, &st, &len))
+	port->rx_drops += st.tp_drops;
+      printf ("%s (%s): %lu received, %lu dropped (rx ring full), "
+	      "%lu sent, %lu dropped (tx ring full), %lu dropped (larger "
+	      "than a tx slot)\n", port->iface->name, port->dev,
+	      (unsigned long) port->rx, (unsigned long) port->rx_drops,
+	      (unsigned long) port->tx, (unsigned long) port->drops,
+	      (unsigned long) port->oversize);
+    }
+}
+
+/**
+ * Unmap the rings and close the sockets (exit)
+ */
+static void
+sr_afpacket_close (struct sr_instance *sr)
+{
+  struct sr_io_port *port;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    {
+      if (!(port = sr->io.ports[i]))
+	continue;
+      if (port->ring)
+	munmap (port->ring, port->ring_len);
+      if (IO_FD (port) != -1)
+	close (IO_FD (port));
+      port->ring = 0;
+      IO_FD (port) = -1;
+    }
+}
+
+/** the AF_PACKET backend, interfaces come from the interface file */
+const struct sr_io_ops sr_io_packet = {
+  "packet",
+  sr_afpacket_open,
+  sr_afpacket_start,
+  sr_afpacket_send,
+  sr_afpacket_flush,
+  sr_afpacket_print_stats,
+  sr_afpacket_close,
+};
+
+#endif /* _LINUX_ */
@@ -3,122 +3,422 @@
  */
 #include <assert.h>
 #include <arpa/inet.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "sr_rt.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
+
+static const char *sr_arp_state_names[] = {
+  "incomplete", "reachable", "stale", "probe", "failed"
+};
+
+static void sr_arp_expire (struct sr_instance *, struct sr_timer *);
+static void sr_arp_timer_free (struct sr_timer *);
+static void sr_arp_send_request (struct sr_instance *, uint32_t,
+				 struct sr_if *, const unsigned char *);
+
 /*---------------------------------------------------------------------------*/
 /**
- * Check age of ARP table, broadcast request if stale
+ * Allocate an empty ARP table of size slots (rounded up to a power of two)
  */
 void
-sr_arp_check_age (struct sr_instance *sr)
+sr_arp_init (struct sr_instance *sr, uint32_t size)
 {
-  time_t t, age, refreshage;
-  int i;
-  struct sr_arp_entry *entry;
+  struct sr_arp_table *t;
 
   assert (sr);
 
-  refreshage = time (&t) - sr->arp_last_reftime;
+  t = &sr->arp_table;
+  for (t->size = 16; t->size < size; t->size *= 2)
+    ;
+  t->entries = (struct sr_arp_entry *)
+    calloc (t->size, sizeof (struct sr_arp_entry));
+  assert (t->entries);
+  t->count = 0;
+  t->tx_tokens = ARP_TX_BURST;
+  t->tx_last = sr_timer_ticks () * TIMER_TICK_MS;
+}
+
+/**
+ * Free the ARP table and its pending events
+ */
+void
+sr_arp_clear (struct sr_instance *sr)
+{
+  assert (sr);
+
+  sr_timer_del_all (&sr->timers, sr_arp_expire, sr_arp_timer_free);
+  free (sr->arp_table.entries);
+  sr->arp_table.entries = 0;
+  sr->arp_table.size = sr->arp_table.count = 0;
+}
+
+/** home slot of an IP address */
+static inline uint32_t
+sr_arp_hash (const struct sr_arp_table *t, uint32_t ip)
+{
+  return (ip * 2654435761u) >> (32 - __builtin_ctz (t->size));
+}
+
+/**
+ * Double the number of slots and insert the entries again
+ */
+static void
+sr_arp_grow (struct sr_instance *sr)
+{
+  struct sr_arp_table *t = &sr->arp_table;
+  struct sr_arp_entry *old = t->entries;
+  uint32_t i, j, size = t->size;
+
+  t->size *= 2;
+  t->entries = (struct sr_arp_entry *)
+    calloc (t->size, sizeof (struct sr_arp_entry));
+  assert (t->entries);
+
+  for (i = 0; i < size; i++)
+    {
+      if (!old[i].ip)
+	continue;
+      for (j = sr_arp_hash (t, old[i].ip); t->entries[j].ip;
+	   j = (j + 1) & (t->size - 1))
+	;
+      t->entries[j] = old[i];
+    }
+  free (old);
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+ * Send a request for an entry, unicast to its known address in
+ * ARP_PROBE state. Requests are limited to ARP_TX_RATE per second
+ * (bursts of ARP_TX_BURST) over all neighbours; a request over the limit
+ * is skipped, the next retry of the entry sends it.
+ */
+static void
+sr_arp_request (struct sr_instance *sr, struct sr_arp_entry *entry)
+{
+  struct sr_arp_table *t = &sr->arp_table;
+  uint64_t now = sr_timer_ticks () * TIMER_TICK_MS;
+  uint64_t refill;
+
+  refill = (now - t->tx_last) * ARP_TX_RATE / 1000;
+  if (refill)
+    {
+      t->tx_tokens = refill + t->tx_tokens > ARP_TX_BURST ?
+	ARP_TX_BURST : t->tx_tokens + refill;
+      t->tx_last = now;
+    }
+  if (!t->tx_tokens)
+    {
+      t->stats.limited++;
+      return;
+    }
+  t->tx_tokens--;
+  t->stats.requests++;
+  sr_arp_send_request (sr, entry->ip, sr->interfaces[entry->ifidx],
+		       entry->state == ARP_PROBE ? entry->mac : 0);
+}
+
+/** drop the packets waiting for an entry */
+static void
+sr_arp_drop_queue (struct sr_instance *sr, struct sr_arp_entry *entry)
+{
+  struct sr_buf_entry *item, *next;
+
+  for (item = sr_buf_detach (sr, entry); item; item = next)
+    {
+      next = item->next;
+      Debug ("ARP: neighbour gone - dropping queued packet\n");
+      sr_buf_remove (sr, item, BUF_DROP_NEIGH);
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+ * Timer event of an ARP entry, moving it through its states:
+ *
+ * INCOMPLETE, PROBE: retry the request, ARP_RETRY_MS after the first
+ *   and doubling after each; FAILED once ARP_MAX_TRIES got no reply.
+ * REACHABLE: STALE ARP_TTL after the last reply. Packets still use a
+ *   stale entry; the first one sent moves it to PROBE.
+ * STALE: removed if it was not used for ARP_GC_TIME.
+ * FAILED: packets to it get a host unreachable for ARP_FAILED_HOLD, then
+ *   it is removed.
+ *
+ * An entry set again since the event was scheduled is not due yet.
+ */
+static void
+sr_arp_expire (struct sr_instance *sr, struct sr_timer *t)
+{
+  struct sr_arp_timer *at = sr_timer_entry (t, struct sr_arp_timer, timer);
+  struct sr_arp_entry *entry;
+  uint32_t i, age;
 
+  entry = sr_arp_get (sr, at->ip);
+  if (entry->ip != at->ip || entry->serial != at->serial)
+    {
+      free (at);
+      return;
+    }
 
-  if (refreshage >= ARP_CHECK_EVERY)
+  i = entry - sr->arp_table.entries;
+  switch (entry->state)
     {
-      for (i = 0; i < ARP_MAX_ENTRIES; i++)
+    case ARP_REACHABLE:
+      age = time (0) - entry->created;
+      if (age < ARP_TTL)
 	{
-	  entry = &sr->arp_table[i];
-	  if (!entry->ip)
-	    continue;
+	  sr_timer_add (&sr->timers, t, sr_arp_expire,
+			(ARP_TTL - age) * 1000);
+	  return;
+	}
+      entry->state = ARP_STALE;
+      sr_dcache_arp_changed (sr);
+      sr_timer_add (&sr->timers, t, sr_arp_expire, ARP_GC_TIME * 1000);
+      return;
 
-	  age = t - entry->created;
-	  printf ("ARP: Entry %i is %lds old (ttl %ds)\n", i, age, ARP_TTL);
-	  if (age <= ARP_TTL)
-	    continue;
+    case ARP_INCOMPLETE:
+    case ARP_PROBE:
+      if (entry->tries < ARP_MAX_TRIES)
+	{
+	  sr_arp_request (sr, entry);
+	  sr_timer_add (&sr->timers, t, sr_arp_expire,
+			ARP_RETRY_MS << entry->tries++);
+	  return;
+	}
+      printf ("ARP: No reply from ");
+      sr_arp_print_entry (i, *entry);
+      entry->state = ARP_FAILED;
+      sr->arp_table.stats.failed++;
+      sr_dcache_arp_changed (sr);
+      sr_arp_drop_queue (sr, entry);
+      sr_timer_add (&sr->timers, t, sr_arp_expire, ARP_FAILED_HOLD * 1000);
+      return;
 
-	  printf ("ARP: Updating ");
-	  sr_arp_print_entry (i, *entry);
+    default:
+      printf ("ARP: Removing ");
+      sr_arp_print_entry (i, *entry);
+      sr_arp_remove (sr, entry->ip);
+      free (at);
+    }
+}
+
+static void
+sr_arp_timer_free (struct sr_timer *t)
+{
+  free (sr_timer_entry (t, struct sr_arp_timer, timer));
+}
+
+/**
+ * schedule the next event of entry in ms milliseconds, superseding the
+ * events scheduled before
+ */
+static void
+sr_arp_schedule (struct sr_instance *sr, struct sr_arp_entry *entry,
+		 uint32_t ms)
+{
+  struct sr_arp_timer *at;
+
+  at = (struct sr_arp_timer *) calloc (1, sizeof (struct sr_arp_timer));
+  assert (at);
+  entry->serial = ++sr->arp_table.serial;
+  at->ip = entry->ip;
+  at->serial = entry->serial;
+  sr_timer_add (&sr->timers, &at->timer, sr_arp_expire, ms);
+}
 
-	  entry->tries++;
-	  sr_arp_refresh (sr, entry->ip, entry->iface->name);
+/**
+ * slot of ip, inserted (with only the IP set) if it has no entry; keeps
+ * the table at most half full
+ */
+static struct sr_arp_entry *
+sr_arp_insert (struct sr_instance *sr, uint32_t ip)
+{
+  struct sr_arp_entry *entry;
+
+  entry = sr_arp_get (sr, ip);
+  if (!entry->ip)
+    {
+      if (2 * (sr->arp_table.count + 1) > sr->arp_table.size)
+	{
+	  sr_arp_grow (sr);
+	  entry = sr_arp_get (sr, ip);
 	}
-      sr->arp_last_reftime = t;
+      sr->arp_table.count++;
+      entry->ip = ip;
     }
+  return entry;
 }
 
 /*---------------------------------------------------------------------------*/
 /** 
     arp setter 
-    set an arp entry given IP and MAC address
+    set an arp entry given IP and MAC address, reachable. Packets queued
+    on the entry stay queued, for the caller to send.
 */
 struct sr_arp_entry *
 sr_arp_set (struct sr_instance *sr, uint32_t ip, unsigned char *mac,
 	    struct sr_if *iface)
 {
-  struct sr_arp_entry *entry = sr_arp_get (sr, ip);
-  struct in_addr n;
+  struct sr_arp_entry *entry;
+  int reachable;
 
   assert (sr);
   assert (ip);
   assert (mac);
   assert (iface);
 
-  memset (entry, 0, sizeof (struct sr_arp_entry));
-  entry->ip = ip;
-  if (mac)
-    {
-      memcpy (entry->mac, mac, ETHER_ADDR_LEN);
-    }
-  entry->iface = iface;
+  entry = sr_arp_insert (sr, ip);
+  reachable = entry->state == ARP_REACHABLE;
+  if (!reachable)
+    sr->arp_table.stats.resolved++;
+
+  memcpy (entry->mac, mac, ETHER_ADDR_LEN);
+  entry->ifidx = sr_name_index (iface->name);
   entry->tries = 0;
-  time (&entry->created);
+  entry->created = time (0);
+  entry->state = ARP_REACHABLE;
+  sr_dcache_arp_changed (sr);
 
-  n.s_addr = entry->ip;
-  printf ("ARP: Created entry %s\n", inet_ntoa (n));
+  /* -- the pending event of a reachable entry finds it set again -- */
+  if (!reachable)
+    sr_arp_schedule (sr, entry, ARP_TTL * 1000);
+
+#ifdef _DEBUG_
+  Debug ("ARP: Created entry %s\n",
+	 inet_ntoa (*(struct in_addr *) &entry->ip));
   sr_arp_print_table (sr);
+#endif
 
   return entry;
 }
 
 /*---------------------------------------------------------------------------*/
 /**
-    Get entries. Indices based on max. no. of ARP entries (ARP_MAX_ENTRIES)
+    Entry of a neighbour packets are about to be queued on: an existing
+    entry, or a new incomplete one, whose request is sent. Further
+    requests are only sent by its retry timer, however many packets
+    wait.
+*/
+/*---------------------------------------------------------------------------*/
+struct sr_arp_entry *
+sr_arp_resolve (struct sr_instance *sr, uint32_t ip, struct sr_if *iface)
+{
+  struct sr_arp_entry *entry;
+
+  assert (sr);
+  assert (ip);
+  assert (iface);
+
+  entry = sr_arp_get (sr, ip);
+  if (entry->ip)
+    return entry;
+
+  entry = sr_arp_insert (sr, ip);
+  entry->ifidx = sr_name_index (iface->name);
+  entry->created = time (0);
+  entry->state = ARP_INCOMPLETE;
+  sr_arp_request (sr, entry);
+  sr_arp_schedule (sr, entry, ARP_RETRY_MS << entry->tries++);
+  return entry;
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+    A packet is sent using a stale entry: check the neighbour is still
+    there with unicast requests, still sending to it meanwhile.
+*/
+/*---------------------------------------------------------------------------*/
+void
+sr_arp_probe (struct sr_instance *sr, struct sr_arp_entry *entry)
+{
+  assert (sr);
+  assert (entry);
+
+  if (entry->state != ARP_STALE)
+    return;
+  entry->state = ARP_PROBE;
+  entry->tries = 0;
+  sr_arp_request (sr, entry);
+  sr_arp_schedule (sr, entry, ARP_RETRY_MS << entry->tries++);
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+    Get the entry of an IP, or the empty slot where it would be inserted
+    (ip is 0) if it has none. The pointer is valid until the next change
+    of the table.
 */
 /*---------------------------------------------------------------------------*/
 struct sr_arp_entry *
 sr_arp_get (struct sr_instance *sr, uint32_t ip)
 {
-  int i;
+  struct sr_arp_table *t;
   struct sr_arp_entry *entry;
+  uint32_t i;
 
   assert (sr);
   assert (ip);
 
-  /* scan table for entries */
-  for (i = 0; i < ARP_MAX_ENTRIES; i++)
+  /* probe from the home slot to the entry or the first empty slot */
+  t = &sr->arp_table;
+  for (i = sr_arp_hash (t, ip);; i = (i + 1) & (t->size - 1))
     {
-      entry = &sr->arp_table[i];
+      entry = &t->entries[i];
       if (entry->ip == ip || entry->ip == 0)
 	return entry;
     }
-  return NULL;
 }
 
 /*---------------------------------------------------------------------------*/
 /**
-    Refresh ARP table
+    Remove the entry of an IP. The entries after it in the probe sequence
+    are shifted back, so no deleted markers are needed. Packets still
+    queued on the entry are dropped.
+*/
+/*---------------------------------------------------------------------------*/
+void
+sr_arp_remove (struct sr_instance *sr, uint32_t ip)
+{
+  struct sr_arp_table *t;
+  uint32_t i, j, home, mask;
+
+  assert (sr);
+  assert (ip);
+
+  t = &sr->arp_table;
+  mask = t->size - 1;
+  i = sr_arp_get (sr, ip) - t->entries;
+  if (!t->entries[i].ip)
+    return;
+
+  sr_arp_drop_queue (sr, &t->entries[i]);
+
+  for (j = (i + 1) & mask; t->entries[j].ip; j = (j + 1) & mask)
+    {
+      /* -- move entry j to the hole unless its home is after the hole -- */
+      home = sr_arp_hash (t, t->entries[j].ip);
+      if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	  t->entries[i] = t->entries[j];
+	  i = j;
+	}
+    }
+  memset (&t->entries[i], 0, sizeof (struct sr_arp_entry));
+  t->count--;
+  sr_dcache_arp_changed (sr);
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+    Broadcast a request for ip on the named interface
 */
 /*---------------------------------------------------------------------------*/
 void
 sr_arp_refresh (struct sr_instance *sr, uint32_t ip, char *interface)
 {
-  int i;
-  struct sr_arp_entry *entry;
-  uint8_t packet[sizeof (struct sr_ethernet_hdr) + sizeof (struct sr_arphdr)];
-  struct sr_ethernet_hdr *e_hdr = (struct sr_ethernet_hdr *) packet;
-  struct sr_arphdr *a_hdr =
-    (struct sr_arphdr *) (packet + sizeof (struct sr_ethernet_hdr));
   struct sr_if *iface = sr_find_interface (sr, interface);
 
   assert (sr);
@@ -130,17 +430,32 @@ sr_arp_refresh (struct sr_instance *sr, uint32_t ip, char *interface)
 	      interface);
       return;
     }
+  sr_arp_send_request (sr, ip, iface, 0);
+}
+
+/**
+ * Send a request for ip on iface, to dmac or broadcast if dmac is 0
+ */
+static void
+sr_arp_send_request (struct sr_instance *sr, uint32_t ip,
+		     struct sr_if *iface, const unsigned char *dmac)
+{
+  int i;
+  uint8_t packet[sizeof (struct sr_ethernet_hdr) + sizeof (struct sr_arphdr)];
+  struct sr_ethernet_hdr *e_hdr = (struct sr_ethernet_hdr *) packet;
+  struct sr_arphdr *a_hdr =
+    (struct sr_arphdr *) (packet + sizeof (struct sr_ethernet_hdr));
 
-  /* ethernet header for broadcast */
+  /* ethernet header, broadcast unless probing a known neighbour */
   memset ((void *) packet, 0, sizeof (packet));
   for (i = 0; i < ETHER_ADDR_LEN; i++)
     {
-      e_hdr->ether_dhost[i] = 0xFF;
+      e_hdr->ether_dhost[i] = dmac ? dmac[i] : 0xFF;
       e_hdr->ether_shost[i] = iface->addr[i];
     }
   e_hdr->ether_type = htons (ETHERTYPE_ARP);
 
-  /* arp message for broadcast */
+  /* arp message */
   a_hdr->ar_hrd = htons (ARPHDR_ETHER);
   a_hdr->ar_pro = htons (ETHERTYPE_IP);
   a_hdr->ar_hln = ETHER_ADDR_LEN;
@@ -148,14 +463,11 @@ sr_arp_refresh (struct sr_instance *sr, uint32_t ip, char *interface)
   a_hdr->ar_op = htons (ARP_REQUEST);
   memcpy (a_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
   a_hdr->ar_sip = iface->ip;
-  memcpy (a_hdr->ar_tha, sr_arp_get (sr, ip), ETHER_ADDR_LEN);
+  /* target hardware address left zero */
   a_hdr->ar_tip = ip;
 
-  /* make an arp entry */
-  entry = sr_arp_get (sr, ip);
-  
   /* send the packet on the interface */
-  sr_send_packet (sr, packet, sizeof (packet), interface);
+  sr_send_packet (sr, packet, sizeof (packet), iface->name);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -239,13 +551,13 @@ sr_arp_scan (struct sr_instance *sr)
 void
 sr_arp_print_table (struct sr_instance *sr)
 {
-  int i;
-  printf ("ARP: Current arp entries out of a total of %d:\n",
-	  ARP_MAX_ENTRIES);
-  for (i = 0; i < ARP_MAX_ENTRIES; i++)
+  uint32_t i;
+  printf ("ARP: Current arp entries %u out of a total of %u:\n",
+	  sr->arp_table.count, sr->arp_table.size);
+  for (i = 0; i < sr->arp_table.size; i++)
     {
-      if (sr->arp_table[i].ip)
-	sr_arp_print_entry (i, sr->arp_table[i]);
+      if (sr->arp_table.entries[i].ip)
+	sr_arp_print_entry (i, sr->arp_table.entries[i]);
     }
   printf ("ARP: End of arp table.\n");
 }
@@ -259,14 +571,31 @@ sr_arp_print_table (struct sr_instance *sr)
 void
 sr_arp_print_entry (int i, struct sr_arp_entry entry)
 {
-  time_t t, age;
+  time_t t, age, created = entry.created;
   struct in_addr pr_ip;
 
   pr_ip.s_addr = entry.ip;
-  age = time (&t) - entry.created;
+  age = time (&t) - created;
 
   printf ("ARP: table entry %d ip %s mac ", i, inet_ntoa (pr_ip));
   DebugMAC (entry.mac);
-  printf (" tries %d age %lds created %s ", entry.tries, age,
-	  ctime (&entry.created));
+  printf (" %s queued %u tries %d age %lds created %s ",
+	  entry.state <= ARP_FAILED ? sr_arp_state_names[entry.state] : "?",
+	  entry.npending, entry.tries, age, ctime (&created));
+}
+
+/*---------------------------------------------------------------------------*/
+/**
+ * print the ARP counters (SIGUSR1)
+ */
+/*---------------------------------------------------------------------------*/
+void
+sr_arp_print_stats (struct sr_instance *sr)
+{
+  struct sr_arp_table *t = &sr->arp_table;
+
+  printf ("ARP: %u entries, %lu requests sent, %lu rate limited, "
+	  "%lu resolved, %lu failed\n", t->count,
+	  (unsigned long) t->stats.requests, (unsigned long) t->stats.limited,
+	  (unsigned long) t->stats.resolved, (unsigned long) t->stats.failed);
 }
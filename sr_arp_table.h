@@ -8,28 +8,96 @@
 #include <stdint.h>
 #include "sr_protocol.h"
 #include "sr_if.h"
+#include "sr_timer.h"
 
-/** data structure for an arp entry */
+struct sr_buf_entry;
+
+/** Resolution state of an ARP entry (see sr_arp_expire) */
+#define ARP_INCOMPLETE 0	/** request sent, no reply yet (mac unknown) */
+#define ARP_REACHABLE 1		/** replied less than ARP_TTL ago */
+#define ARP_STALE 2		/** usable, confirmed on its next use */
+#define ARP_PROBE 3		/** usable, unicast requests sent */
+#define ARP_FAILED 4		/** no reply to ARP_MAX_TRIES requests */
+
+/**
+ * data structure for an arp entry, 32 bytes: 2 per cache line. Packets
+ * waiting for the neighbour are queued on its entry (see sr_buf.c); they
+ * do not point back to it, so the entry can move in the table.
+ */
 struct sr_arp_entry
 {
-  uint32_t ip;
+  uint32_t ip;			/** 0 if the slot is empty */
   unsigned char mac[ETHER_ADDR_LEN];
-  struct sr_if *iface;
+  uint8_t ifidx;		/** index of the interface in sr->interfaces */
   uint8_t tries;
-  time_t created;
+  uint32_t created;
+  uint8_t state;
+  uint16_t npending;		/** packets queued */
+  uint32_t serial;		/** serial of its current event */
+  struct sr_buf_entry *pending;	/** oldest packet queued, 0 if none */
+};
+
+/**
+ * ARP table: open addressing hash table keyed by IP with linear probing,
+ * grown to keep it at most half full
+ */
+struct sr_arp_table
+{
+  struct sr_arp_entry *entries;
+  uint32_t size;		/** number of slots, a power of two */
+  uint32_t count;		/** entries in use */
+  uint32_t serial;		/** serial of the last event scheduled */
+  uint32_t tx_tokens;		/** requests that may be sent now */
+  uint64_t tx_last;		/** ms of the last token refill */
+  struct
+  {
+    uint64_t requests;		/** requests sent */
+    uint64_t limited;		/** requests skipped by the rate limit */
+    uint64_t resolved;		/** entries that became reachable */
+    uint64_t failed;		/** entries that became failed */
+  } stats;
+};
+
+/** the entry has an address packets can be sent to */
+static inline int
+sr_arp_usable (const struct sr_arp_entry *entry)
+{
+  return entry->state >= ARP_REACHABLE && entry->state <= ARP_PROBE;
+}
+
+/**
+ * timer event of an ARP entry. Entries move in the table, so the event
+ * names the entry by IP and serial and is checked against it when it
+ * fires: it is dropped if the entry was removed or got a newer event.
+ */
+struct sr_arp_timer
+{
+  struct sr_timer timer;
+  uint32_t ip;
+  uint32_t serial;		/** serial of the entry */
 };
 
 /** Bitmask to get index from IP */
 #define ARP_MASK 0xFF
 
-/** Changes size of ARP table in interface */
+/** Number of interfaces (indexed by sr_name_index) */
 #define ARP_MAX_ENTRIES (ARP_MASK+1)
 
-/** TTL for a single ARP entry*/
+/** Initial number of slots of the ARP table (-A) */
+#define ARP_TABLE_SIZE 1024
+
+/** TTL for a single ARP entry (reachable time) */
 #define ARP_TTL 60
-/** time to wait between successive ARP checks */
-#define ARP_CHECK_EVERY 10
+/** time to wait for the first reply, doubled after each request (ms) */
+#define ARP_RETRY_MS 500
 /** Try these many times for ARP before giving up */
 #define ARP_MAX_TRIES 5
+/** time failed entries are kept, answering packets with unreachables */
+#define ARP_FAILED_HOLD 20
+/** time before an unused stale entry is removed */
+#define ARP_GC_TIME 60
+/** ARP requests sent per second at most, over all neighbours */
+#define ARP_TX_RATE 100
+#define ARP_TX_BURST 20
 
 #endif
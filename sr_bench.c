@@ -0,0 +1,250 @@
+/**
+ * Benchmarks for the router's lookup paths, built and run by 'make bench'.
+ * Lookups are measured on a static table and under route churn.
+ *
+ * A synthetic routing table is generated with a prefix length distribution
+ * close to a backbone table (mostly /24, /16 to /23 next, a few longer and
+ * shorter prefixes) and looked up with addresses half of which fall in a
+ * configured prefix.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sr_rt.h"
+#include "sr_fib.h"
+
+#define BENCH_ROUTES 100000
+#define BENCH_ADDRS (1 << 20)
+#define BENCH_ROUNDS 8
+
+static uint32_t
+bench_random (void)
+{
+  return ((uint32_t) random () << 16) ^ (uint32_t) random ();
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** prefix length drawn from a backbone-like distribution */
+static int
+bench_prefix_len (void)
+{
+  int r = random () % 100;
+
+  if (r < 55)
+    return 24;
+  if (r < 90)
+    return 16 + random () % 8;
+  if (r < 97)
+    return 25 + random () % 8;
+  return 8 + random () % 8;
+}
+
+/** synthetic routing table list, the first entry is a default route */
+static struct sr_rt *
+bench_routes (int n)
+{
+  struct sr_rt *list = 0, *r;
+  uint32_t mask;
+  int i, len;
+
+  for (i = 0; i < n; i++)
+    {
+      r = (struct sr_rt *) calloc (1, sizeof (struct sr_rt));
+      len = i == n - 1 ? 0 : bench_prefix_len ();
+      mask = len ? 0xFFFFFFFF << (32 - len) : 0;
+      r->mask.s_addr = htonl (mask);
+      r->dest.s_addr = htonl (bench_random () & mask);
+      r->gw.s_addr = htonl (bench_random ());
+      snprintf (r->interface, sr_IFACE_NAMELEN, "eth%d", i % 4);
+      r->ifidx = i % 4;
+      r->next = list;
+      list = r;
+    }
+  return list;
+}
+
+/** destinations in network byte order, half of them inside a route */
+static uint32_t *
+bench_addrs (struct sr_rt *list, int nroutes, int n)
+{
+  struct sr_rt **routes, *r;
+  uint32_t *addrs;
+  int i;
+
+  routes = (struct sr_rt **) malloc (nroutes * sizeof (struct sr_rt *));
+  for (r = list, i = 0; r; r = r->next)
+    routes[i++] = r;
+
+  addrs = (uint32_t *) malloc (n * sizeof (uint32_t));
+  for (i = 0; i < n; i++)
+    {
+      r = routes[random () % nroutes];
+      if (i & 1)
+	addrs[i] = htonl (bench_random ());
+      else
+	addrs[i] = r->dest.s_addr | (htonl (bench_random ()) & ~r->mask.s_addr);
+    }
+  free (routes);
+  return addrs;
+}
+
+/**
+ * lookups per second of sr_fib_lookup and of sr_fib_lookup_batch for
+ * batch sizes 1 to FIB_BATCH_MAX
+ */
+static void
+bench_lookup (struct sr_fib *fib, const uint32_t *addrs, int n)
+{
+  struct sr_rt *out[FIB_BATCH_MAX];
+  uintptr_t sink = 0;
+  double start, elapsed;
+  int i, round, batch;
+
+  start = bench_now ();
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    for (i = 0; i < n; i++)
+      sink += (uintptr_t) sr_fib_lookup (fib, addrs[i]);
+  elapsed = bench_now () - start;
+  printf ("%-6s single     %8.2f Mlookups/s\n",
+	  sr_fib_type_name (fib->type),
+	  (double) n * BENCH_ROUNDS / elapsed / 1e6);
+
+  for (batch = 1; batch <= FIB_BATCH_MAX; batch *= 2)
+    {
+      start = bench_now ();
+      for (round = 0; round < BENCH_ROUNDS; round++)
+	for (i = 0; i + batch <= n; i += batch)
+	  {
+	    sr_fib_lookup_batch (fib, &addrs[i], out, batch);
+	    sink += (uintptr_t) out[batch - 1];
+	  }
+      elapsed = bench_now () - start;
+      printf ("%-6s batch %3d  %8.2f Mlookups/s\n",
+	      sr_fib_type_name (fib->type), batch,
+	      (double) (n / batch) * batch * BENCH_ROUNDS / elapsed / 1e6);
+    }
+
+  if (sink == 1)
+    printf ("\n");
+}
+
+/**
+ * route churn: each round withdraws a random route, announces it again
+ * and then does lookups_per_update lookups; reports the update rate and
+ * the lookup rate while the table changes
+ */
+static void
+bench_churn (struct sr_rt *list, int nroutes, const uint32_t *addrs, int n,
+	     int type, int lookups_per_update)
+{
+  struct sr_rt **routes, *r;
+  struct sr_fib *fib;
+  uintptr_t sink = 0;
+  double start, t_update = 0, t_lookup = 0;
+  int i, j, round, rounds = BENCH_ROUNDS * n / lookups_per_update / 4;
+
+  routes = (struct sr_rt **) malloc (nroutes * sizeof (struct sr_rt *));
+  for (r = list, i = 0; r; r = r->next)
+    routes[i++] = r;
+
+  fib = sr_fib_build (list, type);
+  for (round = 0, j = 0; round < rounds; round++)
+    {
+      r = routes[random () % nroutes];
+      start = bench_now ();
+      if (sr_fib_delete (fib, r->dest, r->mask))
+	sr_fib_insert (fib, r);
+      t_update += bench_now () - start;
+
+      start = bench_now ();
+      for (i = 0; i < lookups_per_update; i++, j = (j + 1) % n)
+	sink += (uintptr_t) sr_fib_lookup (fib, addrs[j]);
+      t_lookup += bench_now () - start;
+    }
+  printf ("%-6s churn      %8.2f Kupdates/s %8.2f Mlookups/s "
+	  "(%d lookups/update) %lu KB\n",
+	  sr_fib_type_name (type), 2.0 * rounds / t_update / 1e3,
+	  (double) rounds * lookups_per_update / t_lookup / 1e6,
+	  lookups_per_update, (unsigned long) (sr_fib_memory (fib) >> 10));
+
+  if (sink == 1)
+    printf ("\n");
+  sr_fib_free (fib);
+  free (routes);
+}
+
+static void
+usage (char *argv0)
+{
+  printf ("Format: %s [-n routes] [-a addresses] [-c lookups/update] "
+	  "[-s seed]\n", argv0);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sr_rt *list;
+  struct sr_fib *fib;
+  uint32_t *addrs;
+  int nroutes = BENCH_ROUTES, naddrs = BENCH_ADDRS, seed = 1;
+  int lookups_per_update = 256;
+  int c, type;
+  double start;
+
+  while ((c = getopt (argc, argv, "hn:a:c:s:")) != EOF)
+    {
+      switch (c)
+	{
+	case 'n':
+	  nroutes = atoi (optarg);
+	  break;
+	case 'a':
+	  naddrs = atoi (optarg);
+	  break;
+	case 'c':
+	  lookups_per_update = atoi (optarg);
+	  break;
+	case 's':
+	  seed = atoi (optarg);
+	  break;
+	default:
+	  usage (argv[0]);
+	  exit (c != 'h');
+	}
+    }
+  if (nroutes < 1 || naddrs < FIB_BATCH_MAX || lookups_per_update < 1)
+    {
+      usage (argv[0]);
+      exit (1);
+    }
+
+  srandom (seed);
+  list = bench_routes (nroutes);
+  addrs = bench_addrs (list, nroutes, naddrs);
+
+  for (type = FIB_TRIE; type <= FIB_DIR24; type++)
+    {
+      start = bench_now ();
+      fib = sr_fib_build (list, type);
+      printf ("%-6s build %d routes %.1f ms, %lu KB\n",
+	      sr_fib_type_name (type), nroutes, (bench_now () - start) * 1e3,
+	      (unsigned long) (sr_fib_memory (fib) >> 10));
+      bench_lookup (fib, addrs, naddrs);
+      sr_fib_free (fib);
+      bench_churn (list, nroutes, addrs, naddrs, type, lookups_per_update);
+    }
+
+  return 0;
+}
@@ -5,79 +5,348 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "sr_router.h"
 #include "sr_buf.h"
 /**
- * Memory allocation for buffer 
+ * Map an arena for class c, backed by hugepages if possible
  */
+static int
+sr_buf_arena (struct sr_buf *b, struct sr_buf_class *c)
+{
+  struct sr_buf_arena *a = MAP_FAILED;
+  size_t hdr = (sizeof (struct sr_buf_arena) + 63) & ~(size_t) 63;
+
+#ifdef MAP_HUGETLB
+  a = mmap (0, BUF_ARENA_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (a != MAP_FAILED)
+    b->hugepages++;
+#endif
+  if (a == MAP_FAILED)
+    {
+      a = mmap (0, BUF_ARENA_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (a == MAP_FAILED)
+	{
+	  perror ("mmap(..):sr_buf_arena");
+	  return -1;
+	}
+#ifdef MADV_HUGEPAGE
+      madvise (a, BUF_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+
+  a->len = BUF_ARENA_SIZE;
+  a->next = b->arenas;
+  b->arenas = a;
+  c->carve = (char *) a + hdr;
+  c->carve_end = (char *) a + BUF_ARENA_SIZE;
+  c->arenas++;
+  return 0;
+}
 
+/** monotonic clock in microseconds */
+static uint64_t
+sr_buf_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Entry for a packet of len bytes, from the smallest class it fits: the
+ * last released one, else carved from the class arena. O(1), and the
+ * memory is not cleared. 0 if the packet is too large or out of memory.
+ */
 struct sr_buf_entry *
-sr_buf_malloc (struct sr_instance *sr)
+sr_buf_get (struct sr_instance *sr, unsigned int len)
 {
-  struct sr_buf_entry *b;
+  struct sr_buf *b;
+  struct sr_buf_class *c;
+  struct sr_buf_entry *e;
   int i;
 
   assert (sr);
+  b = &sr->buffer;
+
+  for (i = 0; i < BUF_CLASSES && b->classes[i].size < len; i++)
+    ;
+  if (i == BUF_CLASSES)
+    return NULL;
+  c = &b->classes[i];
 
-  for (i = 0; i < BUFFSIZE; i++)
+  if ((e = c->free))
+    c->free = e->next;
+  else
     {
-      b = &sr->buffer.items[i];
-      if (b->h.buffered == 0)
-	{
-	  b->h.raw = sr->buffer.packets[i];
-	  b->h.buffered = 1;
-	  b->pos = i;
-	  return b;
-	}
+      if (c->carve + c->objsize > c->carve_end && sr_buf_arena (b, c))
+	return NULL;
+      e = (struct sr_buf_entry *) c->carve;
+      c->carve += c->objsize;
+      memset (&e->stale, 0, sizeof (struct sr_timer));
     }
-  return NULL;
-}
 
+  e->cls = i;
+  e->h.raw = (uint8_t *) (e + 1) + BUF_HEADROOM;
+  e->h.raw_len = len;
+  e->h.buffered = 0;
+  e->nexthop = 0;
+  e->next = e->prev = 0;
+  c->allocs++;
+  if (++c->in_use > c->high)
+    c->high = c->in_use;
+  return e;
+}
 
-/* free buffer*/
+/**
+ * Release an entry to the free list of its class
+ */
 void
-sr_buf_free (struct sr_instance *sr, struct sr_buf_entry *item)
+sr_buf_put (struct sr_instance *sr, struct sr_buf_entry *item)
 {
+  struct sr_buf_class *c;
+
   assert (sr);
-  memset (&sr->buffer.packets[item->pos], 0, QSIZE + QPADDING);
+  c = &sr->buffer.classes[item->cls];
 
   item->h.buffered = 0;
   item->h.pkt = 0;
   item->h.raw = 0;
-  item->pos = -1;
-  item->next = 0;
+  item->nexthop = 0;
   item->prev = 0;
+  item->next = c->free;
+  c->free = item;
+  c->in_use--;
 }
 
 /**
- * Clear buffer (init and exit)
+ * Clear buffer (init and exit): unmap the arenas. The buffer must be
+ * zeroed before the first call; its capacity, timeout and policy are
+ * kept.
  */
 void
 sr_buf_clear (struct sr_instance *sr)
 {
-  int i;
+  static const uint32_t sizes[BUF_CLASSES] = BUF_CLASS_SIZES;
+  struct sr_buf_arena *a, *next;
+  struct sr_buf_class *c;
+  uint32_t capacity, stale_ms;
+  int i, policy;
+
   assert (sr);
+  for (a = sr->buffer.arenas; a; a = next)
+    {
+      next = a->next;
+      munmap (a, a->len);
+    }
+  capacity = sr->buffer.capacity ? sr->buffer.capacity : BUFFSIZE;
+  stale_ms = sr->buffer.stale_ms ? sr->buffer.stale_ms : STALE_TIMEOUT * 1000;
+  policy = sr->buffer.policy;
   memset (&sr->buffer, 0, sizeof (struct sr_buf));
-  sr->buffer.start = sr->buffer.end = 0;
-  for (i = 0; i < BUFFSIZE; i++)
+  sr->buffer.capacity = capacity;
+  sr->buffer.stale_ms = stale_ms;
+  sr->buffer.policy = policy;
+  for (i = 0; i < BUF_CLASSES; i++)
     {
-      sr->buffer.items[i].pos = -1;
+      c = &sr->buffer.classes[i];
+      c->size = sizes[i];
+      c->objsize = (sizeof (struct sr_buf_entry) + BUF_HEADROOM + c->size
+		    + 63) & ~63;
     }
 }
 
-/** 
- * save a packet to the buffer 
+static const char *sr_buf_policies[] = { "tail", "head", "fair", "red" };
+
+/**
+ * drop policy named name (-d), -1 if unknown
+ */
+int
+sr_buf_policy (const char *name)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    if (!strcmp (name, sr_buf_policies[i]))
+      return i;
+  return -1;
+}
+
+/**
+ * delay (us) under which are at least pct percent of the packets sent,
+ * rounded up to a power of two
+ */
+static uint64_t
+sr_buf_delay_pct (struct sr_buf *b, unsigned int pct)
+{
+  uint64_t total = b->removed[BUF_SENT], n = 0;
+  int i;
+
+  if (!total)
+    return 0;
+  for (i = 0; i < BUF_DELAY_BUCKETS - 1; i++)
+    if ((n += b->delay[i]) * 100 >= total * pct)
+      break;
+  return 1ULL << i;
+}
+
+/**
+ * print occupancy of the buffer pool and overload counters (SIGUSR1)
  */
 void
-sr_buf_add (struct sr_bundle *h)
+sr_buf_print_stats (struct sr_instance *sr)
+{
+  static const char *causes[BUF_CAUSES] = {
+    "sent", "full", "head", "fair", "early", "stale", "neighbour", "nomem"
+  };
+  struct sr_buf *b = &sr->buffer;
+  struct sr_buf_class *c;
+  int i;
+
+  printf ("BUF: %u packets buffered (max %u, %s drop) for %u neighbours, "
+	  "%u arenas on hugepages\n", b->count, b->capacity,
+	  sr_buf_policies[b->policy], b->queues, b->hugepages);
+  printf ("BUF: %lu enqueued;", (unsigned long) b->enqueued);
+  for (i = 0; i < BUF_CAUSES; i++)
+    printf (" %s %lu", causes[i], (unsigned long) b->removed[i]);
+  printf ("\n");
+  printf ("BUF: queueing delay p50 < %luus, p90 < %luus, p99 < %luus, "
+	  "max < %luus\n", (unsigned long) sr_buf_delay_pct (b, 50),
+	  (unsigned long) sr_buf_delay_pct (b, 90),
+	  (unsigned long) sr_buf_delay_pct (b, 99),
+	  (unsigned long) sr_buf_delay_pct (b, 100));
+  for (i = 0; i < BUF_CLASSES; i++)
+    {
+      c = &b->classes[i];
+      printf ("BUF: class %5u: %u in use, high %u, %lu allocated, "
+	      "%u arenas\n", c->size, c->in_use, c->high,
+	      (unsigned long) c->allocs, c->arenas);
+    }
+}
+
+/**
+ * stale timeout of a buffered packet
+ */
+static void
+sr_buf_expire (struct sr_instance *sr, struct sr_timer *t)
+{
+  Debug ("BUF: packet too old - deleting\n");
+  sr_buf_remove (sr, sr_timer_entry (t, struct sr_buf_entry, stale),
+		 BUF_DROP_STALE);
+}
+
+/**
+ * RED: whether to drop an arriving packet early, from the average
+ * occupancy. Between the thresholds the probability grows linearly, and
+ * is spread by the number of packets enqueued since the last drop.
+ */
+static int
+sr_buf_red (struct sr_buf *b)
+{
+  uint32_t min_th = b->capacity * 256 / 4, max_th = b->capacity * 256 * 3 / 4;
+  uint64_t pb;
+
+  /* -- avg += (count - avg) / 2^w, in 1/256 packets -- */
+  b->red_avg = b->red_avg + ((int32_t) (b->count * 256 - b->red_avg)
+			     >> BUF_RED_WSHIFT);
+  if (b->red_avg < min_th)
+    {
+      b->red_count = 0;
+      return 0;
+    }
+  if (b->red_avg >= max_th)
+    return 1;
+
+  /* -- pb in 1/2^16, pa = pb / (1 - count * pb) -- */
+  pb = ((uint64_t) (b->red_avg - min_th) << 16) /
+    ((uint64_t) (max_th - min_th) * BUF_RED_MAXP_INV);
+  if (b->red_count * pb >= 65536
+      || (uint64_t) (rand () & 0xffff) * (65536 - b->red_count * pb) <
+      pb * 65536)
+    return 1;
+  b->red_count++;
+  return 0;
+}
+
+/**
+ * Fair drop: the oldest packet of a neighbour other than nh that holds
+ * more than share packets, 0 if none does. The packets of the neighbours
+ * under their share are skipped, at most share of each.
+ */
+static struct sr_buf_entry *
+sr_buf_over_share (struct sr_instance *sr, struct sr_arp_entry *nh,
+		   uint32_t share)
+{
+  struct sr_buf_entry *i;
+  struct sr_arp_entry *owner;
+
+  for (i = sr->buffer.oldest; i; i = i->newer)
+    {
+      if (!i->nexthop || i->nexthop == nh->ip)
+	continue;
+      owner = sr_arp_get (sr, i->nexthop);
+      if (owner->npending > share)
+	return i;
+    }
+  return 0;
+}
+
+/**
+ * Admit a packet for neighbour nh: make room by the drop policy, or
+ * return the cause for dropping the packet itself.
+ */
+static int
+sr_buf_admit (struct sr_instance *sr, struct sr_arp_entry *nh)
+{
+  struct sr_buf *b = &sr->buffer;
+  struct sr_buf_entry *victim;
+  uint32_t share;
+
+  if (b->policy == BUF_RED && sr_buf_red (b))
+    {
+      b->red_count = 0;
+      return BUF_DROP_EARLY;
+    }
+  if (b->count < b->capacity)
+    return BUF_SENT;
+
+  switch (b->policy)
+    {
+    case BUF_HEAD:
+      sr_buf_remove (sr, b->oldest, BUF_DROP_HEAD);
+      return BUF_SENT;
+    case BUF_FAIR:
+      /* -- the neighbours already queued, and this one -- */
+      share = b->capacity / (b->queues + (nh->pending ? 0 : 1));
+      if (nh->npending >= share)
+	return BUF_DROP_FAIR;
+      if (!(victim = sr_buf_over_share (sr, nh, share)))
+	return BUF_DROP_FAIR;
+      sr_buf_remove (sr, victim, BUF_DROP_FAIR);
+      return BUF_SENT;
+    default:
+      return BUF_DROP_TAIL;
+    }
+}
+
+/**
+ * save a packet to the queue of the neighbour it waits for, if the drop
+ * policy admits it. A packet with a descriptor is queued by reference,
+ * others are copied.
+ */
+void
+sr_buf_add (struct sr_bundle *h, struct sr_arp_entry *nh)
 {
   struct sr_instance *sr;
   struct sr_buf *b;
   struct sr_buf_entry *i;
   uint8_t *raw;
-  struct ip *ip;
+  int cause;
 
   assert (h);
+  assert (nh);
   if (h->buffered)
     {
       Debug ("packet already buffered\n");
@@ -88,75 +357,139 @@ sr_buf_add (struct sr_bundle *h)
   assert (sr);
   b = &sr->buffer;
 
-  i = sr_buf_malloc (sr);
-  raw = i->h.raw;
-  if (!i)
+  if ((cause = sr_buf_admit (sr, nh)) != BUF_SENT)
+    {
+      Debug ("Buffer is full - dropping packet\n");
+      b->removed[cause]++;
+      return;
+    }
+  if (!(i = sr_buf_get (sr, h->raw_len)))
     {
       Debug ("Buffer is out of memory\n");
+      b->removed[BUF_DROP_NOMEM]++;
       return;
     }
+  raw = i->h.raw;
   h->buffered = 1;
   i->h = *h;
   i->h.raw = raw;
   memcpy (i->h.raw, h->raw, h->raw_len);
   i->h.pkt = (struct sr_ip_comb *) i->h.raw;
-  time (&i->created);
-  i->next = 0;
+  b->count++;
+  i->enqueued = sr_buf_now ();
+  sr_timer_add (&sr->timers, &i->stale, sr_buf_expire, b->stale_ms);
+  b->enqueued++;
 
-  ip = &i->h.pkt->ip;
+  /* -- the newest of all buffered packets -- */
+  i->newer = 0;
+  i->older = b->newest;
+  if (b->newest)
+    b->newest->newer = i;
+  else
+    b->oldest = i;
+  b->newest = i;
 
-  /* If this is the only item */
-  if (!b->start)
+  /* -- append to the circular list, the oldest packet is the head -- */
+  i->nexthop = nh->ip;
+  if (!nh->pending)
     {
-      b->start = i;
-      i->prev = 0;
-
-      /* if there are more buffered packets */
+      nh->pending = i;
+      i->next = i->prev = i;
+      b->queues++;
     }
   else
     {
-      b->end->next = i;
-      i->prev = b->end;
+      i->next = nh->pending;
+      i->prev = nh->pending->prev;
+      i->prev->next = i;
+      nh->pending->prev = i;
+    }
+  nh->npending++;
+}
+
+/**
+ * take the packets queued on a neighbour off its entry, as a list ending
+ * with a null next. They still need sr_buf_remove.
+ */
+struct sr_buf_entry *
+sr_buf_detach (struct sr_instance *sr, struct sr_arp_entry *nh)
+{
+  struct sr_buf_entry *head, *i;
+
+  assert (sr);
+  assert (nh);
+
+  head = nh->pending;
+  if (!head)
+    return 0;
+  head->prev->next = 0;
+  for (i = head; i; i = i->next)
+    {
+      i->nexthop = 0;
+      i->prev = 0;
     }
-  /* extend buffer */
-  b->end = i;
+  nh->pending = 0;
+  nh->npending = 0;
+  sr->buffer.queues--;
+  return head;
 }
 
 /** 
- * remove a buffer item from buffer
+ * remove a buffer item from buffer (and from its neighbour's queue),
+ * counting it as sent or dropped for cause
  */
 void
-sr_buf_remove (struct sr_instance *sr, struct sr_buf_entry *item)
+sr_buf_remove (struct sr_instance *sr, struct sr_buf_entry *item, int cause)
 {
-  struct sr_buf_entry *prev, *next, *delitem;
   struct sr_buf *b;
+  struct sr_arp_entry *nh;
+  uint64_t delay;
+  int n;
 
   assert (sr);
+  assert (cause >= 0 && cause < BUF_CAUSES);
   b = &sr->buffer;
 
   if (item)
     {
-      delitem = item;
-      /* if this is not the only item in the list */
-      if (item->next || item->prev)
+      sr_timer_del (&sr->timers, &item->stale);
+      if (item->nexthop)
 	{
-	  if (b->end == item)
-	    b->end = item->prev;
-	  if (b->start == item)
-	    b->start = item->next;
-	  prev = item->prev;
-	  next = item->next;
-	  if (next)
-	    next->prev = prev;
-	  if (prev)
-	    prev->next = next;
-
-	  /* if this is the only item in list */
+	  nh = sr_arp_get (sr, item->nexthop);
+	  assert (nh->ip == item->nexthop);
+	  if (item->next == item)
+	    {
+	      nh->pending = 0;
+	      b->queues--;
+	    }
+	  else
+	    {
+	      item->prev->next = item->next;
+	      item->next->prev = item->prev;
+	      if (nh->pending == item)
+		nh->pending = item->next;
+	    }
+	  nh->npending--;
 	}
+
+      if (item->older)
+	item->older->newer = item->newer;
+      else
+	b->oldest = item->newer;
+      if (item->newer)
+	item->newer->older = item->older;
       else
+	b->newest = item->older;
+
+      b->removed[cause]++;
+      if (cause == BUF_SENT)
 	{
-	  b->end = b->start = 0;
+	  delay = sr_buf_now () - item->enqueued;
+	  for (n = 0; n < BUF_DELAY_BUCKETS - 1 && delay >> n; n++)
+	    ;
+	  b->delay[n]++;
 	}
-      sr_buf_free (sr, delitem);
+      b->count--;
+      sr_buf_put (sr, item);
     }
 }
@@ -5,15 +5,55 @@
 #ifndef SR_BUF_H
 #define SR_BUF_H
 
+#include "sr_timer.h"
+#include "vnscommand.h"
+
 #define QSIZE 11000
 #define QPADDING 16
 
-/** Time before buffered packets become stale*/
+/** Time before buffered packets become stale (default of -e, in s) */
 #define STALE_TIMEOUT 6
 
-/** Buffer size */
+/** Buffer size (packets, default of -b) */
 #define BUFFSIZE 256
 
+/** What to drop when the buffer is full (-d) */
+#define BUF_TAIL 0		/** the arriving packet */
+#define BUF_HEAD 1		/** the oldest packet */
+#define BUF_FAIR 2		/** the arriving packet if its neighbour has
+				   its share of the buffer, else the oldest */
+#define BUF_RED 3		/** early random drops as the average
+				   occupancy grows (RED), then tail drop */
+
+/** RED: drop probability goes from 0 to 1/BUF_RED_MAXP_INV between
+    1/4 and 3/4 of the capacity, averaged with weight 2^-BUF_RED_WSHIFT */
+#define BUF_RED_MAXP_INV 10
+#define BUF_RED_WSHIFT 6
+
+/** Why a packet left the buffer, or was not buffered */
+#define BUF_SENT 0
+#define BUF_DROP_TAIL 1		/** full */
+#define BUF_DROP_HEAD 2		/** evicted as the oldest */
+#define BUF_DROP_FAIR 3		/** neighbour over its share */
+#define BUF_DROP_EARLY 4	/** RED */
+#define BUF_DROP_STALE 5	/** waited longer than the stale timeout */
+#define BUF_DROP_NEIGH 6	/** neighbour did not answer */
+#define BUF_DROP_NOMEM 7	/** too large, or no memory */
+#define BUF_CAUSES 8
+
+/** Queueing delay histogram: bucket n counts delays below 2^n us */
+#define BUF_DELAY_BUCKETS 32
+
+/** Packet size classes of the buffer pool (bytes) */
+#define BUF_CLASSES 4
+#define BUF_CLASS_SIZES { 64, 256, 1536, 9216 }
+
+/** Room left before a packet for the header of the VNS command sending it */
+#define BUF_HEADROOM sizeof (c_packet_header)
+
+/** Memory got from the system at once for a size class */
+#define BUF_ARENA_SIZE (2 << 20)
+
 /**
  * bundled data structure to pass into the sr_ip.c functions
  */
@@ -26,23 +66,77 @@ struct sr_bundle
   unsigned int len;
   struct sr_if *iface;
   uint8_t buffered;
+  struct sr_rt *route;		/** route of route_dst, located in a burst */
+  uint32_t route_dst;		/** 0 if no route was located beforehand */
 };
 
+/**
+ * A buffered packet, queued on the ARP entry of the next hop it waits
+ * for (circular list). The packet is copied right after the entry,
+ * leaving BUF_HEADROOM bytes before it to prepend the command header
+ * when it is sent.
+ */
 struct sr_buf_entry
 {
-  struct sr_bundle h;
-  time_t created;
+  struct sr_bundle h;		/** h.raw points BUF_HEADROOM after the entry */
+  uint64_t enqueued;		/** us */
+  struct sr_timer stale;	/** removes the packet after the timeout */
+  uint32_t nexthop;		/** IP of the neighbour, 0 if not queued */
   struct sr_buf_entry *prev;
-  struct sr_buf_entry *next;
-  int pos;
+  struct sr_buf_entry *next;	/** next free entry of the class if free */
+  struct sr_buf_entry *older;	/** all buffered packets by age */
+  struct sr_buf_entry *newer;
+  uint8_t cls;			/** size class */
+};
+
+/**
+ * Entries of one size class: a free list of released entries, then the
+ * uncarved rest of the last arena
+ */
+struct sr_buf_class
+{
+  uint32_t size;		/** packet bytes */
+  uint32_t objsize;		/** entry, headroom and packet, cache line
+				   aligned */
+  struct sr_buf_entry *free;
+  char *carve;
+  char *carve_end;
+  uint32_t in_use;
+  uint32_t high;		/** high-water mark of in_use */
+  uint32_t arenas;
+  uint64_t allocs;
 };
 
+/** header of an arena, the entries follow it */
+struct sr_buf_arena
+{
+  struct sr_buf_arena *next;
+  size_t len;
+};
+
+/**
+ * Pool of packet descriptors. Arenas are mapped on demand, from hugepages
+ * when the system has them reserved, and never returned before exit.
+ */
 struct sr_buf
 {
-  struct sr_buf_entry items[BUFFSIZE];
-  uint8_t packets[BUFFSIZE][QSIZE];
-  struct sr_buf_entry *start;
-  struct sr_buf_entry *end;
+  struct sr_buf_class classes[BUF_CLASSES];
+  struct sr_buf_arena *arenas;
+  uint32_t count;		/** packets buffered */
+  uint32_t hugepages;		/** arenas backed by hugepages */
+
+  uint32_t capacity;		/** packets buffered at most */
+  uint32_t stale_ms;		/** stale timeout */
+  int policy;			/** BUF_TAIL ... BUF_RED */
+  uint32_t queues;		/** neighbours with packets queued */
+  struct sr_buf_entry *oldest;
+  struct sr_buf_entry *newest;
+  uint32_t red_avg;		/** average count, in 1/256 packets */
+  uint32_t red_count;		/** packets enqueued since the last drop */
+
+  uint64_t enqueued;
+  uint64_t removed[BUF_CAUSES];	/** packets sent or dropped, by cause */
+  uint64_t delay[BUF_DELAY_BUCKETS];	/** delays of the packets sent */
 };
 
 #endif
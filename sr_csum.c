@@ -0,0 +1,362 @@
+/**
+ * Internet checksum routines: a portable 64-bit implementation, SSE2 and
+ * AVX2 versions (x86), and the dispatch between them.
+ *
+ * Partial sums are ones' complement sums of 16-bit words, folded to 16
+ * bits and not inverted; the sum of data in pieces is the partial sum of
+ * each piece given the sum of the ones before, every piece but the last
+ * of even length. sr_csum_fold gives the checksum of a sum.
+ */
+#include <assert.h>
+#include <string.h>
+#include "sr_csum.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+#define CSUM_X86
+#include <immintrin.h>
+#endif
+
+typedef uint64_t (*sr_csum_fn) (const uint8_t *, uint32_t, uint64_t);
+typedef uint64_t (*sr_csum_copy_fn) (uint8_t *, const uint8_t *, uint32_t,
+				     uint64_t);
+
+static const char *sr_csum_names[CSUM_TYPES] = { "scalar", "sse2", "avx2" };
+
+/** fold a 64-bit sum of 16-bit words to 16 bits */
+static inline uint16_t
+sr_csum_fold64 (uint64_t sum)
+{
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t) sum;
+}
+
+/** sum of the last len bytes, fewer than 8; a last odd byte is padded */
+static inline uint64_t
+sr_csum_tail (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  uint32_t w32;
+  uint16_t w16 = 0;
+
+  if (len & 4)
+    {
+      memcpy (&w32, p, 4);
+      sum += w32;
+      p += 4;
+    }
+  if (len & 2)
+    {
+      memcpy (&w16, p, 2);
+      sum += w16;
+      p += 2;
+    }
+  if (len & 1)
+    {
+      w16 = 0;
+      memcpy (&w16, p, 1);
+      sum += w16;
+    }
+  return sum;
+}
+
+/**
+ * Portable: 32-bit words added into a 64-bit sum, which cannot overflow
+ * below 16GB of data, 32 bytes per pass
+ */
+static inline uint64_t
+sr_csum_scalar (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  uint64_t a, b, c, d;
+
+  while (len >= 32)
+    {
+      memcpy (&a, p, 8);
+      memcpy (&b, p + 8, 8);
+      memcpy (&c, p + 16, 8);
+      memcpy (&d, p + 24, 8);
+      sum += (a & 0xFFFFFFFF) + (a >> 32) + (b & 0xFFFFFFFF) + (b >> 32)
+	+ (c & 0xFFFFFFFF) + (c >> 32) + (d & 0xFFFFFFFF) + (d >> 32);
+      p += 32;
+      len -= 32;
+    }
+  while (len >= 8)
+    {
+      memcpy (&a, p, 8);
+      sum += (a & 0xFFFFFFFF) + (a >> 32);
+      p += 8;
+      len -= 8;
+    }
+  return sr_csum_tail (p, len, sum);
+}
+
+static uint64_t
+sr_csum_copy_scalar (uint8_t * dst, const uint8_t * src, uint32_t len,
+		     uint64_t sum)
+{
+  uint64_t a;
+
+  while (len >= 8)
+    {
+      memcpy (&a, src, 8);
+      memcpy (dst, &a, 8);
+      sum += (a & 0xFFFFFFFF) + (a >> 32);
+      src += 8;
+      dst += 8;
+      len -= 8;
+    }
+  memcpy (dst, src, len);
+  return sr_csum_tail (src, len, sum);
+}
+
+static uint64_t
+sr_csum_scalar_fn (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  return sr_csum_scalar (p, len, sum);
+}
+
+#ifdef CSUM_X86
+
+/**
+ * SSE2: 16 bytes per step, their 32-bit words widened into two 64-bit
+ * lanes of the accumulator
+ */
+__attribute__ ((target ("sse2")))
+static uint64_t
+sr_csum_sse2 (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  __m128i zero = _mm_setzero_si128 (), acc = zero, v;
+  uint64_t lanes[2];
+
+  while (len >= 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) p);
+      acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (v, zero));
+      acc = _mm_add_epi64 (acc, _mm_unpackhi_epi32 (v, zero));
+      p += 16;
+      len -= 16;
+    }
+  _mm_storeu_si128 ((__m128i *) lanes, acc);
+  sum += sr_csum_fold64 (lanes[0]);
+  sum += sr_csum_fold64 (lanes[1]);
+  return sr_csum_scalar (p, len, sum);
+}
+
+__attribute__ ((target ("sse2")))
+static uint64_t
+sr_csum_copy_sse2 (uint8_t * dst, const uint8_t * src, uint32_t len,
+		   uint64_t sum)
+{
+  __m128i zero = _mm_setzero_si128 (), acc = zero, v;
+  uint64_t lanes[2];
+
+  while (len >= 16)
+    {
+      v = _mm_loadu_si128 ((const __m128i *) src);
+      _mm_storeu_si128 ((__m128i *) dst, v);
+      acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (v, zero));
+      acc = _mm_add_epi64 (acc, _mm_unpackhi_epi32 (v, zero));
+      src += 16;
+      dst += 16;
+      len -= 16;
+    }
+  _mm_storeu_si128 ((__m128i *) lanes, acc);
+  sum += sr_csum_fold64 (lanes[0]);
+  sum += sr_csum_fold64 (lanes[1]);
+  return sr_csum_copy_scalar (dst, src, len, sum);
+}
+
+/**
+ * AVX2: 64 bytes per step into two accumulators of four 64-bit lanes
+ */
+__attribute__ ((target ("avx2")))
+static uint64_t
+sr_csum_avx2 (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  __m256i zero = _mm256_setzero_si256 (), acc0 = zero, acc1 = zero, v, w;
+  uint64_t lanes[4];
+
+  while (len >= 64)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) p);
+      w = _mm256_loadu_si256 ((const __m256i *) (p + 32));
+      acc0 = _mm256_add_epi64 (acc0, _mm256_unpacklo_epi32 (v, zero));
+      acc1 = _mm256_add_epi64 (acc1, _mm256_unpackhi_epi32 (v, zero));
+      acc0 = _mm256_add_epi64 (acc0, _mm256_unpacklo_epi32 (w, zero));
+      acc1 = _mm256_add_epi64 (acc1, _mm256_unpackhi_epi32 (w, zero));
+      p += 64;
+      len -= 64;
+    }
+  if (len >= 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) p);
+      acc0 = _mm256_add_epi64 (acc0, _mm256_unpacklo_epi32 (v, zero));
+      acc1 = _mm256_add_epi64 (acc1, _mm256_unpackhi_epi32 (v, zero));
+      p += 32;
+      len -= 32;
+    }
+  _mm256_storeu_si256 ((__m256i *) lanes, _mm256_add_epi64 (acc0, acc1));
+  sum += sr_csum_fold64 (lanes[0]) + sr_csum_fold64 (lanes[1])
+    + sr_csum_fold64 (lanes[2]) + sr_csum_fold64 (lanes[3]);
+  return sr_csum_scalar (p, len, sum);
+}
+
+__attribute__ ((target ("avx2")))
+static uint64_t
+sr_csum_copy_avx2 (uint8_t * dst, const uint8_t * src, uint32_t len,
+		   uint64_t sum)
+{
+  __m256i zero = _mm256_setzero_si256 (), acc = zero, v;
+  uint64_t lanes[4];
+
+  while (len >= 32)
+    {
+      v = _mm256_loadu_si256 ((const __m256i *) src);
+      _mm256_storeu_si256 ((__m256i *) dst, v);
+      acc = _mm256_add_epi64 (acc, _mm256_unpacklo_epi32 (v, zero));
+      acc = _mm256_add_epi64 (acc, _mm256_unpackhi_epi32 (v, zero));
+      src += 32;
+      dst += 32;
+      len -= 32;
+    }
+  _mm256_storeu_si256 ((__m256i *) lanes, acc);
+  sum += sr_csum_fold64 (lanes[0]) + sr_csum_fold64 (lanes[1])
+    + sr_csum_fold64 (lanes[2]) + sr_csum_fold64 (lanes[3]);
+  return sr_csum_copy_scalar (dst, src, len, sum);
+}
+
+#endif /* CSUM_X86 */
+
+static uint64_t sr_csum_resolve (const uint8_t *, uint32_t, uint64_t);
+static uint64_t sr_csum_copy_resolve (uint8_t *, const uint8_t *, uint32_t,
+				      uint64_t);
+
+/** implementation in use, the resolvers until the first checksum */
+static sr_csum_fn sr_csum_impl = sr_csum_resolve;
+static sr_csum_copy_fn sr_csum_copy_impl = sr_csum_copy_resolve;
+static int sr_csum_in_use = -1;
+
+static uint64_t
+sr_csum_resolve (const uint8_t * p, uint32_t len, uint64_t sum)
+{
+  sr_csum_use (sr_csum_best ());
+  return sr_csum_impl (p, len, sum);
+}
+
+static uint64_t
+sr_csum_copy_resolve (uint8_t * dst, const uint8_t * src, uint32_t len,
+		      uint64_t sum)
+{
+  sr_csum_use (sr_csum_best ());
+  return sr_csum_copy_impl (dst, src, len, sum);
+}
+
+/**
+ * implementation named name, -1 if unknown
+ */
+int
+sr_csum_type (const char *name)
+{
+  int i;
+
+  for (i = 0; i < CSUM_TYPES; i++)
+    if (!strcmp (name, sr_csum_names[i]))
+      return i;
+  return -1;
+}
+
+const char *
+sr_csum_type_name (int type)
+{
+  assert (type >= 0 && type < CSUM_TYPES);
+  return sr_csum_names[type];
+}
+
+/** the fastest implementation the CPU runs (CPUID) */
+int
+sr_csum_best (void)
+{
+#ifdef CSUM_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return CSUM_AVX2;
+  if (__builtin_cpu_supports ("sse2"))
+    return CSUM_SSE2;
+#endif /* CSUM_X86 */
+  return CSUM_SCALAR;
+}
+
+/**
+ * Use implementation type from now on: 0, or -1 if the CPU does not
+ * have the instructions it needs
+ */
+int
+sr_csum_use (int type)
+{
+  assert (type >= 0 && type < CSUM_TYPES);
+
+  switch (type)
+    {
+#ifdef CSUM_X86
+    case CSUM_AVX2:
+      __builtin_cpu_init ();
+      if (!__builtin_cpu_supports ("avx2"))
+	return -1;
+      sr_csum_impl = sr_csum_avx2;
+      sr_csum_copy_impl = sr_csum_copy_avx2;
+      break;
+    case CSUM_SSE2:
+      __builtin_cpu_init ();
+      if (!__builtin_cpu_supports ("sse2"))
+	return -1;
+      sr_csum_impl = sr_csum_sse2;
+      sr_csum_copy_impl = sr_csum_copy_sse2;
+      break;
+#endif /* CSUM_X86 */
+    case CSUM_SCALAR:
+      sr_csum_impl = sr_csum_scalar_fn;
+      sr_csum_copy_impl = sr_csum_copy_scalar;
+      break;
+    default:
+      return -1;
+    }
+  sr_csum_in_use = type;
+  return 0;
+}
+
+/** implementation in use, chosen on the first checksum if not set */
+int
+sr_csum_current (void)
+{
+  if (sr_csum_in_use < 0)
+    sr_csum_use (sr_csum_best ());
+  return sr_csum_in_use;
+}
+
+/**
+ * Partial sum of len bytes of data, added to sum
+ */
+uint16_t
+sr_csum_partial (const void *data, uint32_t len, uint16_t sum)
+{
+  assert (data || !len);
+
+  if (len < CSUM_SHORT)
+    return sr_csum_fold64 (sr_csum_scalar (data, len, sum));
+  return sr_csum_fold64 (sr_csum_impl (data, len, sum));
+}
+
+/**
+ * Copy len bytes from src to dst (not overlapping) and return their
+ * partial sum added to sum, reading src once
+ */
+uint16_t
+sr_csum_copy (void *dst, const void *src, uint32_t len, uint16_t sum)
+{
+  assert ((dst && src) || !len);
+
+  if (len < CSUM_SHORT)
+    return sr_csum_fold64 (sr_csum_copy_scalar (dst, src, len, sum));
+  return sr_csum_fold64 (sr_csum_copy_impl (dst, src, len, sum));
+}
@@ -0,0 +1,62 @@
+/**
+ * Internet checksum engine (RFC 1071). Data is summed in 64-bit
+ * accumulators, with SSE2 or AVX2 on x86 when the CPU has them, chosen
+ * from CPUID the first time a checksum is computed. Sums are kept in host
+ * byte order, which the ones' complement sum allows: stored as they are,
+ * they are the checksum in network byte order.
+ */
+#ifndef SR_CSUM_H
+#define SR_CSUM_H
+
+#include <stdint.h>
+
+/** implementations */
+#define CSUM_SCALAR 0
+#define CSUM_SSE2 1
+#define CSUM_AVX2 2
+#define CSUM_TYPES 3
+
+/** data shorter than this (IP headers) is summed without a dispatch */
+#define CSUM_SHORT 64
+
+uint16_t sr_csum_partial (const void *data, uint32_t len, uint16_t sum);
+uint16_t sr_csum_copy (void *dst, const void *src, uint32_t len,
+		       uint16_t sum);
+
+int sr_csum_type (const char *name);
+const char *sr_csum_type_name (int type);
+int sr_csum_best (void);
+int sr_csum_use (int type);
+int sr_csum_current (void);
+
+/** the checksum of data summing to sum (partial sums of the pieces) */
+static inline uint16_t
+sr_csum_fold (uint16_t sum)
+{
+  return (uint16_t) ~sum;
+}
+
+/**
+ * Checksum csum updated for a 16-bit word of the data changed from old
+ * to new (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')), without summing
+ * the data again. Words are taken as they are stored.
+ */
+static inline uint16_t
+sr_csum_update16 (uint16_t csum, uint16_t old, uint16_t new)
+{
+  uint32_t sum = (uint16_t) ~csum + (uint16_t) ~old + new;
+
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t) ~sum;
+}
+
+/** the same for a 32-bit field, such as an address */
+static inline uint16_t
+sr_csum_update32 (uint16_t csum, uint32_t old, uint32_t new)
+{
+  csum = sr_csum_update16 (csum, old >> 16, new >> 16);
+  return sr_csum_update16 (csum, old & 0xFFFF, new & 0xFFFF);
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ * Destination cache routines
+ *
+ * Instead of finding and clearing the entries a change affects, every
+ * change to the routing table or the ARP table bumps a generation and
+ * entries filled at an older generation are misses. The routing table
+ * generation is bumped by the reload thread too, after publishing the new
+ * FIB. Entries are tagged with the generation read before the route was
+ * looked up, so a route of a replaced FIB is never tagged with a current
+ * generation, and the replaced FIB is only freed at the forwarding
+ * thread's next quiescent point.
+ */
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_dcache.h"
+
+static struct sr_dcache_entry *
+sr_dcache_slot (struct sr_instance *sr, uint32_t dst)
+{
+  return &sr->dcache.entries[(ntohl (dst) * 2654435761u) >>
+			     (32 - DCACHE_BITS)];
+}
+
+/**
+ * cached next hop of dst, 0 on a miss
+ */
+struct sr_dcache_entry *
+sr_dcache_lookup (struct sr_instance *sr, uint32_t dst)
+{
+  struct sr_dcache_entry *e;
+
+  assert (sr);
+
+  e = sr_dcache_slot (sr, dst);
+  if (e->dst != dst ||
+      e->rt_gen != __atomic_load_n (&sr->dcache.rt_gen, __ATOMIC_ACQUIRE) ||
+      e->arp_gen != sr->dcache.arp_gen)
+    return 0;
+  return e;
+}
+
+/**
+ * remember the next hop a packet to dst was just sent to, using the
+ * route of the last lookup
+ */
+void
+sr_dcache_fill (struct sr_instance *sr, uint32_t dst, struct sr_rt *route,
+		const unsigned char *smac, const unsigned char *dmac)
+{
+  struct sr_dcache_entry *e;
+
+  assert (sr);
+  assert (route);
+
+  e = sr_dcache_slot (sr, dst);
+  e->dst = dst;
+  e->rt_gen = sr->dcache.lookup_gen;
+  e->arp_gen = sr->dcache.arp_gen;
+  memcpy (e->smac, smac, ETHER_ADDR_LEN);
+  memcpy (e->dmac, dmac, ETHER_ADDR_LEN);
+  e->route = route;
+}
+
+/**
+ * note the routing table generation before a lookup (forwarding thread)
+ */
+void
+sr_dcache_rt_lookup (struct sr_instance *sr)
+{
+  sr->dcache.lookup_gen = __atomic_load_n (&sr->dcache.rt_gen,
+					   __ATOMIC_ACQUIRE);
+}
+
+/**
+ * invalidate the cache after a routing table change
+ */
+void
+sr_dcache_rt_changed (struct sr_instance *sr)
+{
+  __atomic_add_fetch (&sr->dcache.rt_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * invalidate the cache after an ARP table change
+ */
+void
+sr_dcache_arp_changed (struct sr_instance *sr)
+{
+  sr->dcache.arp_gen++;
+}
@@ -0,0 +1,41 @@
+/**
+ * Destination cache: the result of route and ARP resolution for recently
+ * forwarded destinations, so packets of a flow are sent without a route
+ * lookup or an ARP table scan.
+ */
+
+#ifndef SR_DCACHE_H
+#define SR_DCACHE_H
+
+#include <stdint.h>
+#include "sr_protocol.h"
+
+struct sr_rt;
+
+/** Number of entries (direct mapped), a power of two */
+#define DCACHE_BITS 10
+#define DCACHE_SIZE (1 << DCACHE_BITS)
+
+/**
+ * Resolved next hop of a destination. The entry is valid while the
+ * routing table and ARP table generations it was filled at are current.
+ */
+struct sr_dcache_entry
+{
+  uint32_t dst;			/** destination IP, 0 if empty */
+  uint32_t rt_gen;
+  uint32_t arp_gen;
+  unsigned char smac[ETHER_ADDR_LEN];	/** egress interface address */
+  unsigned char dmac[ETHER_ADDR_LEN];	/** next hop address */
+  struct sr_rt *route;		/** route (next hop) the packets take */
+};
+
+struct sr_dcache
+{
+  struct sr_dcache_entry entries[DCACHE_SIZE];
+  uint32_t rt_gen;		/** bumped on each routing table change */
+  uint32_t arp_gen;		/** bumped on each ARP table change */
+  uint32_t lookup_gen;		/** rt_gen read before the last route lookup */
+};
+
+#endif
@@ -0,0 +1,215 @@
+/**
+ * Event loop routines
+ *
+ * Signals handled by the loop (SIGINT, SIGTERM, SIGHUP, SIGUSR1) are
+ * blocked by sr_event_init, which must run before any other thread is
+ * started, and read from the signalfd instead. Each pass of the loop
+ * handles the ready descriptors, runs the expired timers, sends the
+ * packets queued by the I/O backend and arms the timerfd again.
+ */
+#ifdef _LINUX_
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_event.h"
+
+/** the timerfd expired, sr_event_loop runs the timers */
+static void
+sr_event_timer (struct sr_instance *sr, struct sr_event *ev)
+{
+  uint64_t expirations;
+
+  if (read (ev->fd, &expirations, sizeof (expirations)) < 0
+      && errno != EAGAIN)
+    perror ("read(..):sr_event_timer");
+  sr->loop.armed = 0;
+}
+
+/** signals: exit, reload the routing table or print statistics */
+static void
+sr_event_signal (struct sr_instance *sr, struct sr_event *ev)
+{
+  struct signalfd_siginfo si;
+
+  while (read (ev->fd, &si, sizeof (si)) == sizeof (si))
+    switch (si.ssi_signo)
+      {
+      case SIGINT:
+      case SIGTERM:
+	Debug ("Exiting program\n");
+	sr->loop.stop = 1;
+	break;
+      case SIGHUP:
+	sr_rt_reload (sr);
+	break;
+      case SIGUSR1:
+	sr_print_stats (sr);
+	break;
+      }
+}
+
+/**
+ * arm the timerfd for the next event of the timer wheel, or disarm it
+ */
+static void
+sr_event_arm (struct sr_instance *sr)
+{
+  struct itimerspec its;
+  uint64_t next, ms;
+
+  next = sr_timer_next (&sr->timers);
+  if (next == sr->loop.armed)
+    return;
+
+  memset (&its, 0, sizeof (its));
+  if (next != UINT64_MAX)
+    {
+      ms = next * TIMER_TICK_MS;
+      its.it_value.tv_sec = ms / 1000;
+      its.it_value.tv_nsec = (ms % 1000) * 1000000 + 1;
+    }
+  if (timerfd_settime (sr->loop.timer.fd, TFD_TIMER_ABSTIME, &its, 0) != 0)
+    perror ("timerfd_settime(..):sr_event_arm");
+  sr->loop.armed = next;
+}
+
+/**
+ * Watch fd for input, calling fn with ev when it is readable
+ */
+int
+sr_event_add (struct sr_instance *sr, struct sr_event *ev, int fd,
+	      sr_event_fn fn)
+{
+  struct epoll_event e;
+
+  assert (sr);
+  assert (ev);
+  assert (fn);
+
+  ev->fd = fd;
+  ev->fn = fn;
+  memset (&e, 0, sizeof (e));
+  e.events = EPOLLIN;
+  e.data.ptr = ev;
+  if (epoll_ctl (sr->loop.epfd, EPOLL_CTL_ADD, fd, &e) != 0)
+    {
+      perror ("epoll_ctl(..):sr_event_add");
+      return -1;
+    }
+  return 0;
+}
+
+/**
+ * Create the epoll instance, the timerfd and the signalfd, and block the
+ * signals they take over. Called before other threads are started, as
+ * they inherit the signal mask.
+ */
+int
+sr_event_init (struct sr_instance *sr)
+{
+  sigset_t mask;
+  int fd;
+
+  assert (sr);
+
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGHUP);
+  sigaddset (&mask, SIGUSR1);
+
+  if ((sr->loop.epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1)
+    {
+      perror ("epoll_create1");
+      return -1;
+    }
+  if ((fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+      == -1)
+    {
+      perror ("timerfd_create");
+      return -1;
+    }
+  if (sr_event_add (sr, &sr->loop.timer, fd, sr_event_timer))
+    return -1;
+
+  if (pthread_sigmask (SIG_BLOCK, &mask, 0) != 0
+      || (fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+      perror ("signalfd");
+      return -1;
+    }
+  if (sr_event_add (sr, &sr->loop.signal, fd, sr_event_signal))
+    return -1;
+
+  sr->loop.stop = 0;
+  sr->loop.armed = 0;
+  return 0;
+}
+
+/**
+ * Run the router until the server closes the session, an error or a
+ * signal to exit: 0 on a clean exit, -1 on error. The I/O backend adds
+ * its descriptors first.
+ */
+int
+sr_event_loop (struct sr_instance *sr)
+{
+  struct epoll_event events[EVENT_BATCH];
+  struct sr_event *ev;
+  int i, n;
+
+  assert (sr);
+  assert (sr->loop.epfd != -1);
+
+  if (sr->io.ops->start (sr))
+    return -1;
+
+  while (!sr->loop.stop)
+    {
+      sr_event_arm (sr);
+      if ((n = epoll_wait (sr->loop.epfd, events, EVENT_BATCH, -1)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("epoll_wait(..):sr_event_loop");
+	  return -1;
+	}
+      for (i = 0; i < n && !sr->loop.stop; i++)
+	{
+	  ev = events[i].data.ptr;
+	  ev->fn (sr, ev);
+	}
+
+      sr_timer_run (&sr->timers, sr);
+      sr_io_flush (sr);
+      sr_rt_quiescent (sr);
+    }
+  return sr->loop.stop > 0 ? 0 : -1;
+}
+
+/**
+ * Close the descriptors of the loop (exit)
+ */
+void
+sr_event_clear (struct sr_instance *sr)
+{
+  assert (sr);
+
+  if (sr->loop.epfd == -1)
+    return;
+  close (sr->loop.timer.fd);
+  close (sr->loop.signal.fd);
+  close (sr->loop.epfd);
+  sr->loop.epfd = -1;
+}
+
+#endif /* _LINUX_ */
@@ -0,0 +1,44 @@
+/**
+ * Event loop (Linux): the descriptors of the I/O backend, a timerfd armed
+ * for the next event of the timer wheel and a signalfd, multiplexed with
+ * epoll, so timers run on time whether packets arrive or not. Other file descriptors (control
+ * sockets) are added with sr_event_add.
+ */
+
+#ifndef SR_EVENT_H
+#define SR_EVENT_H
+
+#include <stdint.h>
+
+struct sr_instance;
+struct sr_event;
+
+/** Events handled per epoll_wait */
+#define EVENT_BATCH 16
+
+typedef void (*sr_event_fn) (struct sr_instance *, struct sr_event *);
+
+/** a file descriptor watched for input, embedded in its owner */
+struct sr_event
+{
+  int fd;
+  sr_event_fn fn;		/** called when fd is readable */
+};
+
+struct sr_event_loop
+{
+  int epfd;			/** -1 if not initialised */
+  int stop;			/** 1 to exit the loop, -1 on error */
+  uint64_t armed;		/** tick the timerfd is armed for */
+  struct sr_event vns;		/** server socket of the VNS backend */
+  struct sr_event timer;
+  struct sr_event signal;
+};
+
+int sr_event_init (struct sr_instance *);
+int sr_event_add (struct sr_instance *, struct sr_event *, int fd,
+		  sr_event_fn);
+int sr_event_loop (struct sr_instance *);
+void sr_event_clear (struct sr_instance *);
+
+#endif
@@ -0,0 +1,1125 @@
+/**
+ * FIB construction and lookup.
+ *
+ * The trie follows the poptrie layout (Asai, Ohara - SIGCOMM 2015): each
+ * node covers FIB_STRIDE bits of the address, a bit vector marks the slots
+ * with a child node and a second one the slots where the leaf value
+ * changes, so runs of equal leaves are stored once. A lookup touches at
+ * most one node per level and one leaf.
+ *
+ * DIR-24-8 (Gupta, Lin, McKeown - INFOCOM 1998) expands every prefix up to
+ * /24 in a 2^24 entry table; /24s holding longer prefixes point to a chunk
+ * of 256 entries for the last octet.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_rt.h"
+
+/** scratch state to build one node of the multibit trie */
+struct sr_fib_slots
+{
+  uint32_t leaf[FIB_FANOUT];
+  const struct sr_rib_node *sub[FIB_FANOUT];
+  uint64_t vector;
+};
+
+/** prefix length of a (contiguous) netmask in network byte order */
+static int
+sr_fib_masklen (uint32_t mask)
+{
+  mask = ntohl (mask);
+  return ~mask ? __builtin_clz (~mask) : 32;
+}
+
+/**
+ * Insert a route in the radix trie. Returns the route of the prefix:
+ * route, or the route it already had (route is then one more path of it).
+ */
+static uint32_t
+sr_rib_insert (struct sr_fib *fib, uint32_t prefix, int len, uint32_t route)
+{
+  struct sr_rib_node **n = &fib->rib;
+  int depth;
+
+  for (depth = 0;; depth++)
+    {
+      if (!*n)
+	{
+	  *n = (struct sr_rib_node *) calloc (1, sizeof (struct sr_rib_node));
+	  assert (*n);
+	  fib->n_rib++;
+	}
+      if (depth == len)
+	break;
+      n = &(*n)->child[(prefix >> (31 - depth)) & 1];
+    }
+  if ((*n)->route == FIB_NOROUTE)
+    (*n)->route = route;
+  return (*n)->route;
+}
+
+/**
+ * Remove the route of a prefix from the radix trie and free the nodes left
+ * without route or children. Returns the route removed or FIB_NOROUTE.
+ */
+static uint32_t
+sr_rib_delete (struct sr_fib *fib, struct sr_rib_node **n, uint32_t prefix,
+	       int len, int depth)
+{
+  uint32_t route;
+
+  if (!*n)
+    return FIB_NOROUTE;
+
+  if (depth == len)
+    {
+      route = (*n)->route;
+      (*n)->route = FIB_NOROUTE;
+    }
+  else
+    route = sr_rib_delete (fib, &(*n)->child[(prefix >> (31 - depth)) & 1],
+			   prefix, len, depth + 1);
+
+  if ((*n)->route == FIB_NOROUTE && !(*n)->child[0] && !(*n)->child[1])
+    {
+      free (*n);
+      *n = 0;
+      fib->n_rib--;
+    }
+  return route;
+}
+
+/**
+ * radix node at depth on the path of prefix (0 if there is none), and the
+ * longest route matching prefix above that depth
+ */
+static const struct sr_rib_node *
+sr_rib_walk (const struct sr_fib *fib, uint32_t prefix, int depth,
+	     uint32_t *inherit)
+{
+  const struct sr_rib_node *n = fib->rib;
+  int d;
+
+  *inherit = FIB_NOROUTE;
+  for (d = 0; n && d < depth; d++)
+    {
+      if (n->route != FIB_NOROUTE)
+	*inherit = n->route;
+      n = n->child[(prefix >> (31 - d)) & 1];
+    }
+  return n;
+}
+
+static void
+sr_rib_free (struct sr_rib_node *n)
+{
+  if (!n)
+    return;
+  sr_rib_free (n->child[0]);
+  sr_rib_free (n->child[1]);
+  free (n);
+}
+
+/** reserve count consecutive nodes, returns the index of the first */
+static uint32_t
+sr_fib_alloc_nodes (struct sr_fib *fib, uint32_t count)
+{
+  uint32_t first = fib->n_nodes;
+
+  if (fib->n_nodes + count > fib->cap_nodes)
+    {
+      while (fib->n_nodes + count > fib->cap_nodes)
+	fib->cap_nodes = fib->cap_nodes ? fib->cap_nodes * 2 : 64;
+      fib->nodes = (struct sr_fib_node *)
+	realloc (fib->nodes, fib->cap_nodes * sizeof (struct sr_fib_node));
+      assert (fib->nodes);
+    }
+  fib->n_nodes += count;
+  return first;
+}
+
+static void
+sr_fib_push_leaf (struct sr_fib *fib, uint32_t route)
+{
+  if (fib->n_leaves == fib->cap_leaves)
+    {
+      fib->cap_leaves = fib->cap_leaves ? fib->cap_leaves * 2 : 256;
+      fib->leaves = (uint32_t *)
+	realloc (fib->leaves, fib->cap_leaves * sizeof (uint32_t));
+      assert (fib->leaves);
+    }
+  fib->leaves[fib->n_leaves++] = route;
+}
+
+/** make a slot of fib->routes available for the next insert */
+static void
+sr_fib_release_route (struct sr_fib *fib, uint32_t route)
+{
+  memset (&fib->routes[route], 0, sizeof (struct sr_rt));
+  if (fib->n_route_free == fib->cap_route_free)
+    {
+      fib->cap_route_free = fib->cap_route_free ? fib->cap_route_free * 2 : 64;
+      fib->route_free = (uint32_t *)
+	realloc (fib->route_free, fib->cap_route_free * sizeof (uint32_t));
+      assert (fib->route_free);
+    }
+  fib->route_free[fib->n_route_free++] = route;
+}
+
+/**
+ * Walk FIB_STRIDE levels of the radix trie below n and record, for every
+ * slot of the node, the longest matching route and whether deeper
+ * prefixes exist (the slot then needs a child node).
+ */
+static void
+sr_fib_fill (struct sr_fib_slots *s, const struct sr_rib_node *n, int rel,
+	     unsigned int slot, uint32_t inherit)
+{
+  unsigned int i, span;
+
+  if (n && n->route != FIB_NOROUTE)
+    inherit = n->route;
+
+  if (rel == FIB_STRIDE)
+    {
+      s->leaf[slot] = inherit;
+      if (n && (n->child[0] || n->child[1]))
+	{
+	  s->vector |= 1ULL << slot;
+	  s->sub[slot] = n;
+	}
+      return;
+    }
+
+  if (!n)
+    {
+      span = 1 << (FIB_STRIDE - rel);
+      for (i = slot * span; i < (slot + 1) * span; i++)
+	s->leaf[i] = inherit;
+      return;
+    }
+
+  sr_fib_fill (s, n->child[0], rel + 1, slot << 1, inherit);
+  sr_fib_fill (s, n->child[1], rel + 1, (slot << 1) | 1, inherit);
+}
+
+/** compile the subtrie rooted at the radix node n into nodes[idx] */
+static void
+sr_fib_build_node (struct sr_fib *fib, uint32_t idx,
+		   const struct sr_rib_node *n, uint32_t inherit)
+{
+  struct sr_fib_slots s;
+  struct sr_fib_node node;
+  unsigned int i, child;
+
+  s.vector = 0;
+  sr_fib_fill (&s, n, 0, 0, inherit);
+
+  node.vector = s.vector;
+  node.leafvec = 0;
+  node.base0 = fib->n_leaves;
+  for (i = 0; i < FIB_FANOUT; i++)
+    {
+      if (i == 0 || s.leaf[i] != s.leaf[i - 1])
+	{
+	  node.leafvec |= 1ULL << i;
+	  sr_fib_push_leaf (fib, s.leaf[i]);
+	}
+    }
+  node.base1 = sr_fib_alloc_nodes (fib, __builtin_popcountll (s.vector));
+  fib->nodes[idx] = node;
+
+  for (i = 0, child = node.base1; i < FIB_FANOUT; i++)
+    {
+      if (s.vector & (1ULL << i))
+	sr_fib_build_node (fib, child++, s.sub[i], s.leaf[i]);
+    }
+}
+
+/**
+ * reserve a DIR-24-8 chunk, returns its index. Released chunks are linked
+ * through their first entry.
+ */
+static uint32_t
+sr_fib_alloc_tbl8 (struct sr_fib *fib)
+{
+  uint32_t chunk;
+
+  if (fib->tbl8_free)
+    {
+      chunk = fib->tbl8_free - 1;
+      fib->tbl8_free = fib->tbl8[chunk * FIB_DIR24_CHUNK];
+      return chunk;
+    }
+  if (fib->n_tbl8 == fib->cap_tbl8)
+    {
+      fib->cap_tbl8 = fib->cap_tbl8 ? fib->cap_tbl8 * 2 : 64;
+      fib->tbl8 = (uint32_t *)
+	realloc (fib->tbl8,
+		 fib->cap_tbl8 * FIB_DIR24_CHUNK * sizeof (uint32_t));
+      assert (fib->tbl8);
+    }
+  return fib->n_tbl8++;
+}
+
+static void
+sr_fib_free_tbl8 (struct sr_fib *fib, uint32_t chunk)
+{
+  fib->tbl8[chunk * FIB_DIR24_CHUNK] = fib->tbl8_free;
+  fib->tbl8_free = chunk + 1;
+}
+
+/** expand the radix trie below n into chunk entries */
+static void
+sr_fib_fill_tbl8 (struct sr_fib *fib, uint32_t chunk,
+		  const struct sr_rib_node *n, int rel, unsigned int slot,
+		  uint32_t inherit)
+{
+  uint32_t *e;
+  unsigned int i, span;
+
+  if (n && n->route != FIB_NOROUTE)
+    inherit = n->route;
+
+  if (!n || rel == 8)
+    {
+      span = 1 << (8 - rel);
+      e = &fib->tbl8[chunk * FIB_DIR24_CHUNK + slot * span];
+      for (i = 0; i < span; i++)
+	e[i] = inherit;
+      return;
+    }
+
+  sr_fib_fill_tbl8 (fib, chunk, n->child[0], rel + 1, slot << 1, inherit);
+  sr_fib_fill_tbl8 (fib, chunk, n->child[1], rel + 1, (slot << 1) | 1,
+		    inherit);
+}
+
+/**
+ * expand the radix trie below n into tbl24 entries, moving anything
+ * longer than /24 to a chunk. Chunks already in the range are reused or
+ * released.
+ */
+static void
+sr_fib_fill_tbl24 (struct sr_fib *fib, const struct sr_rib_node *n, int rel,
+		   uint32_t slot, uint32_t inherit)
+{
+  uint32_t i, span, chunk, old;
+
+  if (n && n->route != FIB_NOROUTE)
+    inherit = n->route;
+
+  if (rel == 24)
+    {
+      old = fib->tbl24[slot];
+      if (n && (n->child[0] || n->child[1]))
+	{
+	  chunk = old & FIB_DIR24_EXT ? old & ~FIB_DIR24_EXT
+	    : sr_fib_alloc_tbl8 (fib);
+	  sr_fib_fill_tbl8 (fib, chunk, n, 0, 0, inherit);
+	  fib->tbl24[slot] = FIB_DIR24_EXT | chunk;
+	}
+      else
+	{
+	  if (old & FIB_DIR24_EXT)
+	    sr_fib_free_tbl8 (fib, old & ~FIB_DIR24_EXT);
+	  fib->tbl24[slot] = inherit;
+	}
+      return;
+    }
+
+  if (!n)
+    {
+      span = 1 << (24 - rel);
+      for (i = slot * span; i < (slot + 1) * span; i++)
+	{
+	  if (fib->tbl24[i] & FIB_DIR24_EXT)
+	    sr_fib_free_tbl8 (fib, fib->tbl24[i] & ~FIB_DIR24_EXT);
+	  fib->tbl24[i] = inherit;
+	}
+      return;
+    }
+
+  sr_fib_fill_tbl24 (fib, n->child[0], rel + 1, slot << 1, inherit);
+  sr_fib_fill_tbl24 (fib, n->child[1], rel + 1, (slot << 1) | 1, inherit);
+}
+
+/** copy route to slot i of fib->routes, as a prefix with a single path */
+static void
+sr_fib_set_route (struct sr_fib *fib, uint32_t i, const struct sr_rt *route)
+{
+  fib->routes[i] = *route;
+  fib->routes[i].next = 0;
+  fib->routes[i].npaths = 1;
+  fib->routes[i].path_next = 0;
+  fib->routes[i].packets = 0;
+}
+
+/**
+ * Append route i as one more equal cost path of the prefix whose route is
+ * first. Lookups keep returning first, the path is chosen per flow.
+ */
+static void
+sr_fib_add_path (struct sr_fib *fib, uint32_t first, uint32_t i)
+{
+  struct sr_rt *p = &fib->routes[first];
+
+  while (p->path_next)
+    p += p->path_next;
+  p->path_next = &fib->routes[i] - p;
+  fib->routes[first].npaths++;
+  fib->routes[i].npaths = 0;
+}
+
+/**
+ * Build a FIB from a routing table list. Routes to the same prefix are
+ * the equal cost paths of that prefix. The FIB keeps its own copy of the
+ * routes so it stays valid if the list changes.
+ */
+struct sr_fib *
+sr_fib_build (struct sr_rt *list, int type)
+{
+  struct sr_fib *fib;
+  struct sr_rt *r;
+  uint32_t i, first;
+  int len;
+
+  fib = (struct sr_fib *) calloc (1, sizeof (struct sr_fib));
+  assert (fib);
+  fib->type = type;
+
+  for (r = list; r; r = r->next)
+    fib->n_routes++;
+  fib->cap_routes = fib->n_routes + 1;
+  fib->routes = (struct sr_rt *) calloc (fib->cap_routes,
+					 sizeof (struct sr_rt));
+  assert (fib->routes);
+
+  for (r = list, i = 1; r; r = r->next, i++)
+    {
+      sr_fib_set_route (fib, i, r);
+      len = sr_fib_masklen (r->mask.s_addr);
+      first = sr_rib_insert (fib, ntohl (r->dest.s_addr & r->mask.s_addr),
+			     len, i);
+      if (first != i)
+	sr_fib_add_path (fib, first, i);
+    }
+
+  switch (type)
+    {
+    case FIB_DIR24:
+      fib->tbl24 = (uint32_t *) calloc (1 << 24, sizeof (uint32_t));
+      assert (fib->tbl24);
+      sr_fib_fill_tbl24 (fib, fib->rib, 0, 0, FIB_NOROUTE);
+      break;
+    default:
+      sr_fib_alloc_nodes (fib, 1);
+      sr_fib_build_node (fib, 0, fib->rib, FIB_NOROUTE);
+    }
+
+  return fib;
+}
+
+void
+sr_fib_free (struct sr_fib *fib)
+{
+  if (!fib)
+    return;
+  sr_rib_free (fib->rib);
+  if (fib->image)
+    munmap (fib->image, fib->image_size);
+  else
+    {
+      free (fib->nodes);
+      free (fib->leaves);
+      free (fib->tbl24);
+      free (fib->tbl8);
+      free (fib->routes);
+    }
+  free (fib->route_free);
+  free (fib);
+}
+
+/** malloc'd copy of size bytes at p, 0 if size is 0 */
+static void *
+sr_fib_copy (const void *p, size_t size)
+{
+  void *copy;
+
+  if (!size)
+    return 0;
+  copy = malloc (size);
+  assert (copy);
+  return memcpy (copy, p, size);
+}
+
+/**
+ * Make a FIB loaded from an image updatable: copy its arrays out of the
+ * mapping and rebuild the radix trie from the routes.
+ */
+static void
+sr_fib_thaw (struct sr_fib *fib)
+{
+  uint32_t i;
+
+  if (!fib->image)
+    return;
+
+  fib->routes = (struct sr_rt *)
+    sr_fib_copy (fib->routes, fib->cap_routes * sizeof (struct sr_rt));
+  fib->nodes = (struct sr_fib_node *)
+    sr_fib_copy (fib->nodes, fib->cap_nodes * sizeof (struct sr_fib_node));
+  fib->leaves = (uint32_t *)
+    sr_fib_copy (fib->leaves, fib->cap_leaves * sizeof (uint32_t));
+  if (fib->tbl24)
+    fib->tbl24 = (uint32_t *)
+      sr_fib_copy (fib->tbl24, (1 << 24) * sizeof (uint32_t));
+  fib->tbl8 = (uint32_t *)
+    sr_fib_copy (fib->tbl8, (size_t) fib->cap_tbl8 * FIB_DIR24_CHUNK *
+		 sizeof (uint32_t));
+  munmap (fib->image, fib->image_size);
+  fib->image = 0;
+
+  for (i = 1; i <= fib->n_routes; i++)
+    sr_rib_insert (fib, ntohl (fib->routes[i].dest.s_addr &
+			       fib->routes[i].mask.s_addr),
+		   sr_fib_masklen (fib->routes[i].mask.s_addr), i);
+}
+
+/** count the nodes and leaves of the subtrie at nodes[idx] */
+static void
+sr_fib_subtrie_size (const struct sr_fib *fib, uint32_t idx,
+		     uint32_t *nodes, uint32_t *leaves)
+{
+  const struct sr_fib_node *node = &fib->nodes[idx];
+  uint32_t i, n = __builtin_popcountll (node->vector);
+
+  *nodes += n;
+  *leaves += __builtin_popcountll (node->leafvec);
+  for (i = 0; i < n; i++)
+    sr_fib_subtrie_size (fib, node->base1 + i, nodes, leaves);
+}
+
+/**
+ * Bring the multibit trie up to date after the route of prefix/len
+ * changed in the radix trie. The prefix sets leaves of the node at level
+ * (len - 1) / FIB_STRIDE on its path, and its route is inherited by the
+ * subtries below, so the deepest existing node down to that level is
+ * rebuilt. Its old leaves and subtrie are left unused in the arrays; they
+ * are reclaimed by compacting the trie once they outgrow the live part.
+ */
+static void
+sr_fib_trie_update (struct sr_fib *fib, uint32_t prefix, int len)
+{
+  const struct sr_fib_node *node;
+  const struct sr_rib_node *n;
+  uint64_t key = (uint64_t) prefix << 32;
+  uint32_t idx = 0, inherit, dead_nodes = 0, dead_leaves = 0;
+  int level, last = len ? (len - 1) / FIB_STRIDE : 0;
+  unsigned int v;
+
+  for (level = 0; level < last; level++)
+    {
+      node = &fib->nodes[idx];
+      v = (key >> (64 - FIB_STRIDE * (level + 1))) & (FIB_FANOUT - 1);
+      if (!(node->vector & (1ULL << v)))
+	break;
+      idx = node->base1 +
+	__builtin_popcountll (node->vector & ((2ULL << v) - 1)) - 1;
+    }
+
+  sr_fib_subtrie_size (fib, idx, &dead_nodes, &dead_leaves);
+  fib->dead_nodes += dead_nodes;
+  fib->dead_leaves += dead_leaves;
+
+  n = sr_rib_walk (fib, prefix, level * FIB_STRIDE, &inherit);
+  sr_fib_build_node (fib, idx, n, inherit);
+
+  if (fib->dead_nodes + fib->dead_leaves >
+      (fib->n_nodes + fib->n_leaves) / 2)
+    {
+      fib->n_nodes = fib->n_leaves = 0;
+      fib->dead_nodes = fib->dead_leaves = 0;
+      sr_fib_alloc_nodes (fib, 1);
+      sr_fib_build_node (fib, 0, fib->rib, FIB_NOROUTE);
+    }
+}
+
+/**
+ * Bring the DIR-24-8 table up to date after the route of prefix/len
+ * changed: only the tbl24 entries covered by the prefix, or the chunk of
+ * its /24, are filled again.
+ */
+static void
+sr_fib_dir24_update (struct sr_fib *fib, uint32_t prefix, int len)
+{
+  const struct sr_rib_node *n;
+  uint32_t inherit;
+  int depth = len < 24 ? len : 24;
+
+  n = sr_rib_walk (fib, prefix, depth, &inherit);
+  sr_fib_fill_tbl24 (fib, n, depth, depth ? prefix >> (32 - depth) : 0,
+		     inherit);
+}
+
+static void
+sr_fib_update (struct sr_fib *fib, uint32_t prefix, int len)
+{
+  if (fib->type == FIB_DIR24)
+    sr_fib_dir24_update (fib, prefix, len);
+  else
+    sr_fib_trie_update (fib, prefix, len);
+}
+
+/**
+ * Add a route to a built FIB without rebuilding it. Returns 0 if its
+ * prefix already had a route, the new route is then one more path of it.
+ */
+int
+sr_fib_insert (struct sr_fib *fib, const struct sr_rt *route)
+{
+  uint32_t i, prefix, first;
+  int len;
+
+  assert (fib);
+  assert (route);
+
+  sr_fib_thaw (fib);
+  if (fib->n_route_free)
+    i = fib->route_free[--fib->n_route_free];
+  else
+    {
+      if (fib->n_routes + 1 == fib->cap_routes)
+	{
+	  fib->cap_routes *= 2;
+	  fib->routes = (struct sr_rt *)
+	    realloc (fib->routes, fib->cap_routes * sizeof (struct sr_rt));
+	  assert (fib->routes);
+	}
+      i = ++fib->n_routes;
+    }
+
+  sr_fib_set_route (fib, i, route);
+  len = sr_fib_masklen (route->mask.s_addr);
+  prefix = ntohl (route->dest.s_addr & route->mask.s_addr);
+  if ((first = sr_rib_insert (fib, prefix, len, i)) != i)
+    {
+      sr_fib_add_path (fib, first, i);
+      return 0;
+    }
+
+  sr_fib_update (fib, prefix, len);
+  return 1;
+}
+
+/**
+ * Withdraw the route of a prefix, with all its paths, from a built FIB
+ * without rebuilding it. Returns 0 if there was no route for the prefix.
+ */
+int
+sr_fib_delete (struct sr_fib *fib, struct in_addr dest, struct in_addr mask)
+{
+  uint32_t route, prefix;
+  int32_t next;
+  int len;
+
+  assert (fib);
+
+  sr_fib_thaw (fib);
+  len = sr_fib_masklen (mask.s_addr);
+  prefix = ntohl (dest.s_addr & mask.s_addr);
+  route = sr_rib_delete (fib, &fib->rib, prefix, len, 0);
+  if (route == FIB_NOROUTE)
+    return 0;
+
+  do
+    {
+      next = fib->routes[route].path_next;
+      sr_fib_release_route (fib, route);
+      route += next;
+    }
+  while (next);
+  sr_fib_update (fib, prefix, len);
+  return 1;
+}
+
+/**
+ * bytes used by the lookup structure and the route copies
+ */
+size_t
+sr_fib_memory (const struct sr_fib *fib)
+{
+  size_t bytes;
+
+  assert (fib);
+  bytes = sizeof (struct sr_fib)
+    + fib->cap_routes * sizeof (struct sr_rt)
+    + fib->n_rib * sizeof (struct sr_rib_node)
+    + fib->n_nodes * sizeof (struct sr_fib_node)
+    + fib->n_leaves * sizeof (uint32_t)
+    + (size_t) fib->n_tbl8 * FIB_DIR24_CHUNK * sizeof (uint32_t);
+  if (fib->tbl24)
+    bytes += (1 << 24) * sizeof (uint32_t);
+  return bytes;
+}
+
+/** offset of the next section of an image, FIB_IMAGE_ALIGN aligned */
+static uint64_t
+sr_fib_image_section (uint64_t *size, uint64_t bytes)
+{
+  uint64_t off;
+
+  if (!bytes)
+    return 0;
+  off = (*size + FIB_IMAGE_ALIGN - 1) & ~(uint64_t) (FIB_IMAGE_ALIGN - 1);
+  *size = off + bytes;
+  return off;
+}
+
+/** lay out the sections of an image for the counts set in hdr */
+static void
+sr_fib_image_layout (struct sr_fib_image_hdr *hdr)
+{
+  uint64_t size = sizeof (struct sr_fib_image_hdr);
+
+  hdr->off_routes = sr_fib_image_section (&size, ((uint64_t) hdr->n_routes +
+						   1) * hdr->route_size);
+  hdr->off_nodes = sr_fib_image_section (&size, (uint64_t) hdr->n_nodes *
+					 sizeof (struct sr_fib_node));
+  hdr->off_leaves = sr_fib_image_section (&size, (uint64_t) hdr->n_leaves *
+					  sizeof (uint32_t));
+  hdr->off_tbl24 = sr_fib_image_section (&size, hdr->type == FIB_DIR24 ?
+					 (1 << 24) * sizeof (uint32_t) : 0);
+  hdr->off_tbl8 = sr_fib_image_section (&size, (uint64_t) hdr->n_tbl8 *
+					FIB_DIR24_CHUNK * sizeof (uint32_t));
+  hdr->size = size;
+}
+
+/** write bytes at offset off of fp, -1 on error */
+static int
+sr_fib_image_write (FILE *fp, uint64_t off, const void *p, size_t bytes)
+{
+  if (!bytes)
+    return 0;
+  if (fseek (fp, off, SEEK_SET) != 0 || fwrite (p, bytes, 1, fp) != 1)
+    return -1;
+  return 0;
+}
+
+/**
+ * Save a freshly built FIB as an image. The file is written under a
+ * temporary name and renamed, so a reload never reads a partial image.
+ * Returns 0 on success.
+ */
+int
+sr_fib_save (const struct sr_fib *fib, const char *filename)
+{
+  struct sr_fib_image_hdr hdr;
+  char tmp[BUFSIZ];
+  FILE *fp;
+  int ret = 0;
+
+  assert (fib);
+  assert (filename);
+
+  if (fib->n_route_free || fib->dead_nodes || fib->dead_leaves ||
+      fib->tbl8_free)
+    {
+      fprintf (stderr, "FIB: only a freshly built table can be saved\n");
+      return -1;
+    }
+
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.magic = FIB_IMAGE_MAGIC;
+  hdr.version = FIB_IMAGE_VERSION;
+  hdr.type = fib->type;
+  hdr.route_size = sizeof (struct sr_rt);
+  hdr.n_routes = fib->n_routes;
+  hdr.n_nodes = fib->n_nodes;
+  hdr.n_leaves = fib->n_leaves;
+  hdr.n_tbl8 = fib->n_tbl8;
+  sr_fib_image_layout (&hdr);
+
+  snprintf (tmp, sizeof (tmp), "%s.tmp", filename);
+  if (!(fp = fopen (tmp, "w")))
+    {
+      perror ("fopen");
+      return -1;
+    }
+  if (sr_fib_image_write (fp, 0, &hdr, sizeof (hdr)) ||
+      sr_fib_image_write (fp, hdr.off_routes, fib->routes,
+			  (fib->n_routes + 1) * sizeof (struct sr_rt)) ||
+      sr_fib_image_write (fp, hdr.off_nodes, fib->nodes,
+			  fib->n_nodes * sizeof (struct sr_fib_node)) ||
+      sr_fib_image_write (fp, hdr.off_leaves, fib->leaves,
+			  fib->n_leaves * sizeof (uint32_t)) ||
+      sr_fib_image_write (fp, hdr.off_tbl24, fib->tbl24,
+			  fib->tbl24 ? (1 << 24) * sizeof (uint32_t) : 0) ||
+      sr_fib_image_write (fp, hdr.off_tbl8, fib->tbl8,
+			  (size_t) fib->n_tbl8 * FIB_DIR24_CHUNK *
+			  sizeof (uint32_t)))
+    {
+      perror ("fwrite");
+      ret = -1;
+    }
+  /* -- the last section may end before the size of the layout -- */
+  if (fflush (fp) != 0 || ftruncate (fileno (fp), hdr.size) != 0)
+    ret = -1;
+  if (fclose (fp) != 0)
+    ret = -1;
+  if (ret == 0 && rename (tmp, filename) != 0)
+    {
+      perror ("rename");
+      ret = -1;
+    }
+  if (ret != 0)
+    unlink (tmp);
+  return ret;
+}
+
+/**
+ * check the header of an image of size bytes, 0 if it can be used
+ */
+static int
+sr_fib_image_check (const struct sr_fib_image_hdr *hdr, size_t size)
+{
+  struct sr_fib_image_hdr layout;
+
+  if (size < sizeof (struct sr_fib_image_hdr) ||
+      hdr->magic != FIB_IMAGE_MAGIC)
+    {
+      fprintf (stderr, "FIB: not a FIB image (or other byte order)\n");
+      return -1;
+    }
+  if (hdr->version != FIB_IMAGE_VERSION)
+    {
+      fprintf (stderr, "FIB: image version %u not supported\n",
+	       hdr->version);
+      return -1;
+    }
+  if (hdr->route_size != sizeof (struct sr_rt))
+    {
+      fprintf (stderr, "FIB: image written on another architecture\n");
+      return -1;
+    }
+  if ((hdr->type != FIB_TRIE && hdr->type != FIB_DIR24) ||
+      (hdr->type == FIB_TRIE && !hdr->n_nodes) ||
+      hdr->n_tbl8 >= FIB_DIR24_EXT / FIB_DIR24_CHUNK)
+    {
+      fprintf (stderr, "FIB: corrupt image\n");
+      return -1;
+    }
+
+  /* -- the sections must be where this version puts them -- */
+  layout = *hdr;
+  sr_fib_image_layout (&layout);
+  if (memcmp (&layout, hdr, sizeof (layout)) != 0 || hdr->size != size)
+    {
+      fprintf (stderr, "FIB: truncated or corrupt image\n");
+      return -1;
+    }
+  return 0;
+}
+
+/** 0 if every entry of a loaded image refers to something inside it */
+static int
+sr_fib_image_verify (const struct sr_fib *fib)
+{
+  const struct sr_fib_node *node;
+  const struct sr_rt *r;
+  uint8_t *level, *linked;
+  uint32_t i, j, e, n;
+  int ret = 0;
+
+  for (i = 1; i <= fib->n_routes; i++)
+    {
+      r = &fib->routes[i];
+      if (r->interface[sr_IFACE_NAMELEN - 1] != 0 ||
+	  r->npaths > fib->n_routes ||
+	  (int64_t) i + r->path_next < 1 ||
+	  (int64_t) i + r->path_next > fib->n_routes)
+	return -1;
+    }
+
+  /* -- a group is npaths routes linked by path_next, ending at 0; the
+     later paths have npaths 0 and are in no other group -- */
+  linked = (uint8_t *) calloc (fib->n_routes + 1, 1);
+  assert (linked);
+  for (i = 1; ret == 0 && i <= fib->n_routes; i++)
+    {
+      if (!fib->routes[i].npaths)
+	continue;
+      for (e = i, j = 1; ret == 0 && j < fib->routes[i].npaths; j++)
+	{
+	  if (!fib->routes[e].path_next)
+	    ret = -1;
+	  e += fib->routes[e].path_next;
+	  if (fib->routes[e].npaths || linked[e])
+	    ret = -1;
+	  linked[e] = 1;
+	}
+      if (fib->routes[e].path_next)
+	ret = -1;
+    }
+  free (linked);
+  if (ret != 0)
+    return ret;
+
+  /* -- children follow their parent, at most 32 / FIB_STRIDE levels down -- */
+  level = (uint8_t *) calloc (fib->n_nodes + 1, 1);
+  assert (level);
+  for (i = 0; ret == 0 && i < fib->n_nodes; i++)
+    {
+      node = &fib->nodes[i];
+      n = __builtin_popcountll (node->vector);
+      if (!(node->leafvec & 1) ||
+	  (uint64_t) node->base0 + __builtin_popcountll (node->leafvec) >
+	  fib->n_leaves ||
+	  (n && (node->base1 <= i ||
+		 (uint64_t) node->base1 + n > fib->n_nodes ||
+		 level[i] == 32 / FIB_STRIDE)))
+	ret = -1;
+      for (j = 0; ret == 0 && j < n; j++)
+	{
+	  if (level[node->base1 + j] <= level[i])
+	    level[node->base1 + j] = level[i] + 1;
+	}
+    }
+  free (level);
+  if (ret != 0)
+    return ret;
+
+  for (i = 0; i < fib->n_leaves; i++)
+    {
+      if (fib->leaves[i] > fib->n_routes)
+	return -1;
+    }
+  for (i = 0; fib->tbl24 && i < (1 << 24); i++)
+    {
+      e = fib->tbl24[i];
+      if (e & FIB_DIR24_EXT ? (e & ~FIB_DIR24_EXT) >= fib->n_tbl8
+	  : e > fib->n_routes)
+	return -1;
+    }
+  for (i = 0; i < fib->n_tbl8 * FIB_DIR24_CHUNK; i++)
+    {
+      if (fib->tbl8[i] > fib->n_routes)
+	return -1;
+    }
+  return 0;
+}
+
+/**
+ * Map a FIB image. Lookups use the mapped arrays directly; the first
+ * insert or delete copies them to memory of its own. Returns 0 on error.
+ */
+struct sr_fib *
+sr_fib_load (const char *filename)
+{
+  const struct sr_fib_image_hdr *hdr;
+  struct sr_fib *fib;
+  struct stat st;
+  char *base;
+  int fd;
+
+  assert (filename);
+
+  if ((fd = open (filename, O_RDONLY)) == -1)
+    {
+      perror ("open");
+      return 0;
+    }
+  if (fstat (fd, &st) != 0)
+    {
+      perror ("fstat");
+      close (fd);
+      return 0;
+    }
+  /* -- private and writable: the path counters are updated in place -- */
+  base = (char *) mmap (0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+  close (fd);
+  if (base == MAP_FAILED)
+    {
+      perror ("mmap");
+      return 0;
+    }
+
+  hdr = (const struct sr_fib_image_hdr *) base;
+  if (sr_fib_image_check (hdr, st.st_size) != 0)
+    {
+      munmap (base, st.st_size);
+      return 0;
+    }
+
+  fib = (struct sr_fib *) calloc (1, sizeof (struct sr_fib));
+  assert (fib);
+  fib->type = hdr->type;
+  fib->image = base;
+  fib->image_size = st.st_size;
+  fib->routes = (struct sr_rt *) (base + hdr->off_routes);
+  fib->n_routes = hdr->n_routes;
+  fib->cap_routes = hdr->n_routes + 1;
+  fib->nodes = (struct sr_fib_node *) (base + hdr->off_nodes);
+  fib->n_nodes = fib->cap_nodes = hdr->n_nodes;
+  fib->leaves = (uint32_t *) (base + hdr->off_leaves);
+  fib->n_leaves = fib->cap_leaves = hdr->n_leaves;
+  if (hdr->off_tbl24)
+    fib->tbl24 = (uint32_t *) (base + hdr->off_tbl24);
+  if (hdr->off_tbl8)
+    fib->tbl8 = (uint32_t *) (base + hdr->off_tbl8);
+  fib->n_tbl8 = fib->cap_tbl8 = hdr->n_tbl8;
+
+  if (sr_fib_image_verify (fib) != 0)
+    {
+      fprintf (stderr, "FIB: corrupt image %s\n", filename);
+      sr_fib_free (fib);
+      return 0;
+    }
+  return fib;
+}
+
+/**
+ * 1 if filename starts like a FIB image, 0 otherwise (a text rtable)
+ */
+int
+sr_fib_is_image (const char *filename)
+{
+  uint32_t magic = 0;
+  FILE *fp;
+
+  if (!(fp = fopen (filename, "r")))
+    return 0;
+  if (fread (&magic, sizeof (magic), 1, fp) != 1)
+    magic = 0;
+  fclose (fp);
+  return magic == FIB_IMAGE_MAGIC;
+}
+
+/**
+ * FIB type from its name (command line), -1 if unknown
+ */
+int
+sr_fib_type (const char *name)
+{
+  if (!strcmp (name, "trie"))
+    return FIB_TRIE;
+  if (!strcmp (name, "dir24"))
+    return FIB_DIR24;
+  return -1;
+}
+
+const char *
+sr_fib_type_name (int type)
+{
+  return type == FIB_DIR24 ? "dir24" : "trie";
+}
+
+/**
+ * Longest prefix match on an address in network byte order
+ */
+struct sr_rt *
+sr_fib_lookup (const struct sr_fib *fib, uint32_t ip)
+{
+  uint32_t route;
+
+  assert (fib);
+  route = sr_fib_index (fib, ntohl (ip));
+  return route == FIB_NOROUTE ? 0 : &fib->routes[route];
+}
+
+/**
+ * Longest prefix match on n (at most FIB_BATCH_MAX) addresses in network
+ * byte order. The lookups advance in lockstep, one trie level at a time,
+ * and the node or leaf each of them needs next is prefetched before any
+ * is read, so the cache misses of the whole batch overlap instead of
+ * forming n dependent chains.
+ */
+void
+sr_fib_lookup_batch (const struct sr_fib *fib, const uint32_t *ip,
+		     struct sr_rt **out, int n)
+{
+  const struct sr_fib_node *node[FIB_BATCH_MAX];
+  const uint32_t *leaf[FIB_BATCH_MAX];
+  uint64_t key[FIB_BATCH_MAX];
+  unsigned int v[FIB_BATCH_MAX];
+  unsigned int off;
+  uint32_t e[FIB_BATCH_MAX];
+  int i, active;
+
+  assert (fib);
+  assert (n <= FIB_BATCH_MAX);
+
+  if (fib->type == FIB_DIR24)
+    {
+      for (i = 0; i < n; i++)
+	{
+	  key[i] = ntohl (ip[i]);
+	  __builtin_prefetch (&fib->tbl24[key[i] >> 8]);
+	}
+      for (i = 0; i < n; i++)
+	{
+	  e[i] = fib->tbl24[key[i] >> 8];
+	  if (e[i] & FIB_DIR24_EXT)
+	    __builtin_prefetch (&fib->tbl8[(e[i] & ~FIB_DIR24_EXT) *
+					   FIB_DIR24_CHUNK + (key[i] & 0xFF)]);
+	}
+      for (i = 0; i < n; i++)
+	{
+	  if (e[i] & FIB_DIR24_EXT)
+	    e[i] = fib->tbl8[(e[i] & ~FIB_DIR24_EXT) * FIB_DIR24_CHUNK +
+			     (key[i] & 0xFF)];
+	  out[i] = e[i] == FIB_NOROUTE ? 0 : &fib->routes[e[i]];
+	}
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      key[i] = (uint64_t) ntohl (ip[i]) << 32;
+      v[i] = (key[i] >> (64 - FIB_STRIDE)) & (FIB_FANOUT - 1);
+      node[i] = fib->nodes;
+      leaf[i] = 0;
+    }
+
+  /* descend one level per pass until every lookup has reached a leaf */
+  for (off = 0, active = n; active; off += FIB_STRIDE)
+    {
+      for (i = 0, active = 0; i < n; i++)
+	{
+	  if (leaf[i])
+	    continue;
+	  if (node[i]->vector & (1ULL << v[i]))
+	    {
+	      node[i] = &fib->nodes[node[i]->base1 +
+				    __builtin_popcountll (node[i]->vector &
+							  ((2ULL << v[i]) -
+							   1)) - 1];
+	      __builtin_prefetch (node[i]);
+	      v[i] = (key[i] >> (64 - 2 * FIB_STRIDE - off)) &
+		(FIB_FANOUT - 1);
+	      active++;
+	    }
+	  else
+	    {
+	      leaf[i] = &fib->leaves[node[i]->base0 +
+				     __builtin_popcountll (node[i]->leafvec &
+							   ((2ULL << v[i]) -
+							    1)) - 1];
+	      __builtin_prefetch (leaf[i]);
+	    }
+	}
+    }
+
+  for (i = 0; i < n; i++)
+    out[i] = *leaf[i] == FIB_NOROUTE ? 0 : &fib->routes[*leaf[i]];
+}
@@ -0,0 +1,184 @@
+/**
+ * Forwarding information base. The routes added to the routing table list
+ * are inserted in a binary radix trie (the RIB) which is then compiled into
+ * the lookup structure: a poptrie style multibit trie, or a DIR-24-8 table
+ * trading memory for a single memory access on most lookups.
+ */
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct sr_rt;
+
+/** bits of the address consumed at each level of the trie */
+#define FIB_STRIDE 6
+
+/** number of slots in a trie node */
+#define FIB_FANOUT (1 << FIB_STRIDE)
+
+/** route index stored for addresses without a route */
+#define FIB_NOROUTE 0
+
+/** lookup structures */
+#define FIB_TRIE 0
+#define FIB_DIR24 1
+
+/** DIR-24-8: entry refers to a chunk of 256 entries for the last 8 bits */
+#define FIB_DIR24_EXT 0x80000000
+#define FIB_DIR24_CHUNK 256
+
+/** largest number of addresses resolved by one batch lookup */
+#define FIB_BATCH_MAX 64
+
+/** FIB image file: magic number (host byte order) and format version */
+#define FIB_IMAGE_MAGIC 0x42494653
+#define FIB_IMAGE_VERSION 2
+
+/** alignment of the sections of an image */
+#define FIB_IMAGE_ALIGN 4096
+
+/** node of the binary radix trie, one level per address bit */
+struct sr_rib_node
+{
+  struct sr_rib_node *child[2];
+  uint32_t route;		/** index in sr_fib.routes or FIB_NOROUTE */
+};
+
+/**
+ * node of the multibit trie. The children and the leaves of a node are
+ * stored contiguously in sr_fib.nodes and sr_fib.leaves, and the popcount
+ * of the bit vectors up to a slot gives the offset from the base index.
+ */
+struct sr_fib_node
+{
+  uint64_t vector;		/** slot descends into a child node */
+  uint64_t leafvec;		/** slot starts a new run of equal leaves */
+  uint32_t base0;		/** first leaf in sr_fib.leaves */
+  uint32_t base1;		/** first child in sr_fib.nodes */
+};
+
+struct sr_fib
+{
+  int type;			/** FIB_TRIE or FIB_DIR24 */
+  struct sr_rt *routes;		/** copy of the routes, routes[0] unused */
+  uint32_t n_routes;		/** highest index used in routes */
+  uint32_t cap_routes;
+  uint32_t *route_free;		/** indexes released by sr_fib_delete */
+  uint32_t n_route_free;
+  uint32_t cap_route_free;
+
+  struct sr_rib_node *rib;	/** root of the radix trie */
+  uint32_t n_rib;
+
+  /* FIB_TRIE */
+  struct sr_fib_node *nodes;	/** nodes[0] is the root */
+  uint32_t n_nodes;
+  uint32_t cap_nodes;
+  uint32_t *leaves;		/** route index of each leaf */
+  uint32_t n_leaves;
+  uint32_t cap_leaves;
+  uint32_t dead_nodes;		/** left unused by incremental updates */
+  uint32_t dead_leaves;
+
+  /* FIB_DIR24 */
+  uint32_t *tbl24;		/** indexed by the first 24 bits */
+  uint32_t *tbl8;		/** chunks indexed by the last 8 bits */
+  uint32_t n_tbl8;
+  uint32_t cap_tbl8;
+  uint32_t tbl8_free;		/** first released chunk + 1, 0 if none */
+
+  void *image;			/** mapped image holding the arrays, 0 if owned */
+  size_t image_size;
+
+  struct sr_fib *retired;	/** next FIB waiting to be freed */
+};
+
+/**
+ * Header of a FIB image, a built FIB saved with sr_fib_save. The sections
+ * are the arrays of struct sr_fib as they are in memory, so a loaded image
+ * is used in place without parsing. Images only load on a host with the
+ * same byte order and struct sr_rt layout as the one that wrote them.
+ */
+struct sr_fib_image_hdr
+{
+  uint32_t magic;		/** FIB_IMAGE_MAGIC */
+  uint16_t version;		/** FIB_IMAGE_VERSION */
+  uint16_t type;		/** FIB_TRIE or FIB_DIR24 */
+  uint32_t route_size;		/** sizeof (struct sr_rt) */
+  uint32_t n_routes;
+  uint32_t n_nodes;
+  uint32_t n_leaves;
+  uint32_t n_tbl8;
+  uint32_t pad;
+  uint64_t size;		/** of the whole file */
+  uint64_t off_routes;		/** offsets of the sections, 0 if absent */
+  uint64_t off_nodes;
+  uint64_t off_leaves;
+  uint64_t off_tbl24;
+  uint64_t off_tbl8;
+};
+
+struct sr_fib *sr_fib_build (struct sr_rt *list, int type);
+void sr_fib_free (struct sr_fib *fib);
+struct sr_rt *sr_fib_lookup (const struct sr_fib *fib, uint32_t ip);
+void sr_fib_lookup_batch (const struct sr_fib *fib, const uint32_t *ip,
+			  struct sr_rt **out, int n);
+int sr_fib_insert (struct sr_fib *fib, const struct sr_rt *route);
+int sr_fib_delete (struct sr_fib *fib, struct in_addr dest,
+		   struct in_addr mask);
+size_t sr_fib_memory (const struct sr_fib *fib);
+int sr_fib_save (const struct sr_fib *fib, const char *filename);
+struct sr_fib *sr_fib_load (const char *filename);
+int sr_fib_is_image (const char *filename);
+int sr_fib_type (const char *name);
+const char *sr_fib_type_name (int type);
+
+/** multibit trie lookup */
+static inline uint32_t
+sr_fib_trie_index (const struct sr_fib *fib, uint32_t addr)
+{
+  const struct sr_fib_node *node = fib->nodes;
+  uint64_t key = (uint64_t) addr << 32;
+  unsigned int off = 0;
+  unsigned int v = (key >> (64 - FIB_STRIDE)) & (FIB_FANOUT - 1);
+
+  while (node->vector & (1ULL << v))
+    {
+      node = &fib->nodes[node->base1 +
+			 __builtin_popcountll (node->vector &
+					       ((2ULL << v) - 1)) - 1];
+      off += FIB_STRIDE;
+      v = (key >> (64 - FIB_STRIDE - off)) & (FIB_FANOUT - 1);
+    }
+  return fib->leaves[node->base0 +
+		     __builtin_popcountll (node->leafvec &
+					   ((2ULL << v) - 1)) - 1];
+}
+
+/** DIR-24-8 lookup */
+static inline uint32_t
+sr_fib_dir24_index (const struct sr_fib *fib, uint32_t addr)
+{
+  uint32_t e = fib->tbl24[addr >> 8];
+
+  if (e & FIB_DIR24_EXT)
+    e = fib->tbl8[(e & ~FIB_DIR24_EXT) * FIB_DIR24_CHUNK + (addr & 0xFF)];
+  return e;
+}
+
+/**
+ * Longest prefix match on an address in host byte order, returns the index
+ * of the matching route in fib->routes or FIB_NOROUTE.
+ */
+static inline uint32_t
+sr_fib_index (const struct sr_fib *fib, uint32_t addr)
+{
+  if (fib->type == FIB_DIR24)
+    return sr_fib_dir24_index (fib, addr);
+  return sr_fib_trie_index (fib, addr);
+}
+
+#endif
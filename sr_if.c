@@ -278,18 +278,15 @@ sr_if_clear (struct sr_instance *sr)
 {
   int i;
   assert (sr);
-  for (i = 0; i <= ARP_MAX_ENTRIES; i++)
+  for (i = 0; i < ARP_MAX_ENTRIES; i++)
     {
       if (sr->interfaces[i])
 	{
 	  free (sr->interfaces[i]);
 	  sr->interfaces[i] = 0;
 	}
-      if (sr->ip_iface_m[i])
-	{
-	  free (sr->ip_iface_m[i]);
-	  sr->ip_iface_m[i] = 0;
-	}
+      /* -- the same interfaces, by IP -- */
+      sr->ip_iface_m[i] = 0;
     }
   sr->if_list = 0;
 }
@@ -0,0 +1,223 @@
+/**
+ * Packet I/O backend routines: selection, the interface file of local
+ * backends, and sending through the backend in use.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_io.h"
+
+static const struct sr_io_ops *sr_io_backends[IO_TYPES] = {
+  &sr_io_vns,
+#ifdef _LINUX_
+  &sr_io_packet,
+  &sr_io_tap,
+  &sr_io_replay,
+#else
+  0,
+  0,
+  0,
+#endif /* _LINUX_ */
+};
+
+/**
+ * backend named name (-I), -1 if unknown or not available here
+ */
+int
+sr_io_type (const char *name)
+{
+  int i;
+
+  for (i = 0; i < IO_TYPES; i++)
+    if (sr_io_backends[i] && !strcmp (name, sr_io_backends[i]->name))
+      return i;
+  return -1;
+}
+
+/** parse a MAC address aa:bb:cc:dd:ee:ff */
+static int
+sr_io_parse_mac (const char *s, unsigned char *mac)
+{
+  unsigned int b[ETHER_ADDR_LEN];
+  int i;
+
+  if (sscanf (s, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4],
+	      &b[5]) != ETHER_ADDR_LEN)
+    return -1;
+  for (i = 0; i < ETHER_ADDR_LEN; i++)
+    mac[i] = b[i];
+  return 0;
+}
+
+/**
+ * Read the router interfaces from an interface file, one per line:
+ *
+ *   <interface> <device> <ip> [<mac>]
+ *
+ * e.g. 'eth0 veth0 10.0.1.1'. Interface names are the ones of the
+ * routing table (ethN), devices kernel interface names of fewer than
+ * IO_DEVLEN characters; without a MAC address, the backend picks one.
+ */
+static int
+sr_io_load_ifaces (struct sr_instance *sr, const char *filename)
+{
+  char line[256], name[sr_IFACE_NAMELEN], dev[32], ip[32], mac[32];
+  unsigned char addr[ETHER_ADDR_LEN];
+  struct in_addr in;
+  struct sr_io_port *port;
+  FILE *fp;
+  int n, lineno = 0;
+
+  if (!(fp = fopen (filename, "r")))
+    {
+      perror (filename);
+      return -1;
+    }
+  while (fgets (line, sizeof (line), fp))
+    {
+      lineno++;
+      if (line[0] == '#')
+	continue;
+      if ((n = sscanf (line, "%31s %31s %31s %31s", name, dev, ip, mac)) <= 0)
+	continue;
+      memset (addr, 0, sizeof (addr));
+      if (n < 3 || strlen (dev) >= IO_DEVLEN || !inet_aton (ip, &in)
+	  || (n == 4 && sr_io_parse_mac (mac, addr))
+	  || strncmp (name, "eth", 3) || atoi (name + 3) >= IFACE_MAX
+	  || sr_find_interface (sr, name))
+	{
+	  fprintf (stderr, "%s:%d: bad interface line\n", filename, lineno);
+	  fclose (fp);
+	  return -1;
+	}
+
+      sr_add_interface (sr, name);
+      sr_set_ether_ip (sr, in.s_addr);
+      sr_set_ether_addr (sr, addr);
+      if (!(port = calloc (1, sizeof (struct sr_io_port))))
+	{
+	  fclose (fp);
+	  return -1;
+	}
+      memcpy (port->dev, dev, strlen (dev) + 1);	/* checked above */
+      port->iface = sr_find_interface (sr, name);
+      for (n = 0; n < IO_QUEUES; n++)
+	{
+	  port->q[n].ev.fd = -1;
+	  port->q[n].port = port;
+	}
+      port->queues = 1;
+      sr->io.ports[sr_name_index (name)] = port;
+    }
+  fclose (fp);
+  return 0;
+}
+
+/**
+ * Use backend type. Local backends read the interfaces from the file
+ * ifconfig and attach them to their devices; the VNS backend gets them
+ * from the server once connected.
+ */
+int
+sr_io_open (struct sr_instance *sr, int type, const char *ifconfig)
+{
+  assert (sr);
+  assert (type >= 0 && type < IO_TYPES && sr_io_backends[type]);
+
+  sr->io.type = type;
+  sr->io.ops = sr_io_backends[type];
+  if (type == IO_VNS)
+    return 0;
+
+  if (!ifconfig)
+    {
+      fprintf (stderr, "The %s backend needs an interface file (-i)\n",
+	       sr->io.ops->name);
+      return -1;
+    }
+  if (sr_io_load_ifaces (sr, ifconfig) || sr->io.ops->open (sr))
+    return -1;
+  if (sr_verify_routing_table (sr) != 0)
+    {
+      fprintf (stderr, "Routing table not consistent with interfaces\n");
+      return -1;
+    }
+  sr_print_if_list (sr);
+  printf ("<-- Ready to process packets --> \n");
+  return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ *
+ * Send a packet (ethernet header included!) of length 'len' on interface
+ * iface. The packet is copied, the caller keeps it.
+ *
+ *---------------------------------------------------------------------*/
+int
+sr_send_packet (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+		const char *iface)
+{
+  assert (sr);
+  assert (buf);
+  assert (iface);
+
+  return sr->io.ops->send (sr, buf, len, iface, 0);
+}
+
+/**
+ * Send a packet like sr_send_packet, from the buffer it was received in:
+ * the BUF_HEADROOM bytes before buf are free (packets given to
+ * sr_handlepacket), and the backend may send it without a copy.
+ */
+int
+sr_send_frame (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+	       const char *iface)
+{
+  assert (sr);
+  assert (buf);
+  assert (iface);
+
+  return sr->io.ops->send (sr, buf, len, iface, 1);
+}
+
+/**
+ * send the packets the backend queued (end of a burst)
+ */
+int
+sr_io_flush (struct sr_instance *sr)
+{
+  return sr->io.ops->flush (sr);
+}
+
+/**
+ * print the counters of the backend (SIGUSR1)
+ */
+void
+sr_io_print_stats (struct sr_instance *sr)
+{
+  sr->io.ops->print_stats (sr);
+}
+
+/**
+ * Close the backend and free the ports (exit)
+ */
+void
+sr_io_close (struct sr_instance *sr)
+{
+  int i;
+
+  assert (sr);
+
+  if (sr->io.ops && sr->io.ops->close)
+    sr->io.ops->close (sr);
+  for (i = 0; i < IFACE_MAX; i++)
+    {
+      free (sr->io.ports[i]);
+      sr->io.ports[i] = 0;
+    }
+}
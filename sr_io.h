@@ -0,0 +1,126 @@
+/**
+ * Packet I/O backends. The router receives through sr_handlepacket and
+ * sends through sr_send_packet and sr_send_frame, whichever backend moves
+ * the frames: the VNS server connection (sr_vns_comm.c), or on Linux
+ * AF_PACKET sockets with memory mapped rings on local interfaces
+ * (sr_afpacket.c) or tap devices (sr_tap.c), or the replay of a capture
+ * (sr_replay.c). Local backends take the router interfaces from an
+ * interface file instead of the VNS hardware information.
+ */
+
+#ifndef SR_IO_H
+#define SR_IO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "sr_if.h"
+#include "sr_event.h"
+
+struct sr_instance;
+
+/** Backends (-I) */
+#define IO_VNS 0
+#define IO_PACKET 1
+#define IO_TAP 2
+#define IO_REPLAY 3
+#define IO_TYPES 4
+
+/** Longest device name, as IFNAMSIZ */
+#define IO_DEVLEN 16
+
+/** AF_PACKET rings: the kernel fills rx blocks of frames, returned as a
+    whole once full or after IO_RX_TIMEOUT ms; tx slots hold one frame */
+#define IO_RX_BLOCK_SIZE (1 << 20)
+#define IO_RX_BLOCKS 8
+#define IO_RX_TIMEOUT 1
+#define IO_TX_BLOCK_SIZE (64 * 1024)
+#define IO_TX_BLOCKS 16
+#define IO_FRAME_SIZE 2048
+
+/** Descriptors of an interface at most (tap queues) */
+#define IO_QUEUES 4
+
+/**
+ * Frames the router handles as one burst (sr_burst_add), so at most
+ * FIB_BATCH_MAX for its single sr_rt_locate_batch; also the frames the
+ * tap backend reads from a queue at once and queues for a device, and
+ * the ARP answers replay keeps
+ */
+#define IO_BATCH 64
+
+/** replay: the capture is replayed again until this long (ms) passed */
+#define IO_REPLAY_MS 1000
+
+struct sr_io_ops
+{
+  const char *name;
+  /** attach the interfaces of sr->if_list to their devices */
+  int (*open) (struct sr_instance *);
+  /** watch the descriptors of the backend in the event loop */
+  int (*start) (struct sr_instance *);
+  /** send a frame, with BUF_HEADROOM free bytes before it if headroom */
+  int (*send) (struct sr_instance *, uint8_t *, unsigned int, const char *,
+	       int headroom);
+  /** send the frames queued by send */
+  int (*flush) (struct sr_instance *);
+  void (*print_stats) (struct sr_instance *);
+  void (*close) (struct sr_instance *);
+};
+
+struct sr_io_port;
+struct sr_replay;
+
+/** a descriptor of a port */
+struct sr_io_queue
+{
+  struct sr_event ev;		/** first, handlers get the queue from it */
+  struct sr_io_port *port;
+};
+
+/**
+ * A router interface attached to a local device
+ */
+struct sr_io_port
+{
+  char dev[IO_DEVLEN];		/** device name */
+  struct sr_if *iface;
+  struct sr_io_queue q[IO_QUEUES];	/** AF_PACKET: the socket in q[0] */
+  uint32_t queues;
+  uint8_t *ring;		/** mapped rx then tx ring */
+  size_t ring_len;
+  uint32_t rx_block;		/** next rx block to read */
+  uint32_t tx_frame;		/** next tx frame to fill */
+  uint32_t tx_pending;		/** frames filled since the last kick */
+  uint8_t *tx_buf;		/** tap: copies of the frames to send */
+  struct iovec tx_iov[IO_BATCH];	/** tap: frames to send */
+  uint64_t rx;
+  uint64_t tx;
+  uint64_t drops;		/** frames not sent, tx ring full */
+  uint64_t rx_drops;		/** dropped by the kernel, rx ring full */
+  uint64_t oversize;		/** AF_PACKET: frames larger than a tx slot */
+};
+
+struct sr_io
+{
+  const struct sr_io_ops *ops;
+  int type;			/** IO_VNS ... */
+  struct sr_io_port *ports[IFACE_MAX];	/** by interface index */
+  uint8_t *rx_buf;		/** tap: the batch of frames read last */
+  const char *capture;		/** replay: pcap file replayed (-R) */
+  struct sr_replay *replay;	/** replay: its frames and counters */
+};
+
+extern const struct sr_io_ops sr_io_vns;
+#ifdef _LINUX_
+extern const struct sr_io_ops sr_io_packet;
+extern const struct sr_io_ops sr_io_tap;
+extern const struct sr_io_ops sr_io_replay;
+#endif /* _LINUX_ */
+
+int sr_io_type (const char *name);
+int sr_io_open (struct sr_instance *, int type, const char *ifconfig);
+int sr_io_flush (struct sr_instance *);
+void sr_io_print_stats (struct sr_instance *);
+void sr_io_close (struct sr_instance *);
+
+#endif
@@ -2,9 +2,21 @@
  * Routines for handling IP packets
  */
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_csum.h"
+
+#ifdef _DEBUG_
+static int sr_ip_csum_cover (struct sr_bundle *, int l4);
+static void sr_ip_csum_check (struct sr_bundle *, int l4, int before);
+#define CSUM_COVER(h, l4) sr_ip_csum_cover (h, l4)
+#define CSUM_CHECK(h, l4, before) sr_ip_csum_check (h, l4, before)
+#else
+#define CSUM_COVER(h, l4) 0
+#define CSUM_CHECK(h, l4, before) ((void) (before))
+#endif /* _DEBUG_ */
 
 /**
  * Swaps the ethernet address and ip when sending back packet on  
@@ -67,6 +79,8 @@ sr_icmp_unreachable (struct sr_bundle *h)
   /* The IP header followed by 8 bytes of the original data from datagram */
   memcpy (data, (uint8_t *) & p->ip, ICMP_TIMEOUT_SIZE);
   receiver = sr_rt_locate(h->sr, p->ip.ip_dst.s_addr);
+  if (!receiver)
+    return 0;
   p->ip.ip_dst.s_addr = h->sr->interfaces[ receiver->ifidx ]->ip;
 
   sr_ip_reverse (p, 60); //ip+icmp+data = 60
@@ -82,11 +96,10 @@ sr_icmp_unreachable (struct sr_bundle *h)
   /* clear data from unused field */
   p->d.icmp.fields.timeout.unused = 0;
 
-  /* data from original */
-  memcpy (p->d.icmp.data, data, ICMP_TIMEOUT_SIZE);
-
+  /* data from original, summed as it is copied */
   p->d.icmp.checksum =
-    sr_ip_checksum ((uint16_t *) & p->d.icmp, (ICMP_TIMEOUT_SIZE + 8));
+    sr_csum_fold (sr_csum_copy (p->d.icmp.data, data, ICMP_TIMEOUT_SIZE,
+				sr_csum_partial (&p->d.icmp, 8, 0)));
 
   /* recalculate size of packet */
   h->len = sizeof (struct sr_ethernet_hdr) + ntohs (p->ip.ip_len);
@@ -118,11 +131,7 @@ sr_icmp_handler (struct sr_bundle *h)
     case ICMP_ECHO_REQUEST:
       Debug ("IP - ICMP - ECHO REQUEST\n");
       sr_ip_reverse (p, ntohs (ip->ip_len));
-      p->d.icmp.type = 0;
-      p->d.icmp.code = 0;
-      p->d.icmp.checksum = 0;
-      len = h->raw_len - sizeof (h->pkt->eth) - sizeof (h->pkt->ip);
-      p->d.icmp.checksum = sr_ip_checksum ((uint16_t *) & p->d.icmp, len);
+      sr_icmp_retype (h, ICMP_ECHO_REPLY, 0);
       return 1;
 
     case ICMP_TRACEROUTE:
@@ -170,57 +179,216 @@ sr_ip_handler (struct sr_bundle *h)
 }
 
 /**
- * Decrement TTL and forward packet
+ * Decrement TTL and forward packet. The checksum is updated from the
+ * TTL and protocol word alone (RFC 1624); the header was summed in full
+ * when it was checked on arrival.
  */
 int
 sr_ip_forward (struct sr_bundle *h)
 {
   struct ip *ip;
+  uint16_t old, new;
+  int check;
 
   assert (h);
 
   ip = &h->pkt->ip;
+  check = CSUM_COVER (h, 0);
+  memcpy (&old, &ip->ip_ttl, 2);
   ip->ip_ttl -= 0x01;
-  ip->ip_sum = 0;
-  ip->ip_sum = sr_ip_checksum ((uint16_t *) ip, (ip->ip_hl * 4));
-  Debug
-    ("IP: ttl is %d, Recalculate ip checksum %X (checked value %X)\n",
-     ip->ip_ttl, ntohs (h->pkt->ip.ip_sum), sr_ip_checksum ((uint16_t *) ip,
-							    (ip->ip_hl * 4)));
+  memcpy (&new, &ip->ip_ttl, 2);
+  ip->ip_sum = sr_csum_update16 (ip->ip_sum, old, new);
+  CSUM_CHECK (h, 0, check);
+  Debug ("IP: ttl is %d, updated ip checksum %X\n", ip->ip_ttl,
+	 ntohs (ip->ip_sum));
 
   return 1;
 }
 
 /**
- * Checksum calculations
- *
- * Reference : http://www.faqs.org/rfcs/rfc1071.html 
- *  
- * 
+ * NAT-style rewrite of the source (dst 0) or destination (dst 1) address
+ * of a packet to addr and, for TCP and UDP, of the matching port to port
+ * unless it is 0 (both in network byte order). The IP and transport
+ * checksums are updated from the changed words. Returns 1, or 0 if the
+ * frame is too short for the headers to rewrite.
  */
-uint16_t
-sr_ip_checksum (uint16_t const data[], uint16_t tot_len)
+int
+sr_ip_rewrite (struct sr_bundle *h, int dst, uint32_t addr, uint16_t port)
 {
-  uint32_t sum = 0;
-  uint16_t words = tot_len / 2;
+  struct ip *ip;
+  uint8_t *l4 = NULL;
+  size_t addr_at, port_at, sum_at = 0;
+  uint32_t hl, old;
+  uint16_t old_port, sum = 0;
+  int ip_check, l4_check;
+
+  assert (h);
 
-  /*add up 2 octet parts */
-  while (words-- > 0)
+  ip = &h->pkt->ip;
+  hl = ip->ip_hl * 4;
+  if (hl < sizeof (struct ip) ||
+      h->len < sizeof (struct sr_ethernet_hdr) + hl)
+    return 0;
+
+  /* transport header, in the first fragment only; a UDP checksum of 0
+     means there is none */
+  if ((ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP) &&
+      !(ntohs (ip->ip_off) & IP_OFFMASK))
     {
-      sum += *(data++);
+      sum_at = ip->ip_p == IPPROTO_TCP ? offsetof (struct sr_tcp, checksum)
+	: offsetof (struct sr_udp, checksum);
+      if (h->len < sizeof (struct sr_ethernet_hdr) + hl + sum_at + 2)
+	return 0;
+      l4 = (uint8_t *) h->pkt + sizeof (struct sr_ethernet_hdr) + hl;
+      memcpy (&sum, l4 + sum_at, 2);
+      if (ip->ip_p == IPPROTO_UDP && !sum)
+	sum_at = 0;
     }
-  if (tot_len % 2)  /*handle odd case*/
+  else if (port && (ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP))
+    return 0;
+
+  ip_check = CSUM_COVER (h, 0);
+  l4_check = CSUM_COVER (h, 1);
+
+  addr_at = dst ? offsetof (struct ip, ip_dst) : offsetof (struct ip, ip_src);
+  memcpy (&old, (uint8_t *) ip + addr_at, 4);
+  memcpy ((uint8_t *) ip + addr_at, &addr, 4);
+  ip->ip_sum = sr_csum_update32 (ip->ip_sum, old, addr);
+  /* the addresses are in the pseudo header of the transport checksum */
+  if (sum_at)
+    sum = sr_csum_update32 (sum, old, addr);
+
+  if (l4 && port)
     {
-      	     
-      sum += (*data << 8);
+      port_at = dst ? offsetof (struct sr_tcp, dest_port)
+	: offsetof (struct sr_tcp, src_port);
+      memcpy (&old_port, l4 + port_at, 2);
+      memcpy (l4 + port_at, &port, 2);
+      if (sum_at)
+	sum = sr_csum_update16 (sum, old_port, port);
     }
 
-  /* 1s complement */
-  while (sum >> 16)
+  if (sum_at)
     {
-      sum = (sum >> 16) + (sum & 0xFFFF);
+      if (ip->ip_p == IPPROTO_UDP && !sum)
+	sum = 0xFFFF;
+      memcpy (l4 + sum_at, &sum, 2);
+      CSUM_CHECK (h, 1, l4_check);
     }
+  CSUM_CHECK (h, 0, ip_check);
+  return 1;
+}
 
-  /* invert */
-  return ((uint16_t) ~ sum);
+/**
+ * Change the type and code of an ICMP message in place, updating its
+ * checksum from the changed word
+ */
+void
+sr_icmp_retype (struct sr_bundle *h, uint8_t type, uint8_t code)
+{
+  struct sr_ip_comb *p;
+  uint16_t old, new;
+  int check;
+
+  assert (h);
+  p = h->pkt;
+
+  check = CSUM_COVER (h, 1);
+  memcpy (&old, &p->d.icmp, 2);
+  p->d.icmp.type = type;
+  p->d.icmp.code = code;
+  memcpy (&new, &p->d.icmp, 2);
+  p->d.icmp.checksum = sr_csum_update16 (p->d.icmp.checksum, old, new);
+  CSUM_CHECK (h, 1, check);
+}
+
+#ifdef _DEBUG_
+/**
+ * Full sum of what the IP header checksum (l4 0) or the transport
+ * checksum (l4 1, with the pseudo header for TCP and UDP) of a packet
+ * covers, -1 if it is not all in the frame. Debug builds check that an
+ * incremental update leaves it as it was.
+ */
+static int
+sr_ip_csum_cover (struct sr_bundle *h, int l4)
+{
+  struct ip *ip;
+  uint32_t hl, len;
+  uint8_t pseudo[4];
+  uint16_t sum = 0;
+
+  ip = &h->pkt->ip;
+  hl = ip->ip_hl * 4;
+  if (!l4)
+    return sr_csum_partial (ip, hl, 0);
+
+  len = ntohs (ip->ip_len);
+  if (len < hl || h->len < sizeof (struct sr_ethernet_hdr) + len ||
+      (ntohs (ip->ip_off) & (IP_MF | IP_OFFMASK)))
+    return -1;
+  len -= hl;
+  if (ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP)
+    {
+      pseudo[0] = 0;
+      pseudo[1] = ip->ip_p;
+      pseudo[2] = len >> 8;
+      pseudo[3] = len & 0xFF;
+      sum = sr_csum_partial ((uint8_t *) ip + offsetof (struct ip, ip_src),
+			     8, 0);
+      sum = sr_csum_partial (pseudo, 4, sum);
+    }
+  return sr_csum_partial ((uint8_t *) ip + hl, len, sum);
+}
+
+static void
+sr_ip_csum_check (struct sr_bundle *h, int l4, int before)
+{
+  int after = sr_ip_csum_cover (h, l4);
+
+  if (before != after)
+    Debug ("IP: incremental %s checksum update is wrong (sum %X, was %X)\n",
+	   l4 ? "transport" : "header", after, before);
+  assert (before == after);
+}
+#endif /* _DEBUG_ */
+
+/**
+ * Checksum calculations, by the checksum engine
+ *
+ * Reference : http://www.faqs.org/rfcs/rfc1071.html
+ * An odd last byte is padded with a zero byte.
+ */
+uint16_t
+sr_ip_checksum (uint16_t const data[], uint16_t tot_len)
+{
+  return sr_csum_fold (sr_csum_partial (data, tot_len, 0));
+}
+
+/**
+ * Hash of the flow of a packet: addresses, protocol and, for TCP and UDP,
+ * ports. Fragments hash without ports (only the first one carries them)
+ * so all fragments of a packet take the same path.
+ */
+uint32_t
+sr_ip_flow_hash (struct sr_bundle *h)
+{
+  struct ip *ip;
+  uint32_t hash, ports = 0;
+  unsigned int hl;
+
+  assert (h);
+
+  ip = &h->pkt->ip;
+  hl = ip->ip_hl * 4;
+  if ((ip->ip_p == IPPROTO_TCP || ip->ip_p == IPPROTO_UDP) &&
+      !(ntohs (ip->ip_off) & (IP_MF | IP_OFFMASK)) &&
+      h->len >= sizeof (struct sr_ethernet_hdr) + hl + 4)
+    memcpy (&ports, (uint8_t *) ip + hl, 4);
+
+  /* -- murmur3 finalizer to mix the fields into every bit -- */
+  hash = ip->ip_src.s_addr * 0x9E3779B1 + ip->ip_dst.s_addr;
+  hash = (hash ^ (hash >> 16)) * 0x85EBCA6B;
+  hash ^= ports + ip->ip_p;
+  hash = (hash ^ (hash >> 13)) * 0xC2B2AE35;
+  return hash ^ (hash >> 16);
 }
@@ -13,6 +13,10 @@
 /** size in bytes of time exceeded data payload */
 #define ICMP_TIMEOUT_SIZE 32
 
+/** size in bytes of the ICMP errors built in place of the packet they
+    answer (ethernet, IP and ICMP headers, data) */
+#define ICMP_ERROR_LEN (14 + 20 + 8 + ICMP_TIMEOUT_SIZE)
+
 #ifndef IPPROTO_ICMP
 #define IPPROTO_ICMP 0x0001
 #endif
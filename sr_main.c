@@ -34,6 +34,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 
 extern char *optarg;
 
@@ -59,6 +60,9 @@ static void sr_load_rt_wrap (struct sr_instance *sr, char *rtable);
 
 struct sr_instance sr;
 void sr_main_abort (int sig);
+void sr_main_reload (int sig);
+void sr_main_stats (int sig);
+static volatile sig_atomic_t sr_stats_requested;
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -72,22 +76,34 @@ main (int argc, char **argv)
   char *user = 0;
   char *server = DEFAULT_SERVER;
   char *rtable = DEFAULT_RTABLE;
+  int fib_type = FIB_TRIE;
+  char *image = 0;
+  unsigned int arp_size = ARP_TABLE_SIZE;
+  unsigned int buf_size = BUFFSIZE;
+  unsigned int stale_ms = STALE_TIMEOUT * 1000;
+  int buf_policy = BUF_TAIL;
+  unsigned int tx_delay = VNS_TX_DELAY;
   char *template = NULL;
   unsigned int port = DEFAULT_PORT;
   unsigned int topo = DEFAULT_TOPO;
   char *logfile = 0;
+  int io_type = IO_VNS;
+  char *ifconfig = 0;
+  char *capture = 0;
 
   uint32_t mask = DEF_MASK;
   char *subnet_s = DEF_SUBNET;
-  struct in_addr subnetaddr;
+  struct in_addr subnetaddr, maskaddr;
   uint32_t subnet;
 
   (void) signal (SIGINT, sr_main_abort);
+  (void) signal (SIGHUP, sr_main_reload);
+  (void) signal (SIGUSR1, sr_main_stats);
 
   printf ("Using %s\n", VERSION_INFO);
 
 
-  while ((c = getopt (argc, argv, "ha:s:v:p:u:t:r:l:T:S:M:")) != EOF)
+  while ((c = getopt (argc, argv, "ha:s:v:p:u:t:r:F:C:A:b:d:e:w:l:T:S:M:I:i:R:")) != EOF)
     {
       switch (c)
 	{
@@ -119,9 +135,65 @@ main (int argc, char **argv)
 	case 'r':
 	  rtable = optarg;
 	  break;
+	case 'F':
+	  if ((fib_type = sr_fib_type (optarg)) < 0)
+	    {
+	      fprintf (stderr, "Unknown FIB type %s\n", optarg);
+	      usage (argv[0]);
+	      exit (1);
+	    }
+	  break;
+	case 'C':
+	  image = optarg;
+	  break;
+	case 'A':
+	  arp_size = atoi ((char *) optarg);
+	  break;
+	case 'b':
+	  buf_size = atoi ((char *) optarg);
+	  break;
+	case 'd':
+	  if ((buf_policy = sr_buf_policy (optarg)) < 0)
+	    {
+	      fprintf (stderr, "Unknown drop policy %s\n", optarg);
+	      usage (argv[0]);
+	      exit (1);
+	    }
+	  break;
+	case 'e':
+	  stale_ms = atoi ((char *) optarg);
+	  break;
+	case 'w':
+	  tx_delay = atoi ((char *) optarg);
+	  break;
 	case 'T':
 	  template = optarg;
 	  break;
+	case 'S':
+	  subnet_s = optarg;
+	  break;
+	case 'M':
+	  if (!inet_aton (optarg, &maskaddr))
+	    {
+	      fprintf (stderr, "Bad subnet mask %s\n", optarg);
+	      exit (1);
+	    }
+	  mask = ntohl (maskaddr.s_addr);
+	  break;
+	case 'I':
+	  if ((io_type = sr_io_type (optarg)) < 0)
+	    {
+	      fprintf (stderr, "Unknown I/O backend %s\n", optarg);
+	      usage (argv[0]);
+	      exit (1);
+	    }
+	  break;
+	case 'i':
+	  ifconfig = optarg;
+	  break;
+	case 'R':
+	  capture = optarg;
+	  break;
 
 	}			/* switch */
     }				/* -- while -- */
@@ -141,6 +213,11 @@ main (int argc, char **argv)
 
   /* -- zero out sr instance -- */
   sr_init_instance (&sr);
+  sr_arp_init (&sr, arp_size);
+  sr.buffer.capacity = buf_size ? buf_size : 1;
+  sr.buffer.stale_ms = stale_ms ? stale_ms : 1;
+  sr.buffer.policy = buf_policy;
+  sr.tx_delay_us = tx_delay;
 
 
 
@@ -148,6 +225,7 @@ main (int argc, char **argv)
   sr.subnet = subnet;
   strncpy (sr.subnet_s, subnet_s, 16);
   sr.mask = htonl (mask);
+  sr.fib_type = fib_type;
 
 
   /* -- set up routing table from file -- */
@@ -155,6 +233,9 @@ main (int argc, char **argv)
     {
       sr.template[0] = '\0';
       sr_load_rt_wrap (&sr, rtable);
+      /* -- compile the routing table into an image and stop -- */
+      if (image)
+	exit (sr_rt_save_image (&sr, image) != 0);
     }
   else
     strncpy (sr.template, template, 30);
@@ -183,21 +264,32 @@ main (int argc, char **argv)
 	}
     }
 
-  Debug ("Client %s connecting to Server %s:%d\n", sr.user, server, port);
-  if (template)
-    Debug ("Requesting topology template %s\n", template);
-  else
+  /* -- local backends attach the interfaces of the interface file -- */
+  if (io_type != IO_VNS)
     {
-      Debug ("Requesting topology %d\n", topo);
+      sr.io.capture = capture;
+      if (sr_io_open (&sr, io_type, ifconfig) != 0)
+	return 1;
     }
-
-  /* connect to server and negotiate session */
-  if (sr_connect_to_server (&sr, port, server) == -1)
+  else
     {
-      return 1;
+      Debug ("Client %s connecting to Server %s:%d\n", sr.user, server,
+	     port);
+      if (template)
+	Debug ("Requesting topology template %s\n", template);
+      else
+	{
+	  Debug ("Requesting topology %d\n", topo);
+	}
+
+      /* connect to server and negotiate session */
+      if (sr_connect_to_server (&sr, port, server) == -1)
+	{
+	  return 1;
+	}
     }
 
-  if (template != NULL)
+  if (template != NULL && io_type == IO_VNS)
     {				/* we've recv'd the rtable now, so read it in */
       Debug ("Connected to new instantiation of topology template %s\n",
 	     template);
@@ -207,11 +299,32 @@ main (int argc, char **argv)
   /* call router init (for arp subsystem etc.) */
   sr_init (&sr);
 
+#ifdef _LINUX_
+  /* -- signals go to the event loop, before the reload thread starts -- */
+  if (sr_event_init (&sr) != 0)
+    return 1;
+#endif /* _LINUX_ */
+
+  /* reload the routing table on SIGHUP */
+  if (sr_rt_reload_init (&sr) != 0)
+    return 1;
+
+#ifdef _LINUX_
+  sr_event_loop (&sr);
+#else
   /* -- whizbang main loop ;-) */
   while (sr_read_from_server (&sr) == 1)
     {
-      sr_arp_check_age (&sr);
+      sr_timer_run (&sr.timers, &sr);
+      sr_io_flush (&sr);
+      sr_rt_quiescent (&sr);
+      if (sr_stats_requested)
+	{
+	  sr_stats_requested = 0;
+	  sr_print_stats (&sr);
+	}
     }
+#endif /* _LINUX_ */
 
   sr_destroy_instance (&sr);
 
@@ -230,8 +343,16 @@ usage (char *argv0)
   printf ("Format: %s [-h] [-v host] [-s server] [-p port] \n", argv0);
   printf
     ("           [-T template_name] [-u username] [-a auth_key_filename]\n");
-  printf ("           [-t topo id] [-r routing table] \n");
-  printf ("           [-l log file] \n");
+  printf ("           [-t topo id] [-r routing table] [-F trie|dir24]\n");
+  printf ("           [-C FIB image to write from the routing table]\n");
+  printf ("           [-A ARP table size] [-l log file] \n");
+  printf ("           [-b buffered packets] [-d tail|head|fair|red]\n");
+  printf ("           [-e ms before buffered packets are dropped]\n");
+  printf ("           [-w us sent packets may wait to be written together]\n");
+  printf ("           [-S subnet] [-M subnet mask]\n");
+  printf ("           [-I vns|packet|tap|replay] "
+	  "[-i interface file of local backends]\n");
+  printf ("           [-R capture replayed by the replay backend]\n");
   printf ("   defaults server=%s port=%d host=%s  \n",
 	  DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST);
 }				/* -- usage -- */
@@ -278,6 +399,37 @@ sr_main_abort (int signal)
   exit (0);
 }
 
+/**
+ * SIGHUP: reload the routing table file while forwarding continues
+ */
+void
+sr_main_reload (int signal)
+{
+  sr_rt_reload (&sr);
+}
+
+/**
+ * SIGUSR1: print the packets sent through each equal cost path, the ARP
+ * counters and the buffer pool occupancy, from the main loop
+ */
+void
+sr_main_stats (int signal)
+{
+  sr_stats_requested = 1;
+}
+
+/**
+ * print the statistics of all modules (SIGUSR1)
+ */
+void
+sr_print_stats (struct sr_instance *sr)
+{
+  sr_io_print_stats (sr);
+  sr_print_path_stats (sr);
+  sr_arp_print_stats (sr);
+  sr_buf_print_stats (sr);
+}
+
 static void
 sr_destroy_instance (struct sr_instance *sr)
 {
@@ -290,7 +442,16 @@ sr_destroy_instance (struct sr_instance *sr)
     }
   sr_rt_clear (sr);		//frees up routing, interface tables and buffer to prevent mem leaks
   sr_if_clear (sr);
+  sr_arp_clear (sr);
   sr_buf_clear (sr);
+  free (sr->rx_ring);
+  sr->rx_ring = 0;
+  free (sr->tx_buf);
+  sr->tx_buf = 0;
+  sr_io_close (sr);
+#ifdef _LINUX_
+  sr_event_clear (sr);
+#endif /* _LINUX_ */
 
 
 }
@@ -309,16 +470,32 @@ sr_init_instance (struct sr_instance *sr)
   assert (sr);
 
   sr->sockfd = -1;
+  sr->rx_ring = 0;
+  sr->rx_head = sr->rx_tail = 0;
+  sr->tx_buf = 0;
+  sr->tx_count = sr->tx_bytes = sr->tx_copied = 0;
+  sr->tx_delay_us = VNS_TX_DELAY;
+  sr->loop.epfd = -1;
+  memset (&sr->io, 0, sizeof (struct sr_io));
+  sr->io.ops = &sr_io_vns;
+  sr->io.type = IO_VNS;
   sr->user[0] = 0;
   sr->host[0] = 0;
   sr->topo_id = 0;
   sr->if_list = 0;
   sr->routing_table = 0;
+  sr->rt_tail = 0;
+  sr->fib = 0;
+  sr->fib_type = FIB_TRIE;
+  sr->fib_retired = 0;
+  sr->rt_reload_list = 0;
+  sr->rtable_fn[0] = 0;
   sr->logfile = 0;
 
-  Debug ("sr_init: zero out arp table and reset refresh timer\n");
-  memset (sr->arp_table, 0, sizeof (struct sr_arp_entry) * ARP_MAX_ENTRIES);
-  time (&sr->arp_last_reftime);
+  Debug ("sr_init: reset arp table and timers\n");
+  memset (&sr->arp_table, 0, sizeof (struct sr_arp_table));
+  sr_timer_init (&sr->timers);
+  memset (&sr->dcache, 0, sizeof (struct sr_dcache));
   Debug ("sr_init: zero out interface list \n");
   memset (sr->ip_iface_m, 0, sizeof (struct sr_if *) * ARP_MAX_ENTRIES);
   memset (sr->interfaces, 0, sizeof (struct sr_if *) * ARP_MAX_ENTRIES);
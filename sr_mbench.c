@@ -0,0 +1,722 @@
+/**
+ * Micro-benchmarks of the per-packet primitives of the router, built and
+ * run by 'make bench' after sr_bench: route lookups (sr_rt_locate) over
+ * table sizes and prefix length distributions, ARP table lookups and
+ * updates, buffering a packet and taking it out again, the IP checksum
+ * over packet sizes (and each checksum implementation the CPU runs, with
+ * and without a copy), interface lookups by name, and sr_handlepacket from
+ * receive to send for the common cases, and NAT-style header rewrites.
+ *
+ * Each case runs on one pinned CPU: it is warmed up, then timed over
+ * MBENCH_SAMPLES samples of a fixed number of operations, and the time
+ * per operation is reported as percentiles over the samples. '-m' prints
+ * CSV, one line per case, for tracking results over time.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_fib.h"
+#include "sr_csum.h"
+
+/** samples of a case, and the time a sample takes at least (us) */
+#define MBENCH_SAMPLES 200
+#define MBENCH_SAMPLE_US 500
+/** warmup before the samples of a case (ms) */
+#define MBENCH_WARMUP_MS 50
+/** interface i is 10.0.i.(i + 1), its host 10.0.i.MBENCH_HOST (the
+    interface addresses differ in their last byte, see sr_if_get_iface_ip) */
+#define MBENCH_HOST 100
+
+/** addresses, names or frames a case cycles through */
+#define MBENCH_INPUTS 4096
+#define MBENCH_IFACES 4
+
+/** prefix length distributions of the route lookup tables */
+#define MBENCH_DIST_BACKBONE 0	/** mostly /24, then /16 to /23 */
+#define MBENCH_DIST_24 1	/** all /24 */
+#define MBENCH_DIST_UNIFORM 2	/** /8 to /32, evenly */
+#define MBENCH_DISTS 3
+
+static const char *mbench_dist_names[MBENCH_DISTS] =
+  { "backbone", "all24", "uniform" };
+
+/** an operation of a case, n times; returns something to keep */
+typedef uintptr_t (*mbench_fn) (uint32_t n);
+
+static struct sr_instance sr;
+static int mbench_csv;
+
+/* -- inputs of the current case -- */
+static uint32_t *mbench_addrs;
+static uint8_t *mbench_frames[MBENCH_INPUTS];
+static uint32_t mbench_frame_len[MBENCH_INPUTS];
+static char mbench_names[MBENCH_INPUTS][sr_IFACE_NAMELEN];
+static uint8_t *mbench_data;
+static uint8_t *mbench_copy;
+static uint32_t mbench_len;
+static uint32_t mbench_next;
+
+/* -- sr_main.c is not linked: what the router uses from it -- */
+
+int
+sr_verify_routing_table (struct sr_instance *sr)
+{
+  return 0;
+}
+
+void
+sr_print_stats (struct sr_instance *sr)
+{
+}
+
+static uint64_t mbench_sent;
+
+/** frames sent are counted and dropped */
+static int
+mbench_io_send (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+		const char *iface, int headroom)
+{
+  mbench_sent++;
+  return 0;
+}
+
+static int
+mbench_io_flush (struct sr_instance *sr)
+{
+  return 0;
+}
+
+static const struct sr_io_ops mbench_io = {
+  "mbench", 0, 0, mbench_io_send, mbench_io_flush, 0, 0
+};
+
+static uint64_t
+mbench_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t
+mbench_random (void)
+{
+  return ((uint32_t) random () << 16) ^ (uint32_t) random ();
+}
+
+static int
+mbench_cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Warm fn up, find how many operations take MBENCH_SAMPLE_US, time
+ * MBENCH_SAMPLES samples of that many and print the time per operation
+ */
+static void
+mbench_run (const char *name, const char *param, mbench_fn fn)
+{
+  double ns[MBENCH_SAMPLES], sum = 0;
+  uint64_t start, t;
+  uintptr_t sink = 0;
+  uint32_t n = 1;
+  int i;
+
+  start = mbench_ns ();
+  while ((t = mbench_ns ()) - start < MBENCH_WARMUP_MS * 1000000ULL)
+    {
+      sink += fn (n);
+      if (mbench_ns () - t < MBENCH_SAMPLE_US * 1000ULL)
+	n *= 2;
+    }
+
+  for (i = 0; i < MBENCH_SAMPLES; i++)
+    {
+      t = mbench_ns ();
+      sink += fn (n);
+      ns[i] = (double) (mbench_ns () - t) / n;
+      sum += ns[i];
+    }
+  qsort (ns, MBENCH_SAMPLES, sizeof (double), mbench_cmp);
+
+  if (mbench_csv)
+    printf ("%s,%s,%u,%.2f,%.2f,%.2f,%.2f,%.2f\n", name, param, n, ns[0],
+	    ns[MBENCH_SAMPLES / 2], ns[MBENCH_SAMPLES * 9 / 10],
+	    ns[MBENCH_SAMPLES * 99 / 100], sum / MBENCH_SAMPLES);
+  else
+    printf ("%-14s %-20s %9.1f %9.1f %9.1f %9.1f %8.2f\n", name, param,
+	    ns[0], ns[MBENCH_SAMPLES / 2], ns[MBENCH_SAMPLES * 9 / 10],
+	    ns[MBENCH_SAMPLES * 99 / 100], 1e3 / ns[MBENCH_SAMPLES / 2]);
+  if (sink == 1)
+    printf ("\n");
+}
+
+/* -- route lookups -- */
+
+static int
+mbench_prefix_len (int dist)
+{
+  int r = random () % 100;
+
+  if (dist == MBENCH_DIST_24)
+    return 24;
+  if (dist == MBENCH_DIST_UNIFORM)
+    return 8 + random () % 25;
+  if (r < 55)
+    return 24;
+  if (r < 90)
+    return 16 + random () % 8;
+  if (r < 97)
+    return 25 + random () % 8;
+  return 8 + random () % 8;
+}
+
+/** routing table of n routes and a default route, on the interfaces */
+static void
+mbench_routes (int n, int dist)
+{
+  struct in_addr dest, gw, mask;
+  char name[sr_IFACE_NAMELEN];
+  uint32_t m;
+  int i, len;
+
+  for (i = 0; i <= n; i++)
+    {
+      len = i == n ? 0 : mbench_prefix_len (dist);
+      m = len ? 0xFFFFFFFF << (32 - len) : 0;
+      mask.s_addr = htonl (m);
+      dest.s_addr = htonl (mbench_random () & m);
+      gw.s_addr = htonl (mbench_random ());
+      snprintf (name, sizeof (name), "eth%d", i % MBENCH_IFACES);
+      sr_add_rt_entry (&sr, dest, gw, mask, name);
+    }
+}
+
+/** destinations, half of them inside a route */
+static void
+mbench_route_addrs (void)
+{
+  struct sr_rt *routes[MBENCH_INPUTS], *r;
+  int i, n;
+
+  for (r = sr.routing_table, n = 0; r && n < MBENCH_INPUTS; r = r->next)
+    routes[n++] = r;
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    {
+      r = routes[random () % n];
+      if (i & 1)
+	mbench_addrs[i] = htonl (mbench_random () | 1);
+      else
+	mbench_addrs[i] = r->dest.s_addr
+	  | (htonl (mbench_random () | 1) & ~r->mask.s_addr);
+    }
+}
+
+static uintptr_t
+mbench_rt_locate (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += (uintptr_t) sr_rt_locate (&sr, mbench_addrs[mbench_next++
+							 % MBENCH_INPUTS]);
+  return sink;
+}
+
+static void
+mbench_rt (const int *sizes)
+{
+  char param[64];
+  int s, dist, type;
+
+  for (s = 0; sizes[s]; s++)
+    for (dist = 0; dist < MBENCH_DISTS; dist++)
+      {
+	srandom (s * MBENCH_DISTS + dist + 1);
+	mbench_routes (sizes[s], dist);
+	mbench_route_addrs ();
+	for (type = FIB_TRIE; type <= FIB_DIR24; type++)
+	  {
+	    sr.fib = sr_fib_build (sr.routing_table, type);
+	    snprintf (param, sizeof (param), "%s/%d/%s",
+		      sr_fib_type_name (type), sizes[s],
+		      mbench_dist_names[dist]);
+	    mbench_run ("rt_locate", param, mbench_rt_locate);
+	    sr_fib_free (sr.fib);
+	    sr.fib = 0;
+	  }
+	sr_rt_clear (&sr);
+      }
+}
+
+/* -- ARP table -- */
+
+static uintptr_t
+mbench_arp_get (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += (uintptr_t) sr_arp_get (&sr, mbench_addrs[mbench_next++
+						      % MBENCH_INPUTS]);
+  return sink;
+}
+
+static uintptr_t
+mbench_arp_set (uint32_t n)
+{
+  static unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += (uintptr_t) sr_arp_set (&sr, mbench_addrs[mbench_next++
+						      % MBENCH_INPUTS],
+				    mac, sr.if_list);
+  return sink;
+}
+
+/** lookups hit entries, then miss them; updates refresh them */
+static void
+mbench_arp (int entries)
+{
+  static unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+  char param[64];
+  int i;
+
+  for (i = 0; i < entries; i++)
+    sr_arp_set (&sr, htonl (0x0a000001 + i), mac, sr.if_list);
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    mbench_addrs[i] = htonl (0x0a000001 + random () % entries);
+  snprintf (param, sizeof (param), "%d/hit", entries);
+  mbench_run ("arp_get", param, mbench_arp_get);
+  snprintf (param, sizeof (param), "%d/refresh", entries);
+  mbench_run ("arp_set", param, mbench_arp_set);
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    mbench_addrs[i] = htonl (0x0b000000 + 1 + i);
+  snprintf (param, sizeof (param), "%d/miss", entries);
+  mbench_run ("arp_get", param, mbench_arp_get);
+  sr_arp_clear (&sr);
+  sr_arp_init (&sr, ARP_TABLE_SIZE);
+}
+
+/* -- buffer -- */
+
+static uintptr_t
+mbench_buf_add_remove (uint32_t n)
+{
+  struct sr_arp_entry *nh;
+  struct sr_bundle h;
+  uintptr_t sink = 0;
+
+  memset (&h, 0, sizeof (h));
+  h.sr = &sr;
+  h.raw = mbench_data;
+  h.raw_len = h.len = mbench_len;
+  while (n--)
+    {
+      nh = sr_arp_get (&sr, mbench_addrs[0]);
+      h.buffered = 0;
+      sr_buf_add (&h, nh);
+      sink += (uintptr_t) nh->pending;
+      sr_buf_remove (&sr, nh->pending, BUF_SENT);
+    }
+  return sink;
+}
+
+/** a packet queued on a neighbour and removed as sent, over sizes */
+static void
+mbench_buf (const int *sizes)
+{
+  static unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 0, 1 };
+  char param[64];
+  int s;
+
+  mbench_addrs[0] = htonl (0x0a000001);
+  sr_arp_set (&sr, mbench_addrs[0], mac, sr.if_list);
+  for (s = 0; sizes[s]; s++)
+    {
+      mbench_len = sizes[s];
+      snprintf (param, sizeof (param), "%d", sizes[s]);
+      mbench_run ("buf_add_remove", param, mbench_buf_add_remove);
+    }
+  sr_arp_clear (&sr);
+  sr_arp_init (&sr, ARP_TABLE_SIZE);
+}
+
+/* -- checksum -- */
+
+static uintptr_t
+mbench_checksum (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += sr_ip_checksum ((uint16_t *) mbench_data, mbench_len);
+  return sink;
+}
+
+static uintptr_t
+mbench_csum_partial (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += sr_csum_partial (mbench_data, mbench_len, 0);
+  return sink;
+}
+
+static uintptr_t
+mbench_csum_copy (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += sr_csum_copy (mbench_copy, mbench_data, mbench_len, 0);
+  return sink;
+}
+
+static void
+mbench_checksums (const int *sizes)
+{
+  char param[64];
+  int s, type, best = sr_csum_current ();
+
+  for (s = 0; sizes[s]; s++)
+    {
+      mbench_len = sizes[s];
+      snprintf (param, sizeof (param), "%d", sizes[s]);
+      mbench_run ("ip_checksum", param, mbench_checksum);
+    }
+
+  /* every implementation, over the sizes the dispatch hands it */
+  for (type = 0; type < CSUM_TYPES; type++)
+    {
+      if (sr_csum_use (type) < 0)
+	continue;
+      for (s = 0; sizes[s]; s++)
+	{
+	  if (sizes[s] < CSUM_SHORT)
+	    continue;
+	  mbench_len = sizes[s];
+	  snprintf (param, sizeof (param), "%s/%d", sr_csum_type_name (type),
+		    sizes[s]);
+	  mbench_run ("csum_partial", param, mbench_csum_partial);
+	  mbench_run ("csum_copy", param, mbench_csum_copy);
+	}
+    }
+  sr_csum_use (best);
+}
+
+/* -- interfaces -- */
+
+static uintptr_t
+mbench_find_interface (uint32_t n)
+{
+  uintptr_t sink = 0;
+
+  while (n--)
+    sink += (uintptr_t) sr_find_interface (&sr, mbench_names[mbench_next++
+							      %
+							      MBENCH_INPUTS]);
+  return sink;
+}
+
+static void
+mbench_interfaces (void)
+{
+  int i;
+
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    snprintf (mbench_names[i], sr_IFACE_NAMELEN, "eth%d", i % MBENCH_IFACES);
+  mbench_run ("find_interface", "hit", mbench_find_interface);
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    snprintf (mbench_names[i], sr_IFACE_NAMELEN, "eth%d",
+	      MBENCH_IFACES + i % 8);
+  mbench_run ("find_interface", "miss", mbench_find_interface);
+}
+
+/* -- sr_handlepacket -- */
+
+/** IPv4 frame from the host of interface i to dst, payload bytes of UDP or
+    an ICMP echo request, into a buffer with headroom */
+static uint32_t
+mbench_frame (int n, int i, uint32_t dst, int ttl, int proto, int payload)
+{
+  struct sr_ethernet_hdr *eth;
+  struct ip *ip;
+  uint8_t *l4;
+  uint32_t len = sizeof (*eth) + sizeof (*ip) + 8 + payload;
+  uint16_t sum;
+
+  mbench_frames[n] = calloc (1, BUF_HEADROOM + len + ICMP_ERROR_LEN)
+    + BUF_HEADROOM;
+  eth = (struct sr_ethernet_hdr *) mbench_frames[n];
+  memcpy (eth->ether_dhost, sr.interfaces[i]->addr, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, "\x02\x00\x00\x00\x02", 5);
+  eth->ether_shost[5] = i;
+  eth->ether_type = htons (ETHERTYPE_IP);
+  ip = (struct ip *) (eth + 1);
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_len = htons (len - sizeof (*eth));
+  ip->ip_ttl = ttl;
+  ip->ip_p = proto;
+  ip->ip_src.s_addr = htonl (0x0a000000 + (i << 8) + MBENCH_HOST);
+  ip->ip_dst.s_addr = dst;
+  ip->ip_sum = sr_ip_checksum ((uint16_t *) (eth + 1), sizeof (*ip));
+  l4 = (uint8_t *) (ip + 1);
+  if (proto == IPPROTO_ICMP)
+    {
+      l4[0] = 8;		/* echo request */
+      sum = sr_ip_checksum ((uint16_t *) l4, 8 + payload);
+      memcpy (l4 + 2, &sum, 2);
+    }
+  else
+    {
+      l4[1] = 9;		/* port 9 to port 9 */
+      l4[3] = 9;
+      l4[5] = 8 + payload;
+    }
+  mbench_frame_len[n] = len;
+  return len;
+}
+
+static uintptr_t
+mbench_handlepacket (uint32_t n)
+{
+  uint8_t *frame = mbench_data + BUF_HEADROOM;
+  uint32_t k;
+
+  while (n--)
+    {
+      k = mbench_next++ % mbench_len;
+      memcpy (frame, mbench_frames[k], mbench_frame_len[k]);
+      sr_handlepacket (&sr, frame, mbench_frame_len[k],
+		       sr.interfaces[k % MBENCH_IFACES]->name);
+    }
+  return mbench_sent;
+}
+
+/** frames received on every interface: forwarded UDP of several sizes,
+    pings of the router and TTL expiries, each case on its own */
+static void
+mbench_packets (void)
+{
+  static const struct
+  {
+    const char *name;
+    int ttl, proto, payload, local;
+  } cases[] =
+  {
+    { "forward/64", 64, IPPROTO_UDP, 64 - 42, 0 },
+    { "forward/512", 64, IPPROTO_UDP, 512 - 42, 0 },
+    { "forward/1500", 64, IPPROTO_UDP, 1500 - 42, 0 },
+    { "echo/64", 64, IPPROTO_ICMP, 64 - 42, 1 },
+    { "echo/1500", 64, IPPROTO_ICMP, 1500 - 42, 1 },
+    { "ttl_expired/64", 1, IPPROTO_UDP, 64 - 42, 0 },
+  };
+  static unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 2, 0 };
+  struct in_addr dest, gw, mask;
+  uint32_t dst;
+  int c, i, k;
+
+  /* -- 10.0.i.0/24 behind interface i, its host resolved -- */
+  mask.s_addr = htonl (0xFFFFFF00);
+  for (i = 0; i < MBENCH_IFACES; i++)
+    {
+      dest.s_addr = htonl (0x0a000000 + (i << 8));
+      gw.s_addr = htonl (0x0a000000 + (i << 8) + MBENCH_HOST);
+      sr_add_rt_entry (&sr, dest, gw, mask, sr.interfaces[i]->name);
+      mac[5] = i;
+      sr_arp_set (&sr, gw.s_addr, mac, sr.interfaces[i]);
+    }
+  sr.fib = sr_fib_build (sr.routing_table, FIB_TRIE);
+
+  for (c = 0; c < (int) (sizeof (cases) / sizeof (cases[0])); c++)
+    {
+      for (k = 0; k < MBENCH_IFACES * 16; k++)
+	{
+	  i = k % MBENCH_IFACES;
+	  dst = cases[c].local ? sr.interfaces[i]->ip
+	    : htonl (0x0a000000 + (((i + 1) % MBENCH_IFACES) << 8)
+		     + MBENCH_HOST);
+	  mbench_frame (k, i, dst, cases[c].ttl, cases[c].proto,
+			cases[c].payload);
+	}
+      mbench_len = MBENCH_IFACES * 16;
+      mbench_run ("handlepacket", cases[c].name, mbench_handlepacket);
+      for (k = 0; k < MBENCH_IFACES * 16; k++)
+	free (mbench_frames[k] - BUF_HEADROOM);
+    }
+  sr_rt_clear (&sr);
+  sr_arp_clear (&sr);
+  sr_arp_init (&sr, ARP_TABLE_SIZE);
+}
+
+/* -- header rewrites -- */
+
+static uintptr_t
+mbench_rewrite (uint32_t n)
+{
+  struct sr_bundle h;
+
+  memset (&h, 0, sizeof (h));
+  h.sr = &sr;
+  h.pkt = (struct sr_ip_comb *) mbench_frames[0];
+  h.raw = mbench_frames[0];
+  h.raw_len = h.len = mbench_frame_len[0];
+  while (n--)
+    sr_ip_rewrite (&h, 1, mbench_addrs[n % MBENCH_INPUTS],
+		   htons (1024 + (n & 0x3FFF)));
+  return h.pkt->ip.ip_sum;
+}
+
+/** NAT-style rewrites of the destination address and port of a UDP
+    frame, its checksums updated from the changed words */
+static void
+mbench_rewrites (void)
+{
+  int i;
+
+  for (i = 0; i < MBENCH_INPUTS; i++)
+    mbench_addrs[i] = htonl (0xc0a80000 + i);
+  mbench_frame (0, 0, htonl (0x0a000164), 64, IPPROTO_UDP, 1500 - 42);
+  /* any UDP checksum but 0 (none), so that it is updated too */
+  mbench_frames[0][sizeof (struct sr_ethernet_hdr) + sizeof (struct ip)
+		   + 6] = 0x5A;
+  mbench_run ("ip_rewrite", "udp/1500", mbench_rewrite);
+  free (mbench_frames[0] - BUF_HEADROOM);
+}
+
+/** an instance with MBENCH_IFACES interfaces */
+static void
+mbench_instance (void)
+{
+  unsigned char mac[ETHER_ADDR_LEN] = { 2, 0, 0, 0, 1, 0 };
+  char name[sr_IFACE_NAMELEN];
+  int i;
+
+  memset (&sr, 0, sizeof (sr));
+  sr.sockfd = -1;
+  sr.loop.epfd = -1;
+  sr.io.ops = &mbench_io;
+  sr.fib_type = FIB_TRIE;
+  sr_timer_init (&sr.timers);
+  sr_arp_init (&sr, ARP_TABLE_SIZE);
+  sr_buf_clear (&sr);
+  sr.buffer.capacity = BUFFSIZE;
+  sr.buffer.stale_ms = STALE_TIMEOUT * 1000;
+  sr.buffer.policy = BUF_TAIL;
+  for (i = 0; i < MBENCH_IFACES; i++)
+    {
+      snprintf (name, sizeof (name), "eth%d", i);
+      sr_add_interface (&sr, name);
+      mac[5] = i;
+      sr_set_ether_addr (&sr, mac);
+      sr_set_ether_ip (&sr, htonl (0x0a000001 + (i << 8) + i));
+    }
+}
+
+/** run on cpu only, so samples do not migrate */
+static void
+mbench_pin (int cpu)
+{
+#ifdef _LINUX_
+  cpu_set_t set;
+
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+  if (sched_setaffinity (0, sizeof (set), &set) != 0)
+    perror ("sched_setaffinity");
+#endif /* _LINUX_ */
+}
+
+static void
+usage (char *argv0)
+{
+  printf ("Format: %s [-c cpu] [-n largest routing table] [-m]\n", argv0);
+  printf ("           (-m: CSV output)\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int packet_sizes[] = { 20, 64, 576, 1500, 9000, 0 };
+  int table_sizes[5] = { 1000, 10000, 100000, 0 };
+  int c, i, cpu = -1, routes = 100000;
+
+  while ((c = getopt (argc, argv, "hc:n:m")) != EOF)
+    {
+      switch (c)
+	{
+	case 'c':
+	  cpu = atoi (optarg);
+	  break;
+	case 'n':
+	  routes = atoi (optarg);
+	  break;
+	case 'm':
+	  mbench_csv = 1;
+	  break;
+	default:
+	  usage (argv[0]);
+	  exit (c != 'h');
+	}
+    }
+  if (routes < 1)
+    {
+      usage (argv[0]);
+      exit (1);
+    }
+  for (i = 0; table_sizes[i] && table_sizes[i] < routes; i++)
+    ;
+  table_sizes[i] = routes;
+  table_sizes[i + 1] = 0;
+
+#ifdef _LINUX_
+  if (cpu < 0)
+    cpu = sched_getcpu ();
+#endif /* _LINUX_ */
+  if (cpu >= 0)
+    mbench_pin (cpu);
+
+  mbench_instance ();
+  mbench_addrs = malloc (MBENCH_INPUTS * sizeof (uint32_t));
+  mbench_data = calloc (1, BUF_HEADROOM + 9216 + ICMP_ERROR_LEN);
+  for (i = 0; i < 9216; i++)
+    mbench_data[i] = mbench_random ();
+  mbench_copy = malloc (9216);
+
+  if (mbench_csv)
+    printf ("benchmark,case,ops_per_sample,ns_min,ns_p50,ns_p90,ns_p99,"
+	    "ns_mean\n");
+  else
+    printf ("%-14s %-20s %9s %9s %9s %9s %8s   (cpu %d)\n", "benchmark",
+	    "case", "min ns", "p50 ns", "p90 ns", "p99 ns", "Mops/s", cpu);
+
+  mbench_rt (table_sizes);
+  mbench_arp (1000);
+  mbench_arp (100000);
+  mbench_buf (packet_sizes + 1);
+  mbench_checksums (packet_sizes);
+  mbench_interfaces ();
+  mbench_packets ();
+  mbench_rewrites ();
+
+  sr_if_clear (&sr);
+  sr_buf_clear (&sr);
+  return 0;
+}
@@ -0,0 +1,433 @@
+/**
+ * Replay backend (Linux): the frames of a pcap capture (as written by
+ * sr -l) are handed to sr_handlepacket one after the other as fast as it
+ * takes them, and frames sent are counted instead of sent, so the
+ * forwarding path can be measured and profiled without a network. Each
+ * frame is replayed on the interface whose MAC address it was sent to;
+ * frames the router sent are skipped. ARP requests of the router are
+ * answered, so next hops resolve as they would on a link.
+ */
+#ifdef _LINUX_
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_io.h"
+#include "sr_dumper.h"
+
+/** outcomes of a replayed frame */
+#define REPLAY_FORWARDED 0
+#define REPLAY_BUFFERED 1
+#define REPLAY_ICMP 2
+#define REPLAY_DROPPED 3
+#define REPLAY_ARP 4
+#define REPLAY_OUTCOMES 5
+
+/** largest frame of a capture replayed */
+#define REPLAY_FRAME_MAX (64 * 1024)
+
+static const char *sr_replay_outcomes[REPLAY_OUTCOMES] = {
+  "forwarded", "buffered", "ICMP generated", "dropped", "ARP handled"
+};
+
+/** a frame of the capture and the interface it is replayed on */
+struct sr_replay_frame
+{
+  size_t offset;		/** in frames */
+  uint32_t len;
+  struct sr_io_port *port;
+};
+
+struct sr_replay
+{
+  uint8_t *frames;		/** the frames replayed, back to back */
+  size_t frames_len;
+  struct sr_replay_frame *frame;
+  uint32_t count;
+  uint32_t skipped;		/** sent by the router, or to no interface */
+  uint8_t *buf;			/** a frame being handled, after headroom */
+  uint32_t buf_len;
+
+  /* -- ARP replies of the neighbours, handled after the frame -- */
+  uint8_t answers[IO_BATCH][sizeof (struct sr_ethernet_hdr)
+			    + sizeof (struct sr_arphdr)];
+  struct sr_io_port *answer_port[IO_BATCH];
+  uint32_t nanswers;
+
+  /* -- frames sent, by kind -- */
+  uint64_t sent_forwarded;
+  uint64_t sent_icmp;
+  uint64_t sent_arp;
+  uint64_t outcome[REPLAY_OUTCOMES];
+  uint64_t replayed;
+  uint32_t rounds;
+  double seconds;
+};
+
+/** port of the interface a frame was sent to, 0 if none */
+static struct sr_io_port *
+sr_replay_port_of (struct sr_instance *sr, const uint8_t * frame,
+		   uint32_t len)
+{
+  const struct sr_ethernet_hdr *eth = (const struct sr_ethernet_hdr *) frame;
+  const struct sr_arphdr *arp = (const struct sr_arphdr *) (eth + 1);
+  struct sr_io_port *port;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    {
+      if (!(port = sr->io.ports[i]))
+	continue;
+      if (!memcmp (eth->ether_shost, port->iface->addr, ETHER_ADDR_LEN))
+	return 0;
+      if (!memcmp (eth->ether_dhost, port->iface->addr, ETHER_ADDR_LEN))
+	return port;
+
+      /* -- broadcast ARP requests go to the owner of the address -- */
+      if ((eth->ether_dhost[0] & 1)
+	  && ntohs (eth->ether_type) == ETHERTYPE_ARP
+	  && len >= sizeof (*eth) + sizeof (*arp)
+	  && arp->ar_tip == port->iface->ip)
+	return port;
+    }
+  return 0;
+}
+
+/**
+ * Read the capture into memory, keeping the frames sent to an interface
+ */
+static int
+sr_replay_load (struct sr_instance *sr, struct sr_replay *rp,
+		const char *filename)
+{
+  struct pcap_file_header fh;
+  struct pcap_sf_pkthdr ph;
+  struct sr_io_port *port;
+  size_t size = 0, frames = 0;
+  void *p;
+  FILE *fp;
+
+  if (!(fp = fopen (filename, "r")))
+    {
+      perror (filename);
+      return -1;
+    }
+  if (fread (&fh, sizeof (fh), 1, fp) != 1 || fh.magic != TCPDUMP_MAGIC
+      || fh.linktype != LINKTYPE_ETHERNET)
+    {
+      fprintf (stderr, "%s: not an ethernet pcap file\n", filename);
+      fclose (fp);
+      return -1;
+    }
+  while (fread (&ph, sizeof (ph), 1, fp) == 1)
+    {
+      /* -- a corrupt length must not size the buffer -- */
+      if (ph.caplen > fh.snaplen || ph.caplen > REPLAY_FRAME_MAX)
+	{
+	  fprintf (stderr, "%s: frame %u of %u bytes is too large\n",
+		   filename, rp->count + rp->skipped + 1, ph.caplen);
+	  fclose (fp);
+	  return -1;
+	}
+      if (rp->frames_len + ph.caplen > size)
+	{
+	  size = 2 * size + ph.caplen + (1 << 20);
+	  if (!(p = realloc (rp->frames, size)))
+	    break;
+	  rp->frames = p;
+	}
+      if (rp->count == frames)
+	{
+	  frames = 2 * frames + 1024;
+	  if (!(p = realloc (rp->frame, frames * sizeof (*rp->frame))))
+	    break;
+	  rp->frame = p;
+	}
+      if (fread (rp->frames + rp->frames_len, ph.caplen, 1, fp) != 1)
+	break;
+
+      if (ph.caplen < sizeof (struct sr_ethernet_hdr)
+	  || !(port = sr_replay_port_of (sr, rp->frames + rp->frames_len,
+					 ph.caplen)))
+	{
+	  rp->skipped++;
+	  continue;
+	}
+      rp->frame[rp->count].offset = rp->frames_len;
+      rp->frame[rp->count].len = ph.caplen;
+      rp->frame[rp->count].port = port;
+      rp->count++;
+      rp->frames_len += ph.caplen;
+      if (ph.caplen > rp->buf_len)
+	rp->buf_len = ph.caplen;
+    }
+  fclose (fp);
+
+  printf ("Replaying %u frames of %s (%u skipped)\n", rp->count, filename,
+	  rp->skipped);
+  if (!rp->count)
+    return -1;
+  if (rp->buf_len < IO_FRAME_SIZE)
+    rp->buf_len = IO_FRAME_SIZE;
+  if (!(rp->buf = malloc (BUF_HEADROOM + rp->buf_len)))
+    return -1;
+  rp->buf += BUF_HEADROOM;
+  return 0;
+}
+
+/**
+ * Load the capture given with -R. Frames are matched to the interfaces by
+ * their MAC addresses, which the interface file must give.
+ */
+static int
+sr_replay_open (struct sr_instance *sr)
+{
+  struct sr_replay *rp;
+  int i;
+
+  if (!sr->io.capture)
+    {
+      fprintf (stderr, "The replay backend needs a capture (-R)\n");
+      return -1;
+    }
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i]
+	&& !memcmp (sr->io.ports[i]->iface->addr, "\0\0\0\0\0\0",
+		    ETHER_ADDR_LEN))
+      {
+	fprintf (stderr, "%s needs the MAC address of the capture\n",
+		 sr->io.ports[i]->iface->name);
+	return -1;
+      }
+  if (!(rp = sr->io.replay = calloc (1, sizeof (struct sr_replay))))
+    return -1;
+  return sr_replay_load (sr, rp, sr->io.capture);
+}
+
+static double
+sr_replay_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** hand the ARP replies queued by the frame last handled to the router */
+static void
+sr_replay_answer (struct sr_instance *sr, struct sr_replay *rp)
+{
+  uint32_t i, n = rp->nanswers;
+  uint8_t *frame = rp->buf;
+
+  rp->nanswers = 0;
+  for (i = 0; i < n; i++)
+    {
+      memcpy (frame, rp->answers[i], sizeof (rp->answers[i]));
+      sr_handlepacket (sr, frame, sizeof (rp->answers[i]),
+		       rp->answer_port[i]->iface->name);
+    }
+}
+
+/**
+ * Replay the capture, as many rounds as take IO_REPLAY_MS at least, then
+ * print the rates and outcomes and stop the event loop. Each frame is
+ * copied to a buffer with headroom first, as it would be received.
+ */
+static int
+sr_replay_start (struct sr_instance *sr)
+{
+  struct sr_replay *rp = sr->io.replay;
+  struct sr_replay_frame *f;
+  struct sr_ethernet_hdr *eth;
+  uint64_t forwarded, icmp, enqueued;
+  double start;
+  uint32_t i;
+  int outcome;
+
+  start = sr_replay_now ();
+  do
+    {
+      for (i = 0; i < rp->count; i++)
+	{
+	  f = &rp->frame[i];
+	  eth = (struct sr_ethernet_hdr *) (rp->frames + f->offset);
+	  memcpy (rp->buf, eth, f->len);
+	  forwarded = rp->sent_forwarded;
+	  icmp = rp->sent_icmp;
+	  enqueued = sr->buffer.enqueued;
+	  f->port->rx++;
+	  sr_handlepacket (sr, rp->buf, f->len, f->port->iface->name);
+
+	  if (ntohs (eth->ether_type) == ETHERTYPE_ARP)
+	    outcome = REPLAY_ARP;
+	  else if (rp->sent_icmp != icmp)
+	    outcome = REPLAY_ICMP;
+	  else if (rp->sent_forwarded != forwarded)
+	    outcome = REPLAY_FORWARDED;
+	  else if (sr->buffer.enqueued != enqueued)
+	    outcome = REPLAY_BUFFERED;
+	  else
+	    outcome = REPLAY_DROPPED;
+	  rp->outcome[outcome]++;
+
+	  if (rp->nanswers)
+	    sr_replay_answer (sr, rp);
+	  if (i % IO_BATCH == IO_BATCH - 1)
+	    {
+	      sr_timer_run (&sr->timers, sr);
+	      sr_rt_quiescent (sr);
+	    }
+	}
+      rp->replayed += rp->count;
+      rp->rounds++;
+      rp->seconds = sr_replay_now () - start;
+    }
+  while (rp->seconds * 1000 < IO_REPLAY_MS);
+
+  printf ("REPLAY: %lu frames in %u rounds, %.3f s: %.0f packets/s, "
+	  "%.1f ns/packet\n", (unsigned long) rp->replayed, rp->rounds,
+	  rp->seconds, rp->replayed / rp->seconds,
+	  rp->seconds * 1e9 / rp->replayed);
+  sr_print_stats (sr);
+  sr->loop.stop = 1;
+  return 0;
+}
+
+/** queue the reply of the neighbour a request of the router asks for */
+static void
+sr_replay_arp (struct sr_replay *rp, struct sr_io_port *port,
+	       const struct sr_arphdr *req)
+{
+  struct sr_ethernet_hdr *eth;
+  struct sr_arphdr *rep;
+
+  if (ntohs (req->ar_op) != ARP_REQUEST || rp->nanswers == IO_BATCH)
+    return;
+  eth = (struct sr_ethernet_hdr *) rp->answers[rp->nanswers];
+  rep = (struct sr_arphdr *) (eth + 1);
+  *rep = *req;
+  rep->ar_op = htons (ARP_REPLY);
+  memcpy (rep->ar_sha, "\x02\x00\x00\x00\x00\x00", ETHER_ADDR_LEN);
+  memcpy (rep->ar_sha + 2, &req->ar_tip, 4);	/* locally administered */
+  rep->ar_sip = req->ar_tip;
+  memcpy (rep->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+  rep->ar_tip = req->ar_sip;
+  memcpy (eth->ether_dhost, req->ar_sha, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, rep->ar_sha, ETHER_ADDR_LEN);
+  eth->ether_type = htons (ETHERTYPE_ARP);
+  rp->answer_port[rp->nanswers++] = port;
+}
+
+/** ip is an address of the router */
+static int
+sr_replay_is_local (struct sr_instance *sr, uint32_t ip)
+{
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i] && sr->io.ports[i]->iface->ip == ip)
+      return 1;
+  return 0;
+}
+
+/**
+ * Count a frame the router sends: forwarded, ICMP from one of its
+ * addresses, or ARP; requests are answered once the frame is handled
+ */
+static int
+sr_replay_send (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+		const char *iface, int headroom)
+{
+  struct sr_replay *rp = sr->io.replay;
+  struct sr_io_port *port = sr->io.ports[sr_name_index (iface)];
+  struct sr_ethernet_hdr *eth = (struct sr_ethernet_hdr *) buf;
+  struct ip *ip = (struct ip *) (eth + 1);
+
+  if (!port)
+    {
+      fprintf (stderr, "** Error, interface %s, does not exist\n", iface);
+      return -1;
+    }
+  sr_log_packet (sr, buf, len);
+  port->tx++;
+
+  if (ntohs (eth->ether_type) == ETHERTYPE_ARP)
+    {
+      rp->sent_arp++;
+      if (len >= sizeof (*eth) + sizeof (struct sr_arphdr))
+	sr_replay_arp (rp, port, (struct sr_arphdr *) (eth + 1));
+    }
+  else if (len >= sizeof (*eth) + sizeof (*ip) && ip->ip_p == IPPROTO_ICMP
+	   && sr_replay_is_local (sr, ip->ip_src.s_addr))
+    rp->sent_icmp++;
+  else
+    rp->sent_forwarded++;
+  return 0;
+}
+
+/** nothing is queued */
+static int
+sr_replay_flush (struct sr_instance *sr)
+{
+  return 0;
+}
+
+/**
+ * Print the frames replayed and sent per interface, the outcomes of the
+ * frames replayed and the frames sent by kind
+ */
+static void
+sr_replay_print_stats (struct sr_instance *sr)
+{
+  struct sr_replay *rp = sr->io.replay;
+  struct sr_io_port *port;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if ((port = sr->io.ports[i]))
+      printf ("%s: %lu replayed, %lu sent\n", port->iface->name,
+	      (unsigned long) port->rx, (unsigned long) port->tx);
+  if (!rp)
+    return;
+  for (i = 0; i < REPLAY_OUTCOMES; i++)
+    printf ("%s%lu %s", i ? ", " : "Replayed frames: ",
+	    (unsigned long) rp->outcome[i], sr_replay_outcomes[i]);
+  printf ("\nSent: %lu forwarded, %lu ICMP, %lu ARP\n",
+	  (unsigned long) rp->sent_forwarded, (unsigned long) rp->sent_icmp,
+	  (unsigned long) rp->sent_arp);
+}
+
+/** free the capture (exit) */
+static void
+sr_replay_close (struct sr_instance *sr)
+{
+  struct sr_replay *rp = sr->io.replay;
+
+  if (!rp)
+    return;
+  free (rp->frames);
+  free (rp->frame);
+  if (rp->buf)
+    free (rp->buf - BUF_HEADROOM);
+  free (rp);
+  sr->io.replay = 0;
+}
+
+/** the replay backend, interfaces come from the interface file */
+const struct sr_io_ops sr_io_replay = {
+  "replay",
+  sr_replay_open,
+  sr_replay_start,
+  sr_replay_send,
+  sr_replay_flush,
+  sr_replay_print_stats,
+  sr_replay_close,
+};
+
+#endif /* _LINUX_ */
@@ -18,10 +18,20 @@
 
 
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_buf.h"
 
+static int sr_router_xmit (struct sr_bundle *, const char *,
+			   const unsigned char *, const unsigned char *);
+static void sr_router_handle (struct sr_instance *, uint8_t *, unsigned int,
+			      char *, struct sr_rt *, uint32_t);
+
+#if IO_BATCH > FIB_BATCH_MAX
+#error "a burst is located with one sr_rt_locate_batch"
+#endif
+
 /*--------------------------------------------------------------------- 
  * Method: sr_init(void)
  * Scope:  Global
@@ -50,7 +60,9 @@ sr_init (struct sr_instance *sr)
  * Note: Both the packet buffer and the character's memory are handled
  * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
  * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * the method call. The BUF_HEADROOM bytes before the packet are free for
+ * the header of the command sending it, and it has room for
+ * ICMP_ERROR_LEN bytes.
  *
  *---------------------------------------------------------------------*/
 
@@ -58,6 +70,19 @@ void
 sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
 		 unsigned int len, char *interface)
 {
+  sr_router_handle (sr, packet, len, interface, 0, 0);
+}				/* end sr_handlepacket */
+
+/**
+ * Handle a packet like sr_handlepacket; route is the route of
+ * destination route_dst if it was located with its burst, route_dst 0
+ * otherwise.
+ */
+static void
+sr_router_handle (struct sr_instance *sr, uint8_t * packet,
+		  unsigned int len, char *interface, struct sr_rt *route,
+		  uint32_t route_dst)
+{
 
   struct sr_if *iface = sr_find_interface (sr, interface);	
   	
@@ -119,6 +144,8 @@ sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
       ip_handler.raw_len = len;
       ip_handler.len = len;
       ip_handler.iface = iface;
+      ip_handler.route = route;
+      ip_handler.route_dst = route_dst;
 
       /*TTL expiry case*/
       if (ip->ip_ttl <= 1)
@@ -149,9 +176,7 @@ sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
 	    return;
 	}
 
-      /* handle backlog */
-      sr_clear_backlog (sr);
-      /* then try and send packet */
+      /* try and send packet */
       send_success = sr_router_send (&ip_handler);
       Debug ("Packet successfully sent %d\n", send_success);
 
@@ -166,9 +191,9 @@ sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
 	  break;
 	case ARP_REPLY:
 	  Debug ("ARP reply - update ARP table\n");
-	  sr_arp_set (sr, a_hdr->ar_sip, a_hdr->ar_sha, iface);
-	  /* handle any backlog */
-	  sr_clear_backlog (sr);
+	  /* send the packets waiting for this neighbour */
+	  sr_router_flush (sr, sr_arp_set (sr, a_hdr->ar_sip, a_hdr->ar_sha,
+					   iface));
 	  break;
 	default:
 	  Debug ("Unknown ARP value %d is!\n", a_hdr->ar_op);
@@ -179,7 +204,101 @@ sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
 	     e_hdr->ether_type);
     }
 
-}				/* end sr_handlepacket */
+}				/* end sr_router_handle */
+
+/**
+ * destination of the IPv4 frame rx whose route has to be located, 0 if
+ * it is not IPv4 or its next hop is known (sr_dcache)
+ */
+static uint32_t
+sr_burst_dst (struct sr_instance *sr, struct sr_rx *rx)
+{
+  struct sr_ip_comb *pkt = (struct sr_ip_comb *) rx->packet;
+
+  if (rx->len < sizeof (struct sr_ethernet_hdr) + sizeof (struct ip)
+      || pkt->eth.ether_type != htons (ETHERTYPE_IP)
+      || !pkt->ip.ip_dst.s_addr
+      || sr_dcache_lookup (sr, pkt->ip.ip_dst.s_addr))
+    return 0;
+  return pkt->ip.ip_dst.s_addr;
+}
+
+/**
+ * Queue a received packet for sr_burst_handle, handling the burst first
+ * if it is full. The arguments are the ones of sr_handlepacket; the
+ * packet has to stay until the burst is handled, but short packets are
+ * copied, as they could not be answered in place.
+ */
+void
+sr_burst_add (struct sr_instance *sr, uint8_t * packet, unsigned int len,
+	      char *interface)
+{
+  struct sr_burst *b = &sr->burst;
+  struct sr_rx *rx;
+
+  assert (sr);
+  assert (packet);
+  assert (interface);
+
+  if (b->n == IO_BATCH)
+    sr_burst_handle (sr);
+  if (len < ICMP_ERROR_LEN)
+    {
+      memcpy (b->small[b->n] + BUF_HEADROOM, packet, len);
+      packet = b->small[b->n] + BUF_HEADROOM;
+    }
+  rx = &b->rx[b->n++];
+  rx->packet = packet;
+  rx->len = len;
+  rx->interface = interface;
+}
+
+/**
+ * Handle the packets queued by sr_burst_add, in order. The routes of
+ * the destinations not in the destination cache are located first, with
+ * one batched lookup (sr_rt_locate_batch).
+ */
+void
+sr_burst_handle (struct sr_instance *sr)
+{
+  struct sr_burst *b = &sr->burst;
+  struct sr_rt *found[IO_BATCH], *route[IO_BATCH];
+  uint32_t ip[IO_BATCH], dst[IO_BATCH];
+  int at[IO_BATCH];
+  uint32_t gen;
+  int i, n = 0;
+
+  assert (sr);
+
+  for (i = 0; i < b->n; i++)
+    {
+      route[i] = 0;
+      if ((dst[i] = sr_burst_dst (sr, &b->rx[i])))
+	{
+	  at[n] = i;
+	  ip[n++] = dst[i];
+	}
+    }
+  if (n)
+    {
+      sr_rt_locate_batch (sr, ip, found, n);
+      for (i = 0; i < n; i++)
+	route[at[i]] = found[i];
+    }
+  gen = sr->dcache.lookup_gen;
+
+  /* -- b->n is reset first: packets are not queued while handled -- */
+  n = b->n;
+  b->n = 0;
+  for (i = 0; i < n; i++)
+    {
+      /* -- routes cached from the batch are tagged with its generation,
+	 even after lookups of other packets -- */
+      sr->dcache.lookup_gen = gen;
+      sr_router_handle (sr, b->rx[i].packet, b->rx[i].len,
+			b->rx[i].interface, route[i], dst[i]);
+    }
+}
 
 /**--------------------------------------------------------------------- 
  * Method: sr_router_send
@@ -189,26 +308,82 @@ sr_handlepacket (struct sr_instance *sr, uint8_t * packet,
 int
 sr_router_send (struct sr_bundle *h)
 {
-  struct sr_arp_entry *arp_entry;
-  struct sr_rt *sender;
-  struct sr_ethernet_hdr *eth;
+  struct sr_dcache_entry *e;
 
   assert (h->sr);
   assert (h->pkt->ip.ip_dst.s_addr);
 
-  sender = sr_rt_locate (h->sr, h->pkt->ip.ip_dst.s_addr);
-  arp_entry = sr_arp_get (h->sr, sender->gw.s_addr);
+  /* -- known destination: no route lookup or ARP scan -- */
+  if ((e = sr_dcache_lookup (h->sr, h->pkt->ip.ip_dst.s_addr)))
+    {
+      e->route->packets++;
+      return sr_router_xmit (h, e->route->interface, e->smac, e->dmac);
+    }
+
+  /* -- located with its burst (sr_burst_handle), unless the packet was
+     turned into a reply to another destination -- */
+  if (h->route_dst == h->pkt->ip.ip_dst.s_addr)
+    return sr_router_send_via (h, h->route);
+
+  return sr_router_send_via (h, sr_rt_locate (h->sr,
+					       h->pkt->ip.ip_dst.s_addr));
+}
+
+/**
+ * Set the mac addresses of a packet and send it on interface iface
+ */
+static int
+sr_router_xmit (struct sr_bundle *h, const char *iface,
+		const unsigned char *smac, const unsigned char *dmac)
+{
+  struct sr_ethernet_hdr *eth;
 
-  if (!arp_entry->ip)
+  Debug
+    ("Sending packet of length %d bytes on interface %s\n", h->len, iface);
+
+  /* set mac addresses for tx */
+  eth = &h->pkt->eth;
+  memcpy (eth->ether_shost, smac, ETHER_ADDR_LEN);
+  memcpy (eth->ether_dhost, dmac, ETHER_ADDR_LEN);
+  Debug ("ROUTER: Source IP %s (send mac ", inet_ntoa (h->pkt->ip.ip_src));
+  DebugMAC (eth->ether_shost);
+  Debug (") Destination IP %s (recv mac ", inet_ntoa (h->pkt->ip.ip_dst));
+  DebugMAC (eth->ether_dhost);
+  Debug (")\n");
+  /* -- received packets have room for the command header -- */
+  if (sr_send_frame (h->sr, h->raw, h->len, iface) == -1)
     {
-      Debug
-	("Buffering packet\n");
-      sr_buf_add (h);
-      sr_arp_refresh (h->sr, sender->gw.s_addr, sender->interface);
-      return 0;
+      Debug ("ROUTER: error sending packet - dropping\n");	/* - buffering\n"); */
+      /* sr_buf_add(h);
+         return 0; */
+    }
+  return 1;
+}
+
+/**
+ * Send a packet using the routing entry already located for its
+ * destination. For a route with several equal cost paths, the path is
+ * chosen by the flow hash of the packet.
+ */
+int
+sr_router_send_via (struct sr_bundle *h, struct sr_rt *sender)
+{
+  struct sr_arp_entry *arp_entry;
+  unsigned char *smac;
+  int multipath;
 
+  assert (h->sr);
+
+  if (!sender)
+    {
+      Debug ("ROUTER: no route to destination - dropping\n");
+      return 1;
     }
-  else if (arp_entry->tries >= ARP_MAX_TRIES)
+  if ((multipath = sender->npaths > 1))
+    sender = sr_rt_path (sender, sr_ip_flow_hash (h));
+  arp_entry = sr_arp_get (h->sr, sender->gw.s_addr);
+
+  if (arp_entry->ip && arp_entry->state == ARP_FAILED)
     {
       Debug
 	("Router: out of tries");
@@ -216,8 +391,12 @@ sr_router_send (struct sr_bundle *h)
       if (!sr_icmp_unreachable (h))
 	return 1;		/* Return error */
       sender = sr_rt_locate (h->sr, h->pkt->ip.ip_dst.s_addr);
+      if (!sender)
+	return 1;
+      if ((multipath = sender->npaths > 1))
+	sender = sr_rt_path (sender, sr_ip_flow_hash (h));
       arp_entry = sr_arp_get (h->sr, sender->gw.s_addr);
-      if (arp_entry->tries >= ARP_MAX_TRIES)
+      if (!arp_entry->ip || !sr_arp_usable (arp_entry))
 	{
 	  Debug
 	    ("Aborting ARP request");
@@ -225,73 +404,56 @@ sr_router_send (struct sr_bundle *h)
 	}
 
     }
-  else if (arp_entry->tries > 0)
+  else if (!arp_entry->ip || arp_entry->state == ARP_INCOMPLETE)
     {
+      if (!h->sr->interfaces[sender->ifidx])
+	{
+	  Debug ("ROUTER: no interface %s - dropping\n", sender->interface);
+	  return 1;
+	}
       Debug
-	("Interface %s arp entry being refreshed (tries %d) - packet buffered\n",
-	 sender->interface, arp_entry->tries);
-      sr_buf_add (h);
+	("Buffering packet\n");
+      /* -- one request per neighbour, the retries are timed -- */
+      arp_entry = sr_arp_resolve (h->sr, sender->gw.s_addr,
+				  h->sr->interfaces[sender->ifidx]);
+      sender->packets++;
+      sr_buf_add (h, arp_entry);
       return 0;
 
     }
-  Debug
-    ("Sending packet of length %d bytes on interface %s\n",
-     h->len, sender->interface);
 
-  /* set mac addresses for tx */
-  eth = &h->pkt->eth;
-  memcpy (eth->ether_shost, arp_entry->iface->addr, ETHER_ADDR_LEN);
-  memcpy (eth->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
-  Debug ("ROUTER: Source IP %s (send mac ", inet_ntoa (h->pkt->ip.ip_src));
-  DebugMAC (eth->ether_shost);
-  Debug (") Destination IP %s (recv mac ", inet_ntoa (h->pkt->ip.ip_dst));
-  DebugMAC (eth->ether_dhost);
-  Debug (")\n");
-  if (sr_send_packet (h->sr, h->raw, h->len, sender->interface) == -1)
-    {
-      Debug ("ROUTER: error sending packet - dropping\n");	/* - buffering\n"); */
-      /* sr_buf_add(h);
-         return 0; */
-    }
-  return 1;
+  sr_arp_probe (h->sr, arp_entry);
+
+  /* -- the cache is per destination, multipath routes choose per flow -- */
+  smac = h->sr->interfaces[arp_entry->ifidx]->addr;
+  if (arp_entry->state == ARP_REACHABLE && !multipath)
+    sr_dcache_fill (h->sr, h->pkt->ip.ip_dst.s_addr, sender, smac,
+		    arp_entry->mac);
+  sender->packets++;
+  return sr_router_xmit (h, sender->interface, smac, arp_entry->mac);
 }
 
 /**
- * Handle backlogged packets, delete stale packets
- * 
+ * Send the packets queued on a neighbour, after its ARP reply. They are
+ * sent in the order they were queued, through the interface the
+ * neighbour answered on.
  */
 void
-sr_clear_backlog (struct sr_instance *sr)
+sr_router_flush (struct sr_instance *sr, struct sr_arp_entry *entry)
 {
-  struct sr_buf *b;
   struct sr_buf_entry *item, *next;
-  struct ip *ip;
-  time_t t;
+  struct sr_if *iface;
 
   assert (sr);
-  b = &sr->buffer;
+  assert (entry);
 
-  if (b->start)
+  iface = sr->interfaces[entry->ifidx];
+  for (item = sr_buf_detach (sr, entry); item; item = next)
     {
-      item = b->start;
-      while (item)
-	{
-	  ip = &item->h.pkt->ip;
-	  next = item->next;
-	  Debug ("ROUTER: attempting to resend packet (proto %d, from %s, ",
-		 ip->ip_p, inet_ntoa (ip->ip_src));
-	  Debug ("to %s)\n", inet_ntoa (ip->ip_dst));
-	  if (time (&t) - item->created > STALE_TIMEOUT)
-	    {
-	      Debug ("ROUTER: packet too old - deleting\n");
-	      sr_buf_remove (sr, item);
-	    }
-	  else if (sr_router_send (&item->h))
-	    {
-	      Debug ("ROUTER: packet successfully sent - deleting\n");
-	      sr_buf_remove (sr, item);
-	    }
-	  item = next;
-	}
+      next = item->next;
+      Debug ("ROUTER: sending queued packet to %s\n",
+	     inet_ntoa (item->h.pkt->ip.ip_dst));
+      sr_router_xmit (&item->h, iface->name, iface->addr, entry->mac);
+      sr_buf_remove (sr, item, BUF_SENT);
     }
 }
@@ -10,13 +10,20 @@
 #define SR_ROUTER_H
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <semaphore.h>
+#include <pthread.h>
 
 #include "sr_protocol.h"
 #include "sr_buf.h"
 #include "sr_arp_table.h"
+#include "sr_dcache.h"
+#include "sr_timer.h"
 #include "sr_ip.h"
+#include "sr_event.h"
+#include "sr_io.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -31,9 +38,39 @@
 
 #define PACKET_DUMP_SIZE 1024
 
+/** bytes read from the server at once, at least a command (VNSCMDSIZE) */
+#define VNS_RX_SIZE (256 * 1024)
+
+/** packets sent to the server are written together, at most VNS_TX_IOV
+    pieces or about VNS_TX_BYTES at once, or after VNS_TX_DELAY us (-w) */
+#define VNS_TX_IOV 64
+#define VNS_TX_BYTES (64 * 1024)
+#define VNS_TX_DELAY 500
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+
+/** a frame of a burst, see sr_burst_add */
+struct sr_rx
+{
+  uint8_t *packet;
+  unsigned int len;
+  char *interface;
+};
+
+/**
+ * Frames received together (VNS ring, TPACKET_V3 block, tap batch): the
+ * routes of their IPv4 destinations are located with one batched lookup
+ * before they are handled. Short frames are copied, with their headroom.
+ */
+struct sr_burst
+{
+  int n;
+  struct sr_rx rx[IO_BATCH];
+  uint8_t small[IO_BATCH][BUF_HEADROOM + ICMP_ERROR_LEN];
+};
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -50,16 +87,43 @@ struct sr_instance
   char auth_key_fn[64];		/* auth key filename */
   unsigned short topo_id;
   struct sockaddr_in sr_addr;	/* address to server */
+  uint8_t *rx_ring;		/** bytes read from the server */
+  uint32_t rx_head;		/** next command to handle */
+  uint32_t rx_tail;		/** end of the bytes read */
+  uint64_t rx_reads;
+  uint64_t rx_commands;
+  struct iovec tx_iov[VNS_TX_IOV];	/** packets to write to the server */
+  uint32_t tx_count;		/** pieces in tx_iov */
+  uint32_t tx_bytes;		/** bytes in tx_iov */
+  uint8_t *tx_buf;		/** copies of the packets not in the ring */
+  uint32_t tx_copied;		/** bytes used in tx_buf */
+  uint64_t tx_first;		/** us, when the first packet was queued */
+  uint32_t tx_delay_us;		/** longest wait of a queued packet */
+  uint64_t tx_frames;
+  uint64_t tx_writes;
   struct sr_if *if_list;	/* list of interfaces */
   struct sr_if *interfaces[ARP_MAX_ENTRIES];	/** interfaces ordered by name */
 
   struct sr_if *ip_iface_m[ARP_MAX_ENTRIES];   /** interfaces mapped to IPs */
   struct sr_rt *routing_table;	/* routing table */
+  struct sr_rt **rt_tail;	/** next field of the last route, 0 if unknown */
+  struct sr_fib *fib;		/** routing table compiled for lookups */
+  int fib_type;			/** FIB_TRIE or FIB_DIR24 */
+  struct sr_fib *fib_retired;	/** replaced FIBs, freed when quiescent */
+  struct sr_rt *rt_reload_list;	/** routing table list of a reload */
+  sem_t rt_reload_sem;		/** posted to request a reload */
+  pthread_mutex_t rt_lock;	/** orders route changes and reloads */
+  int rt_reloader;		/** reload thread started, rt_lock set up */
+  char rtable_fn[64];		/** rtable file name */
 
   struct sr_buf buffer;   /** buffer for unsent packets */
-  time_t arp_last_reftime;   /** last time we ran sr_arp_check_refresh in sr_arp.c */
+  struct sr_timer_wheel timers;	/** ARP aging, stale packets */
+  struct sr_event_loop loop;	/** sockets, timers and signals (Linux) */
+  struct sr_io io;		/** backend sending and receiving frames */
+  struct sr_burst burst;	/** frames received, not handled yet */
 
-  struct sr_arp_entry arp_table[ARP_MAX_ENTRIES];   /** ARP table for LAN*/
+  struct sr_arp_table arp_table;   /** ARP table for LAN*/
+  struct sr_dcache dcache;	/** next hops of recent destinations */
 
   char subnet_s[32];	/** subnet in string form*/
   uint32_t subnet;    /** subnet : numerical */
@@ -68,12 +132,17 @@ struct sr_instance
 };
 
 /* -- sr_arp.c -- */
+void sr_arp_init (struct sr_instance *sr, uint32_t size);
+void sr_arp_clear (struct sr_instance *sr);
 struct sr_arp_entry *sr_arp_set (struct sr_instance *sr, uint32_t ip,
 				 unsigned char *mac, struct sr_if *iface);
 struct sr_arp_entry *sr_arp_get (struct sr_instance *sr, uint32_t ip);
+struct sr_arp_entry *sr_arp_resolve (struct sr_instance *sr, uint32_t ip,
+				     struct sr_if *iface);
+void sr_arp_probe (struct sr_instance *sr, struct sr_arp_entry *entry);
+void sr_arp_remove (struct sr_instance *sr, uint32_t ip);
 
 void sr_arp_scan (struct sr_instance *sr);
-void sr_arp_check_age (struct sr_instance *sr);
 void sr_arp_refresh (struct sr_instance *sr, uint32_t ip, char *interface);
 void sr_arp_convert_request_response (struct sr_instance *sr,
 				      uint8_t * packet, unsigned int len,
@@ -81,34 +150,64 @@ void sr_arp_convert_request_response (struct sr_instance *sr,
 
 void sr_arp_print_table (struct sr_instance *sr);
 void sr_arp_print_entry (int i, struct sr_arp_entry entry);
+void sr_arp_print_stats (struct sr_instance *sr);
+
+/* -- sr_dcache.c -- */
+struct sr_dcache_entry *sr_dcache_lookup (struct sr_instance *sr,
+					  uint32_t dst);
+void sr_dcache_fill (struct sr_instance *sr, uint32_t dst, struct sr_rt *route,
+		     const unsigned char *smac, const unsigned char *dmac);
+void sr_dcache_rt_lookup (struct sr_instance *sr);
+void sr_dcache_rt_changed (struct sr_instance *sr);
+void sr_dcache_arp_changed (struct sr_instance *sr);
 
 /* -- sr_buf.c -- */
 void sr_buf_clear (struct sr_instance *);
-void sr_buf_add (struct sr_bundle *);
-void sr_buf_remove (struct sr_instance *, struct sr_buf_entry *);
+void sr_buf_print_stats (struct sr_instance *);
+struct sr_buf_entry *sr_buf_get (struct sr_instance *, unsigned int len);
+void sr_buf_put (struct sr_instance *, struct sr_buf_entry *);
+void sr_buf_add (struct sr_bundle *, struct sr_arp_entry *);
+int sr_buf_policy (const char *name);
+struct sr_buf_entry *sr_buf_detach (struct sr_instance *,
+				    struct sr_arp_entry *);
+void sr_buf_remove (struct sr_instance *, struct sr_buf_entry *, int cause);
 
 /* -- sr_ip.c -- */
 int sr_icmp_handler (struct sr_bundle *);
 int sr_icmp_unreachable (struct sr_bundle *);
 int sr_ip_handler (struct sr_bundle *);
 int sr_ip_forward (struct sr_bundle *);
+int sr_ip_rewrite (struct sr_bundle *, int dst, uint32_t addr,
+		   uint16_t port);
+void sr_icmp_retype (struct sr_bundle *, uint8_t type, uint8_t code);
 uint16_t sr_ip_checksum (uint16_t const data[], uint16_t tot_len);
+uint32_t sr_ip_flow_hash (struct sr_bundle *);
 
 /* -- sr_main.c -- */
 int sr_verify_routing_table (struct sr_instance *sr);
+void sr_print_stats (struct sr_instance *sr);
 
-/* -- sr_vns_comm.c -- */
+/* -- sr_io.c -- */
 int sr_send_packet (struct sr_instance *, uint8_t *, unsigned int,
 		    const char *);
+int sr_send_frame (struct sr_instance *, uint8_t *, unsigned int,
+		   const char *);
+
+/* -- sr_vns_comm.c -- */
 int sr_connect_to_server (struct sr_instance *, unsigned short, char *);
 int sr_read_from_server (struct sr_instance *);
+void sr_vns_print_stats (struct sr_instance *);
+int sr_vns_flush (struct sr_instance *);
 void sr_log_packet (struct sr_instance *sr, uint8_t * buf, int len);
 
 /* -- sr_router.c -- */
 void sr_init (struct sr_instance *);
 void sr_handlepacket (struct sr_instance *, uint8_t *, unsigned int, char *);
+void sr_burst_add (struct sr_instance *, uint8_t *, unsigned int, char *);
+void sr_burst_handle (struct sr_instance *);
 int sr_router_send (struct sr_bundle *);
-void sr_clear_backlog (struct sr_instance *);
+int sr_router_send_via (struct sr_bundle *, struct sr_rt *);
+void sr_router_flush (struct sr_instance *, struct sr_arp_entry *);
 
 /* -- sr_if.c -- */
 
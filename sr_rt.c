@@ -12,6 +12,9 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/time.h>
 
 
 #include <sys/socket.h>
@@ -20,84 +23,311 @@
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_router.h"
 
 /*--------------------------------------------------------------------- 
- * locate routing entry for a given ip address
- * 
+ * Routing table reload
  *
- * returns address of  entry
+ * The FIB is read without locks: lookups load sr->fib once and use that
+ * table to the end. A reload (SIGHUP) parses the rtable file and builds
+ * the new FIB in a separate thread, then publishes it with one atomic
+ * pointer exchange. The replaced FIB is retired and freed by the
+ * forwarding thread at its next quiescent point (between two packets),
+ * when no lookup can still hold a pointer into it.
+ *
+ * Routes added or withdrawn change the published FIB in place: they are
+ * made by the forwarding thread, the only one looking routes up, between
+ * packets. rt_lock orders them with a reload, which holds it from reading
+ * the file to publishing, so a change made during a reload is applied to
+ * the reloaded table instead of one about to be retired.
  *---------------------------------------------------------------------*/
-struct sr_rt *
-sr_rt_locate (struct sr_instance *sr, uint32_t ip)
+
+static int sr_rt_parse (const char *filename, struct sr_rt **list);
+static int sr_rt_read (const char *filename, struct sr_rt **list,
+		       struct sr_fib **fib);
+static struct sr_rt *sr_rt_list_add (struct sr_rt **tail,
+				     struct in_addr dest, struct in_addr gw,
+				     struct in_addr mask, char *if_name);
+
+static void
+sr_rt_free_list (struct sr_rt *r)
 {
-  struct sr_rt *search_inst, *elsewhere, *matchingpref;
-  uint32_t prfx, longpref;
+  struct sr_rt *del;
 
-  assert (sr);
-  assert (ip);
+  while (r)
+    {
+      del = r;
+      r = r->next;
+      free (del);
+    }
+}
+
+/**
+ * make fib the FIB used by lookups and retire the one it replaces
+ */
+static void
+sr_rt_publish (struct sr_instance *sr, struct sr_fib *fib)
+{
+  struct sr_fib *old;
+
+  old = __atomic_exchange_n (&sr->fib, fib, __ATOMIC_ACQ_REL);
+  sr_dcache_rt_changed (sr);
+  if (!old)
+    return;
+
+  old->retired = __atomic_load_n (&sr->fib_retired, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&sr->fib_retired, &old->retired, old,
+				       0, __ATOMIC_RELEASE,
+				       __ATOMIC_RELAXED))
+    ;
+}
+
+/** take rt_lock, once there is a reload thread to order with */
+static void
+sr_rt_lock (struct sr_instance *sr)
+{
+  if (sr->rt_reloader)
+    pthread_mutex_lock (&sr->rt_lock);
+}
 
-  search_inst = sr->routing_table;
-  assert (search_inst);
+static void
+sr_rt_unlock (struct sr_instance *sr)
+{
+  if (sr->rt_reloader)
+    pthread_mutex_unlock (&sr->rt_lock);
+}
 
-  prfx = longpref = 0;
-  //first entry test
+/**
+ * install the routing table list of a reload already published, which
+ * goes with the FIB in use (forwarding thread)
+ */
+static void
+sr_rt_install (struct sr_instance *sr)
+{
+  struct sr_rt *list;
 
-  if (search_inst->dest.s_addr == 0)
+  list = __atomic_exchange_n (&sr->rt_reload_list, 0, __ATOMIC_ACQUIRE);
+  if (list)
     {
-      elsewhere = search_inst;
+      sr_rt_free_list (sr->routing_table);
+      sr->routing_table = list;
+      sr->rt_tail = 0;
     }
-  else if ((prfx = (search_inst->dest.s_addr & search_inst->mask.s_addr)) ==
-	   (ip & search_inst->mask.s_addr))
+}
+
+/**
+ * Called by the forwarding thread when it holds no routing entry: frees
+ * the retired FIBs and installs the routing table list of a reload.
+ */
+void
+sr_rt_quiescent (struct sr_instance *sr)
+{
+  struct sr_fib *fib, *next;
+
+  assert (sr);
+
+  fib = __atomic_exchange_n (&sr->fib_retired, 0, __ATOMIC_ACQUIRE);
+  for (; fib; fib = next)
     {
-      matchingpref = search_inst;
-      longpref = prfx;
-      if (search_inst->mask.s_addr == 0xFFFFFFFF)
-	return search_inst;
+      next = fib->retired;
+      sr_fib_free (fib);
     }
-  //search remaining
-  while (search_inst->next)
+  sr_rt_install (sr);
+}
+
+/**
+ * reload thread: waits for a request, then reads the rtable file again
+ */
+static void *
+sr_rt_reload_thread (void *arg)
+{
+  struct sr_instance *sr = (struct sr_instance *) arg;
+  struct sr_rt *list, *r;
+  struct sr_fib *fib;
+  uint32_t n_routes;
+
+  for (;;)
     {
-      search_inst = search_inst->next;
-      if (search_inst->dest.s_addr == 0)
+      if (sem_wait (&sr->rt_reload_sem) == -1)
+	continue;		/* -- EINTR -- */
+
+      pthread_mutex_lock (&sr->rt_lock);
+      list = 0;
+      if (sr_rt_read (sr->rtable_fn, &list, &fib) != 0)
+	{
+	  fprintf (stderr, "RT: reload of %s failed, keeping routes\n",
+		   sr->rtable_fn);
+	  sr_rt_free_list (list);
+	  pthread_mutex_unlock (&sr->rt_lock);
+	  continue;
+	}
+      for (r = list; r; r = r->next)
 	{
-	  elsewhere = search_inst;
+	  if (!sr_get_interface (sr, r->interface))
+	    break;
 	}
-      else if ((prfx =
-		(search_inst->dest.s_addr & search_inst->mask.s_addr)) ==
-	       (ip & search_inst->mask.s_addr))
+      if (r)
 	{
-	  if (longpref == 0 || prfx > longpref)
-	    {
-	      longpref = prfx;
-	      matchingpref = search_inst;
-	      if (search_inst->mask.s_addr == 0xFFFFFFFF)
-		return search_inst;
-	    }
+	  fprintf (stderr, "RT: reload of %s failed, no interface %s\n",
+		   sr->rtable_fn, r->interface);
+	  sr_rt_free_list (list);
+	  sr_fib_free (fib);
+	  pthread_mutex_unlock (&sr->rt_lock);
+	  continue;
 	}
+
+      if (!fib)
+	fib = sr_fib_build (list, sr->fib_type);
+      n_routes = fib->n_routes;	/* -- fib may be freed once published -- */
+      sr_rt_publish (sr, fib);
+      /* -- a list not yet installed by the forwarding thread is stale -- */
+      sr_rt_free_list (__atomic_exchange_n (&sr->rt_reload_list, list,
+					    __ATOMIC_RELEASE));
+      pthread_mutex_unlock (&sr->rt_lock);
+      printf ("RT: reloaded %s, %u routes\n", sr->rtable_fn, n_routes);
     }
-  if (longpref == 0)
-    return elsewhere;
-  return matchingpref;
+  return 0;
 }
 
 /**
- * free routing table 
+ * start the reload thread
  */
-void
-sr_rt_clear (struct sr_instance *sr)
+int
+sr_rt_reload_init (struct sr_instance *sr)
 {
-  struct sr_rt *r, *del;
+  pthread_t thread;
 
   assert (sr);
-  r = sr->routing_table;
-  while (r)
+
+  if (sem_init (&sr->rt_reload_sem, 0, 0) != 0)
     {
-      del = r;
-      r = r->next;
-      free (del);
+      perror ("sem_init");
+      return -1;
+    }
+  if (pthread_mutex_init (&sr->rt_lock, 0) != 0)
+    {
+      fprintf (stderr, "RT: cannot create the routing table lock\n");
+      return -1;
     }
+  sr->rt_reloader = 1;
+  if (pthread_create (&thread, 0, sr_rt_reload_thread, sr) != 0)
+    {
+      fprintf (stderr, "RT: cannot start reload thread\n");
+      return -1;
+    }
+  pthread_detach (thread);
+  return 0;
+}
+
+/**
+ * request a reload of the rtable file. Only posts a semaphore, so it can
+ * be called from a signal handler.
+ */
+void
+sr_rt_reload (struct sr_instance *sr)
+{
+  sem_post (&sr->rt_reload_sem);
+}
+
+/*--------------------------------------------------------------------- 
+ * locate routing entry for a given ip address
+ * 
+ * longest prefix match in the FIB, which is built from the routing
+ * table list on the first lookup if there is none yet; routes added or
+ * withdrawn later update it in place
+ *
+ * returns address of entry, 0 if there is no route
+ *---------------------------------------------------------------------*/
+struct sr_rt *
+sr_rt_locate (struct sr_instance *sr, uint32_t ip)
+{
+  struct sr_fib *fib;
+
+  assert (sr);
+  assert (ip);
+
+  sr_dcache_rt_lookup (sr);
+  if (!(fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    fib = sr_rt_build_fib (sr);
+  return sr_fib_lookup (fib, ip);
+}
+
+/**
+ * the path of a route a flow with the given hash takes. Routes with a
+ * single next hop are their own path.
+ */
+struct sr_rt *
+sr_rt_path (struct sr_rt *route, uint32_t hash)
+{
+  uint32_t k;
+
+  assert (route);
+
+  if (route->npaths < 2)
+    return route;
+  for (k = ((uint64_t) hash * route->npaths) >> 32; k; k--)
+    route += route->path_next;
+  return route;
+}
+
+/**
+ * locate the routing entries of n (at most FIB_BATCH_MAX) addresses,
+ * out[i] is 0 when there is no route to ip[i]
+ */
+void
+sr_rt_locate_batch (struct sr_instance *sr, const uint32_t *ip,
+		    struct sr_rt **out, int n)
+{
+  struct sr_fib *fib;
+
+  assert (sr);
+
+  sr_dcache_rt_lookup (sr);
+  if (!(fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    fib = sr_rt_build_fib (sr);
+  sr_fib_lookup_batch (fib, ip, out, n);
+}
+
+/**
+ * (re)compile the routing table list into the FIB
+ */
+struct sr_fib *
+sr_rt_build_fib (struct sr_instance *sr)
+{
+  struct timeval start, end;
+  struct sr_fib *fib;
+
+  assert (sr);
+
+  gettimeofday (&start, 0);
+  fib = sr_fib_build (sr->routing_table, sr->fib_type);
+  gettimeofday (&end, 0);
+  sr_rt_publish (sr, fib);
+
+  printf ("FIB: %s table for %u routes built in %.3f ms, %lu KB\n",
+	  sr_fib_type_name (sr->fib_type), fib->n_routes,
+	  (end.tv_sec - start.tv_sec) * 1e3 +
+	  (end.tv_usec - start.tv_usec) / 1e3,
+	  (unsigned long) (sr_fib_memory (fib) >> 10));
+  return fib;
+}
+
+/**
+ * free routing table 
+ */
+void
+sr_rt_clear (struct sr_instance *sr)
+{
+  assert (sr);
+
+  sr_rt_free_list (sr->routing_table);
   sr->routing_table = 0;
+  sr_rt_publish (sr, 0);
+  sr_rt_quiescent (sr);
+  sr_rt_free_list (sr->routing_table);
+  sr->routing_table = 0;
+  sr->rt_tail = 0;
 }
 
 /*--------------------------------------------------------------------- 
@@ -107,6 +337,107 @@ sr_rt_clear (struct sr_instance *sr)
 
 int
 sr_load_rt (struct sr_instance *sr, const char *filename)
+{
+  struct sr_rt *list = 0, *end;
+  struct timeval start, now;
+  struct sr_fib *fib;
+
+  /* -- REQUIRES -- */
+  assert (sr);
+  assert (filename);
+
+  gettimeofday (&start, 0);
+  if (sr_rt_read (filename, &list, &fib) != 0)
+    {
+      sr_rt_free_list (list);
+      return -1;
+    }
+  strncpy (sr->rtable_fn, filename, sizeof (sr->rtable_fn) - 1);
+
+  sr->rt_tail = 0;
+  if (!sr->routing_table)
+    sr->routing_table = list;
+  else
+    {
+      for (end = sr->routing_table; end->next; end = end->next)
+	;
+      end->next = list;
+      /* -- the image does not hold the routes already loaded -- */
+      sr_fib_free (fib);
+      fib = 0;
+    }
+
+  if (!fib)
+    {
+      sr_rt_build_fib (sr);
+      return 0;
+    }
+
+  sr_rt_publish (sr, fib);
+  gettimeofday (&now, 0);
+  printf ("FIB: %s image %s, %u routes loaded in %.3f ms\n",
+	  sr_fib_type_name (fib->type), filename, fib->n_routes,
+	  (now.tv_sec - start.tv_sec) * 1e3 +
+	  (now.tv_usec - start.tv_usec) / 1e3);
+  return 0;			/* -- success -- */
+}				/* -- sr_load_rt -- */
+
+/**
+ * Read a routing table file into list, which must be empty. The file is
+ * a text rtable, or a FIB image written by 'sr -C': *fib is then the FIB
+ * mapped from it (0 for a text rtable) and list holds a copy of its
+ * routes.
+ */
+static int
+sr_rt_read (const char *filename, struct sr_rt **list, struct sr_fib **fib)
+{
+  struct sr_rt **tail = list, *r;
+  uint32_t i;
+
+  *fib = 0;
+  if (!sr_fib_is_image (filename))
+    return sr_rt_parse (filename, list);
+
+  if (!(*fib = sr_fib_load (filename)))
+    return -1;
+  for (i = 1; i <= (*fib)->n_routes; i++)
+    {
+      r = &(*fib)->routes[i];
+      tail = &sr_rt_list_add (tail, r->dest, r->gw, r->mask,
+			      r->interface)->next;
+    }
+  return 0;
+}
+
+/**
+ * Compile the routing table into a FIB image that sr_load_rt maps
+ * instead of parsing the text file.
+ */
+int
+sr_rt_save_image (struct sr_instance *sr, const char *filename)
+{
+  struct sr_fib *fib;
+
+  assert (sr);
+  assert (filename);
+
+  if (!(fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    fib = sr_rt_build_fib (sr);
+  if (sr_fib_save (fib, filename) != 0)
+    {
+      fprintf (stderr, "Error writing FIB image %s\n", filename);
+      return -1;
+    }
+  printf ("FIB: %s image %s written, %u routes\n",
+	  sr_fib_type_name (fib->type), filename, fib->n_routes);
+  return 0;
+}
+
+/**
+ * read the routes of an rtable file into list, which must be empty
+ */
+static int
+sr_rt_parse (const char *filename, struct sr_rt **list)
 {
   FILE *fp;
   char line[BUFSIZ];
@@ -117,6 +448,8 @@ sr_load_rt (struct sr_instance *sr, const char *filename)
   struct in_addr dest_addr;
   struct in_addr gw_addr;
   struct in_addr mask_addr;
+  struct sr_rt **tail = list;
+  int ret = 0;
 
   /* -- REQUIRES -- */
   assert (filename);
@@ -130,81 +463,142 @@ sr_load_rt (struct sr_instance *sr, const char *filename)
 
   while (fgets (line, BUFSIZ, fp) != 0)
     {
-      sscanf (line, "%s %s %s %s", dest, gw, mask, iface);
+      if (sscanf (line, "%31s %31s %31s %31s", dest, gw, mask, iface) != 4)
+	continue;
       if (inet_aton (dest, &dest_addr) == 0)
 	{
 	  fprintf (stderr,
 		   "Error loading routing table, cannot convert %s to valid IP\n",
 		   dest);
-	  return -1;
+	  ret = -1;
+	  break;
 	}
       if (inet_aton (gw, &gw_addr) == 0)
 	{
 	  fprintf (stderr,
 		   "Error loading routing table, cannot convert %s to valid IP\n",
 		   gw);
-	  return -1;
+	  ret = -1;
+	  break;
 	}
       if (inet_aton (mask, &mask_addr) == 0)
 	{
 	  fprintf (stderr,
 		   "Error loading routing table, cannot convert %s to valid IP\n",
 		   mask);
-	  return -1;
+	  ret = -1;
+	  break;
 	}
-      sr_add_rt_entry (sr, dest_addr, gw_addr, mask_addr, iface);
+      tail = &sr_rt_list_add (tail, dest_addr, gw_addr, mask_addr,
+			      iface)->next;
     }				/* -- while -- */
 
-  return 0;			/* -- success -- */
-}				/* -- sr_load_rt -- */
+  fclose (fp);
+  return ret;
+}				/* -- sr_rt_parse -- */
 
 /*--------------------------------------------------------------------- 
  * Method:
  *
+ * Append a route to the routing table list. A FIB already built is
+ * updated in place rather than rebuilt.
  *---------------------------------------------------------------------*/
 
 void
 sr_add_rt_entry (struct sr_instance *sr, struct in_addr dest,
 		 struct in_addr gw, struct in_addr mask, char *if_name)
 {
-  struct sr_rt *rt_search_inst = 0;
+  struct sr_fib *fib;
+  struct sr_rt *r;
 
   /* -- REQUIRES -- */
   assert (if_name);
   assert (sr);
 
-  /* -- empty list special case -- */
-  if (sr->routing_table == 0)
+  sr_rt_lock (sr);
+  sr_rt_install (sr);
+
+  /* -- find the end of the list once, then keep track of it -- */
+  if (!sr->rt_tail)
     {
-      sr->routing_table = (struct sr_rt *) malloc (sizeof (struct sr_rt));
-      assert (sr->routing_table);
-      sr->routing_table->next = 0;
-      sr->routing_table->dest = dest;
-      sr->routing_table->gw = gw;
-      sr->routing_table->mask = mask;
-      sr->routing_table->ifidx = sr_name_index (if_name);
-      strncpy (sr->routing_table->interface, if_name, sr_IFACE_NAMELEN);
-      return;
+      for (sr->rt_tail = &sr->routing_table; *sr->rt_tail;
+	   sr->rt_tail = &(*sr->rt_tail)->next)
+	;
     }
+  r = sr_rt_list_add (sr->rt_tail, dest, gw, mask, if_name);
+  sr->rt_tail = &r->next;
+
+  if ((fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    sr_fib_insert (fib, r);
+  sr_dcache_rt_changed (sr);
+  sr_rt_unlock (sr);
+}				/* -- sr_add_entry -- */
+
+/**
+ * Withdraw the routes to dest/mask from the routing table list and the
+ * FIB. Returns the number of entries removed. Nothing in the router
+ * withdraws routes yet: this is the interface for what will (the churn
+ * benchmark drives the FIB side, sr_fib_delete).
+ */
+int
+sr_del_rt_entry (struct sr_instance *sr, struct in_addr dest,
+		 struct in_addr mask)
+{
+  struct sr_fib *fib;
+  struct sr_rt **r, *del;
+  int removed = 0;
 
-  /* -- find the end of the list -- */
-  rt_search_inst = sr->routing_table;
-  while (rt_search_inst->next)
+  assert (sr);
+
+  sr_rt_lock (sr);
+  sr_rt_install (sr);
+  for (r = &sr->routing_table; *r;)
     {
-      rt_search_inst = rt_search_inst->next;
+      if ((*r)->mask.s_addr == mask.s_addr &&
+	  ((*r)->dest.s_addr & mask.s_addr) == (dest.s_addr & mask.s_addr))
+	{
+	  del = *r;
+	  *r = del->next;
+	  free (del);
+	  removed++;
+	}
+      else
+	r = &(*r)->next;
     }
+  sr->rt_tail = r;
 
-  rt_search_inst->next = (struct sr_rt *) malloc (sizeof (struct sr_rt));
-  assert (rt_search_inst->next);
-  rt_search_inst = rt_search_inst->next;
+  if ((fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    sr_fib_delete (fib, dest, mask);
+  sr_dcache_rt_changed (sr);
+  sr_rt_unlock (sr);
+  return removed;
+}
 
-  rt_search_inst->next = 0;
-  rt_search_inst->dest = dest;
-  rt_search_inst->gw = gw;
-  rt_search_inst->mask = mask;
-  strncpy (rt_search_inst->interface, if_name, sr_IFACE_NAMELEN);
+/**
+ * append a new route at tail, the next field of the last entry of a list
+ */
+static struct sr_rt *
+sr_rt_list_add (struct sr_rt **tail, struct in_addr dest,
+		struct in_addr gw, struct in_addr mask, char *if_name)
+{
+  struct sr_rt *r;
 
-}				/* -- sr_add_entry -- */
+  r = (struct sr_rt *) malloc (sizeof (struct sr_rt));
+  assert (r);
+
+  r->next = 0;
+  r->dest = dest;
+  r->gw = gw;
+  r->mask = mask;
+  r->ifidx = sr_name_index (if_name);
+  strncpy (r->interface, if_name, sr_IFACE_NAMELEN);
+  r->npaths = 0;
+  r->path_next = 0;
+  r->packets = 0;
+
+  *tail = r;
+  return r;
+}				/* -- sr_rt_list_add -- */
 
 /*--------------------------------------------------------------------- 
  * Method:
@@ -253,3 +647,36 @@ sr_print_routing_entry (struct sr_rt *entry)
   printf ("%s\n", entry->interface);
 
 }				/* -- sr_print_routing_entry -- */
+
+/**
+ * print the packets sent through each next hop of the prefixes with
+ * several equal cost paths
+ */
+void
+sr_print_path_stats (struct sr_instance *sr)
+{
+  struct sr_fib *fib;
+  struct sr_rt *r;
+  uint32_t i, k;
+
+  assert (sr);
+
+  if (!(fib = __atomic_load_n (&sr->fib, __ATOMIC_ACQUIRE)))
+    return;
+
+  printf ("Destination\tMask\t\tGateway\t\tIface\tPackets\n");
+  for (i = 1; i <= fib->n_routes; i++)
+    {
+      if (fib->routes[i].npaths < 2)
+	continue;
+      for (k = 0, r = &fib->routes[i]; k < fib->routes[i].npaths;
+	   k++, r += r->path_next)
+	{
+	  printf ("%s\t", inet_ntoa (r->dest));
+	  printf ("%s\t", inet_ntoa (r->mask));
+	  printf ("%s\t", inet_ntoa (r->gw));
+	  printf ("%s\t%llu\n", r->interface,
+		  (unsigned long long) r->packets);
+	}
+    }
+}
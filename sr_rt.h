@@ -34,16 +34,31 @@ struct sr_rt
   uint8_t ifidx;
   char interface[sr_IFACE_NAMELEN];
   struct sr_rt *next;
+
+  /* -- FIB copies only: equal cost next hops of a prefix -- */
+  uint32_t npaths;		/** number of paths, in the first one, else 0 */
+  int32_t path_next;		/** offset to the next path, 0 for the last */
+  uint64_t packets;		/** packets forwarded through this next hop */
 };
 
 
 struct sr_rt *sr_rt_locate (struct sr_instance *, uint32_t);
+void sr_rt_locate_batch (struct sr_instance *, const uint32_t *,
+			 struct sr_rt **, int);
+struct sr_fib *sr_rt_build_fib (struct sr_instance *sr);
 void sr_rt_clear (struct sr_instance *sr);
+struct sr_rt *sr_rt_path (struct sr_rt *route, uint32_t hash);
+void sr_rt_quiescent (struct sr_instance *sr);
+int sr_rt_reload_init (struct sr_instance *sr);
+void sr_rt_reload (struct sr_instance *sr);
 
 int sr_load_rt (struct sr_instance *, const char *);
+int sr_rt_save_image (struct sr_instance *, const char *);
 void sr_add_rt_entry (struct sr_instance *, struct in_addr, struct in_addr,
 		      struct in_addr, char *);
+int sr_del_rt_entry (struct sr_instance *, struct in_addr, struct in_addr);
 void sr_print_routing_table (struct sr_instance *sr);
+void sr_print_path_stats (struct sr_instance *sr);
 void sr_print_routing_entry (struct sr_rt *entry);
 
 
@@ -0,0 +1,310 @@
+/**
+ * Tap backend (Linux): each router interface is the far end of a tap
+ * device of the host, so traffic generators and hosts (in network
+ * namespaces) on the host reach the router through the device. Devices
+ * are opened multi-queue, each queue a descriptor of the event loop, and
+ * read a batch of frames at a time; frames sent are queued per device and
+ * written at the end of the batch.
+ */
+#ifdef _LINUX_
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_io.h"
+
+#define IO_RX_BATCH_LEN (IO_BATCH * IO_FRAME_SIZE)
+
+/** longest frame read or queued, after the room for the command header */
+#define IO_TAP_MTU (IO_FRAME_SIZE - BUF_HEADROOM)
+
+/**
+ * Open the queues of the tap device of port, created if it does not
+ * exist, and bring it up. Kernels without multi-queue taps get one.
+ */
+static int
+sr_tap_open_port (struct sr_io_port *port, int index)
+{
+  struct ifreq ifr;
+  int i, fd, ret, single = 0;
+
+  for (i = 0; i < IO_QUEUES && !single; i++)
+    {
+      if ((fd = open ("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1)
+	{
+	  perror ("open(/dev/net/tun)");
+	  return -1;
+	}
+      memset (&ifr, 0, sizeof (ifr));
+      snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", port->dev);
+      ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE;
+      ret = ioctl (fd, TUNSETIFF, &ifr);
+
+      /* -- older kernels, or a device made single queue: one queue -- */
+      if (ret && i == 0 && errno == EINVAL)
+	{
+	  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	  ret = ioctl (fd, TUNSETIFF, &ifr);
+	  single = 1;
+	}
+      if (ret)
+	{
+	  close (fd);
+	  if (i > 0)
+	    break;
+	  perror ("ioctl(TUNSETIFF)");
+	  return -1;
+	}
+      port->q[i].ev.fd = fd;
+      port->queues = i + 1;
+    }
+
+  /* -- up, through any socket -- */
+  if ((fd = socket (AF_INET, SOCK_DGRAM, 0)) == -1)
+    {
+      perror ("socket(..):sr_tap_open_port");
+      return -1;
+    }
+  memset (&ifr, 0, sizeof (ifr));
+  snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", port->dev);
+  if (ioctl (fd, SIOCGIFFLAGS, &ifr) == 0)
+    {
+      ifr.ifr_flags |= IFF_UP;
+      if (ioctl (fd, SIOCSIFFLAGS, &ifr))
+	perror ("ioctl(SIOCSIFFLAGS)");
+    }
+  close (fd);
+
+  /* -- the router is the other end of the wire: not the device's MAC -- */
+  if (!memcmp (port->iface->addr, "\0\0\0\0\0\0", ETHER_ADDR_LEN))
+    {
+      port->iface->addr[0] = 0x02;	/* locally administered */
+      port->iface->addr[1] = 's';
+      port->iface->addr[2] = 'r';
+      port->iface->addr[5] = index;
+    }
+
+  if (!(port->tx_buf = malloc (IO_BATCH * IO_FRAME_SIZE)))
+    return -1;
+  return 0;
+}
+
+/**
+ * Open the devices of all interfaces
+ */
+static int
+sr_tap_open (struct sr_instance *sr)
+{
+  int i;
+
+  if (!(sr->io.rx_buf = malloc (IO_RX_BATCH_LEN)))
+    return -1;
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i] && sr_tap_open_port (sr->io.ports[i], i))
+      {
+	fprintf (stderr, "Cannot attach %s to %s\n",
+		 sr->io.ports[i]->iface->name, sr->io.ports[i]->dev);
+	return -1;
+      }
+  return 0;
+}
+
+/**
+ * Write the frames queued for port
+ */
+static void
+sr_tap_flush_port (struct sr_io_port *port)
+{
+  uint32_t i;
+
+  for (i = 0; i < port->tx_pending; i++)
+    if (write (port->q[0].ev.fd, port->tx_iov[i].iov_base,
+	       port->tx_iov[i].iov_len) == -1)
+      port->drops++;
+  port->tx_pending = 0;
+}
+
+/**
+ * A queue is readable: read a batch of frames into rx_buf, handle them,
+ * then send what they produced while they are still there
+ */
+static void
+sr_tap_event (struct sr_instance *sr, struct sr_event *ev)
+{
+  struct sr_io_port *port = ((struct sr_io_queue *) ev)->port;
+  uint32_t len[IO_BATCH];
+  uint8_t *frame;
+  ssize_t n;
+  int i, count;
+
+  for (count = 0; count < IO_BATCH; count++)
+    {
+      frame = sr->io.rx_buf + count * IO_FRAME_SIZE + BUF_HEADROOM;
+      if ((n = read (ev->fd, frame, IO_TAP_MTU)) <= 0)
+	{
+	  if (n == -1 && errno != EAGAIN && errno != EINTR)
+	    perror ("read(..):sr_tap_event");
+	  break;
+	}
+      len[count] = n;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      frame = sr->io.rx_buf + i * IO_FRAME_SIZE + BUF_HEADROOM;
+
+      /* -- frames the host sent to other stations -- */
+      if (len[i] < sizeof (struct sr_ethernet_hdr)
+	  || (!(frame[0] & 1)
+	      && memcmp (frame, port->iface->addr, ETHER_ADDR_LEN)))
+	continue;
+      port->rx++;
+
+      sr_log_packet (sr, frame, len[i]);
+      sr_burst_add (sr, frame, len[i], port->iface->name);
+    }
+  sr_burst_handle (sr);
+  sr_io_flush (sr);
+}
+
+/**
+ * Watch every queue of every device
+ */
+static int
+sr_tap_start (struct sr_instance *sr)
+{
+  struct sr_io_port *port;
+  uint32_t q;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if ((port = sr->io.ports[i]))
+      for (q = 0; q < port->queues; q++)
+	if (sr_event_add (sr, &port->q[q].ev, port->q[q].ev.fd, sr_tap_event))
+	  return -1;
+  return 0;
+}
+
+/**
+ * Queue a frame for the device of iface. Frames still in rx_buf (headroom)
+ * are queued in place, as the queue is written before the next batch is
+ * read; others are copied.
+ */
+static int
+sr_tap_send (struct sr_instance *sr, uint8_t * buf, unsigned int len,
+	     const char *iface, int headroom)
+{
+  struct sr_io_port *port = sr->io.ports[sr_name_index (iface)];
+  uint8_t *copy;
+
+  if (!port || port->q[0].ev.fd == -1)
+    {
+      fprintf (stderr, "** Error, interface %s, does not exist\n", iface);
+      return -1;
+    }
+  sr_log_packet (sr, buf, len);
+
+  if (len > IO_TAP_MTU)
+    {
+      if (write (port->q[0].ev.fd, buf, len) != (ssize_t) len)
+	{
+	  port->drops++;
+	  return -1;
+	}
+      port->tx++;
+      return 0;
+    }
+
+  if (port->tx_pending == IO_BATCH)
+    sr_tap_flush_port (port);
+  if (!headroom || buf < sr->io.rx_buf || buf >= sr->io.rx_buf
+      + IO_RX_BATCH_LEN)
+    {
+      copy = port->tx_buf + port->tx_pending * IO_FRAME_SIZE;
+      memcpy (copy, buf, len);
+      buf = copy;
+    }
+  port->tx_iov[port->tx_pending].iov_base = buf;
+  port->tx_iov[port->tx_pending].iov_len = len;
+  port->tx_pending++;
+  port->tx++;
+  return 0;
+}
+
+/**
+ * Write the frames queued for all devices
+ */
+static int
+sr_tap_flush (struct sr_instance *sr)
+{
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if (sr->io.ports[i] && sr->io.ports[i]->tx_pending)
+      sr_tap_flush_port (sr->io.ports[i]);
+  return 0;
+}
+
+/**
+ * Print the frames received, sent and dropped per device (SIGUSR1)
+ */
+static void
+sr_tap_print_stats (struct sr_instance *sr)
+{
+  struct sr_io_port *port;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    if ((port = sr->io.ports[i]) && port->queues)
+      printf ("%s (%s, %u queues): %lu received, %lu sent, "
+	      "%lu not written\n", port->iface->name, port->dev,
+	      port->queues, (unsigned long) port->rx,
+	      (unsigned long) port->tx, (unsigned long) port->drops);
+}
+
+/**
+ * Close the queues, which removes devices the router created (exit)
+ */
+static void
+sr_tap_close (struct sr_instance *sr)
+{
+  struct sr_io_port *port;
+  uint32_t q;
+  int i;
+
+  for (i = 0; i < IFACE_MAX; i++)
+    {
+      if (!(port = sr->io.ports[i]))
+	continue;
+      for (q = 0; q < port->queues; q++)
+	close (port->q[q].ev.fd);
+      port->queues = 0;
+      free (port->tx_buf);
+      port->tx_buf = 0;
+    }
+  free (sr->io.rx_buf);
+  sr->io.rx_buf = 0;
+}
+
+/** the tap backend, interfaces come from the interface file */
+const struct sr_io_ops sr_io_tap = {
+  "tap",
+  sr_tap_open,
+  sr_tap_start,
+  sr_tap_send,
+  sr_tap_flush,
+  sr_tap_print_stats,
+  sr_tap_close,
+};
+
+#endif /* _LINUX_ */
@@ -0,0 +1,209 @@
+/**
+ * Timer wheel routines
+ *
+ * A timer due in d ticks goes to the lowest level n whose slots span
+ * d (TIMER_SLOTS^n <= d < TIMER_SLOTS^(n+1)), in the slot of its expiry
+ * tick's level n digit. When the tick digits below level n all wrap to
+ * zero, the slot of level n for the current tick is emptied and its
+ * timers linked again, which puts them at a lower level. Level 0 slots
+ * are run when the wheel reaches their tick.
+ */
+#include <assert.h>
+#include <time.h>
+#include "sr_timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+/**
+ * current time in ticks of the monotonic clock
+ */
+uint64_t
+sr_timer_ticks (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void
+sr_timer_init (struct sr_timer_wheel *w)
+{
+  int level, i;
+
+  assert (w);
+
+  for (level = 0; level < TIMER_LEVELS; level++)
+    for (i = 0; i < TIMER_SLOTS; i++)
+      w->slots[level][i] = 0;
+  w->now = sr_timer_ticks ();
+  w->count = 0;
+}
+
+/** put t in the slot of its expiry, t->expires >= w->now */
+static void
+sr_timer_link (struct sr_timer_wheel *w, struct sr_timer *t)
+{
+  struct sr_timer **head;
+  uint64_t expires = t->expires;
+  int level;
+
+  if (expires - w->now > TIMER_MAX_TICKS)
+    expires = w->now + TIMER_MAX_TICKS;
+  for (level = 0; level < TIMER_LEVELS - 1; level++)
+    if (!((expires - w->now) >> (TIMER_BITS * (level + 1))))
+      break;
+
+  head = &w->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK];
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+/**
+ * Schedule t to call fn in ms milliseconds (rounded up to a tick). A
+ * pending timer is moved.
+ */
+void
+sr_timer_add (struct sr_timer_wheel *w, struct sr_timer *t, sr_timer_fn fn,
+	      uint32_t ms)
+{
+  assert (w);
+  assert (t);
+  assert (fn);
+
+  sr_timer_del (w, t);
+  t->fn = fn;
+  t->expires = sr_timer_ticks () + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  if (t->expires < w->now)
+    t->expires = w->now;
+  sr_timer_link (w, t);
+  w->count++;
+}
+
+/**
+ * Cancel t if it is pending
+ */
+void
+sr_timer_del (struct sr_timer_wheel *w, struct sr_timer *t)
+{
+  assert (w);
+  assert (t);
+
+  if (!t->pprev)
+    return;
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = 0;
+  t->pprev = 0;
+  w->count--;
+}
+
+/**
+ * Cancel all pending timers calling fn, and pass each to release (on
+ * exit, for timers allocated by their owner)
+ */
+void
+sr_timer_del_all (struct sr_timer_wheel *w, sr_timer_fn fn,
+		  void (*release) (struct sr_timer *))
+{
+  struct sr_timer *t, *next;
+  int level, i;
+
+  assert (w);
+
+  for (level = 0; level < TIMER_LEVELS; level++)
+    for (i = 0; i < TIMER_SLOTS; i++)
+      for (t = w->slots[level][i]; t; t = next)
+	{
+	  next = t->next;
+	  if (t->fn != fn)
+	    continue;
+	  sr_timer_del (w, t);
+	  if (release)
+	    release (t);
+	}
+}
+
+/**
+ * Tick by which sr_timer_run next has work: the next expiry at level 0,
+ * else the next cascade of the higher levels. UINT64_MAX if no timer is
+ * pending.
+ */
+uint64_t
+sr_timer_next (struct sr_timer_wheel *w)
+{
+  uint64_t t;
+
+  assert (w);
+
+  if (!w->count)
+    return UINT64_MAX;
+  for (t = w->now; t < w->now + TIMER_SLOTS; t++)
+    if (w->slots[0][t & TIMER_MASK] || !(t & TIMER_MASK))
+      break;
+  return t;
+}
+
+/** link the timers of a slot of level again, at lower levels */
+static void
+sr_timer_cascade (struct sr_timer_wheel *w, int level, int i)
+{
+  struct sr_timer *t, *next;
+
+  t = w->slots[level][i];
+  w->slots[level][i] = 0;
+  for (; t; t = next)
+    {
+      next = t->next;
+      sr_timer_link (w, t);
+    }
+}
+
+/**
+ * Run the timers expired by now. Callbacks may add and cancel timers,
+ * including the other timers expiring in the same tick.
+ */
+void
+sr_timer_run (struct sr_timer_wheel *w, struct sr_instance *sr)
+{
+  struct sr_timer *t, *expired;
+  uint64_t target;
+  int level;
+
+  assert (w);
+
+  target = sr_timer_ticks ();
+  while (w->now <= target)
+    {
+      if (!w->count)
+	{
+	  w->now = target + 1;
+	  break;
+	}
+
+      for (level = 1; level < TIMER_LEVELS; level++)
+	{
+	  if (w->now & ((1ULL << (TIMER_BITS * level)) - 1))
+	    break;
+	  sr_timer_cascade (w, level,
+			    (w->now >> (TIMER_BITS * level)) & TIMER_MASK);
+	}
+
+      /* -- timers added by the callbacks go to later ticks -- */
+      expired = w->slots[0][w->now & TIMER_MASK];
+      w->slots[0][w->now & TIMER_MASK] = 0;
+      if (expired)
+	expired->pprev = &expired;
+      w->now++;
+
+      while ((t = expired))
+	{
+	  sr_timer_del (w, t);
+	  t->fn (sr, t);
+	}
+    }
+}
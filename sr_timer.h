@@ -0,0 +1,70 @@
+/**
+ * Hierarchical timer wheel. Pending timers hang off TIMER_LEVELS wheels of
+ * TIMER_SLOTS slots each, a slot of level n covering TIMER_SLOTS^n ticks;
+ * a slot is moved down a level when the wheel below it wraps. Adding,
+ * cancelling and expiring a timer cost O(1) whatever the number of
+ * pending timers.
+ */
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sr_instance;
+struct sr_timer;
+
+/** Tick of the wheel in milliseconds */
+#define TIMER_TICK_MS 10
+
+/** Slots per level, a power of two */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+/** Longest delay in ticks (about 46 hours), later timers wait at the top */
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+typedef void (*sr_timer_fn) (struct sr_instance *, struct sr_timer *);
+
+/**
+ * A timer, embedded in the structure it is for (see sr_timer_entry).
+ * It must be zeroed before it is first added.
+ */
+struct sr_timer
+{
+  struct sr_timer *next;
+  struct sr_timer **pprev;	/** 0 if not pending */
+  uint64_t expires;		/** tick */
+  sr_timer_fn fn;		/** called once expired, not pending anymore */
+};
+
+struct sr_timer_wheel
+{
+  struct sr_timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+  uint64_t now;			/** next tick to run */
+  uint32_t count;		/** pending timers */
+};
+
+/** structure of type type containing timer t as member member */
+#define sr_timer_entry(t, type, member) \
+  ((type *) ((char *) (t) - offsetof (type, member)))
+
+static inline int
+sr_timer_pending (const struct sr_timer *t)
+{
+  return t->pprev != 0;
+}
+
+uint64_t sr_timer_ticks (void);
+void sr_timer_init (struct sr_timer_wheel *);
+void sr_timer_add (struct sr_timer_wheel *, struct sr_timer *, sr_timer_fn,
+		   uint32_t ms);
+void sr_timer_del (struct sr_timer_wheel *, struct sr_timer *);
+void sr_timer_del_all (struct sr_timer_wheel *, sr_timer_fn,
+		       void (*release) (struct sr_timer *));
+void sr_timer_run (struct sr_timer_wheel *, struct sr_instance *);
+uint64_t sr_timer_next (struct sr_timer_wheel *);
+
+#endif
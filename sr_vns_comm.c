@@ -30,16 +30,21 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_io.h"
 
 #include "sha1.h"
 
@@ -50,6 +55,8 @@ static int sr_arp_req_not_for_us (struct sr_instance *sr,
 				  char *interface /* lent */ );
 int sr_read_from_server_expect (struct sr_instance *sr /* borrowed */ ,
 				int expected_cmd);
+static int sr_handle_command (struct sr_instance *sr, unsigned char *buf,
+			      int len, int expected_cmd);
 
 /*-----------------------------------------------------------------------------
  * Method: sr_connect_to_server()
@@ -335,6 +342,8 @@ sr_handle_auth_status (struct sr_instance *sr, c_auth_status * status)
  * Scope: global
  *
  * Houses main while loop for communicating with the virtual router server.
+ * Reads what the server sent into a ring with one recv, and handles all
+ * the complete commands in it.
  *
  *---------------------------------------------------------------------------*/
 
@@ -348,90 +357,120 @@ int
 sr_read_from_server_expect (struct sr_instance *sr /* borrowed */ ,
 			    int expected_cmd)
 {
-  int command, len;
-  unsigned char buf[VNSCMDSIZE + MPADDING];
-  c_packet_ethernet_header *sr_pkt = 0;
-  int ret = 0, bytes_read = 0;
+  uint32_t len;
+  unsigned char *buf;
+  int ret = 0, commands = 0;
 
   /* REQUIRES */
   assert (sr);
 
+  if (!sr->rx_ring && !(sr->rx_ring = malloc (VNS_RX_SIZE)))
+    {
+      fprintf (stderr, "Error: out of memory (sr_read_from_server)\n");
+      return -1;
+    }
+
+  for (;;)
+    {
+      /* -- handle every complete command in the ring, only the next one
+	 when expecting a command -- */
+      while (sr->rx_tail - sr->rx_head >= 4)
+	{
+	  buf = sr->rx_ring + sr->rx_head;
+	  memcpy (&len, buf, 4);
+	  len = ntohl (len);
+	  if (len > VNSCMDSIZE || len < sizeof (c_base))
+	    {
+	      fprintf (stderr, "Error: command length to large %u\n", len);
+	      close (sr->sockfd);
+	      return -1;
+	    }
+	  if (sr->rx_tail - sr->rx_head < len)
+	    break;
+
+	  sr->rx_head += len;
+	  sr->rx_commands++;
+	  commands++;
+	  ret = sr_handle_command (sr, buf, len, expected_cmd);
+	  if (ret != 1 || expected_cmd)
+	    {
+	      sr_burst_handle (sr);
+	      sr_vns_flush (sr);
+	      return ret;
+	    }
+	}
+      /* -- the packets of the ring are handled as bursts -- */
+      sr_burst_handle (sr);
+      if (commands)
+	return sr_vns_flush (sr) == 0 ? 1 : -1;
+
     /*---------------------------------------------------------------------------
-      Read a command from the server
+      Read as much as the server sent, after the partial command left
       -------------------------------------------------------------------------*/
 
-  bytes_read = 0;
+      /* -- packets queued from the ring are written before it moves -- */
+      assert (!sr->tx_count);
+      if (sr->rx_head)
+	{
+	  memmove (sr->rx_ring, sr->rx_ring + sr->rx_head,
+		   sr->rx_tail - sr->rx_head);
+	  sr->rx_tail -= sr->rx_head;
+	  sr->rx_head = 0;
+	}
 
-  /* attempt to read the size of the incoming packet */
-  while (bytes_read < 4)
-    {
       do
 	{			/* -- just in case SIGALRM breaks recv -- */
 	  errno = 0;		/* -- hacky glibc workaround -- */
-	  if ((ret = recv (sr->sockfd, ((uint8_t *) & len) + bytes_read,
-			   4 - bytes_read, 0)) == -1)
+	  if ((ret = recv (sr->sockfd, sr->rx_ring + sr->rx_tail,
+			   VNS_RX_SIZE - sr->rx_tail, 0)) == -1)
 	    {
 	      if (errno == EINTR)
 		{
 		  continue;
 		}
+	      /* -- nonblocking socket (event loop): the rest comes later -- */
+	      if ((errno == EAGAIN || errno == EWOULDBLOCK) && !expected_cmd)
+		return 1;
 
 	      perror ("recv(..):sr_client.c::sr_read_from_server");
 	      return -1;
 	    }
-	  bytes_read += ret;
 	}
       while (errno == EINTR);	/* be mindful of signals */
-    }
-
-  len = ntohl (len);
 
-  if (len > VNSCMDSIZE || len < 0)
-    {
-      fprintf (stderr, "Error: command length to large %d\n", len);
-      close (sr->sockfd);
-      return -1;
-    }
-/*
-    if((buf = malloc(len + MPADDING)) == 0)
-    {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
+      if (ret == 0)
+	{
+	  fprintf (stderr, "VNS server closed the connection.\n");
+	  close (sr->sockfd);
+	  return -1;
+	}
+      sr->rx_tail += ret;
+      sr->rx_reads++;
     }
-*/
+}				/* -- sr_read_from_server -- */
 
-  /* set first field of command since we've already read it */
-  *((int *) buf) = htonl (len);
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_command(..)
+ * Scope: Local
+ *
+ * Handle a command of len bytes read in buf.
+ *
+ *---------------------------------------------------------------------------*/
 
-  bytes_read = 0;
+static int
+sr_handle_command (struct sr_instance *sr /* borrowed */ ,
+		   unsigned char *buf /* borrowed */ , int len,
+		   int expected_cmd)
+{
+  int command, ret;
+  c_packet_ethernet_header *sr_pkt = 0;
 
-  /* read the rest of the command */
-  while (bytes_read < len - 4)
-    {
-      do
-	{			/* -- just in case SIGALRM breaks recv -- */
-	  errno = 0;		/* -- hacky glibc workaround -- */
-	  if ((ret =
-	       read (sr->sockfd, buf + 4 + bytes_read,
-		     len - 4 - bytes_read)) == -1)
-	    {
-	      if (errno == EINTR)
-		{
-		  continue;
-		}
-	      fprintf (stderr, "Error: failed reading command body %d\n",
-		       ret);
-	      close (sr->sockfd);
-	      return -1;
-	    }
-	  bytes_read += ret;
-	}
-      while (errno == EINTR);	/* be mindful of signals */
-    }
+  /* -- commands in the ring are not aligned, c_base is packed -- */
+  command = ((c_base *) buf)->mType = ntohl (((c_base *) buf)->mType);
 
-  /* My entry for most unreadable line of code - guido */
-  /* ... you win - mc                                  */
-  command = *(((int *) buf) + 1) = ntohl (*(((int *) buf) + 1));
+  /* -- packets received before the command are handled first -- */
+  if (command != VNSPACKET)
+    sr_burst_handle (sr);
 
   /* make sure the command is what we expected if we were expecting something */
   if (expected_cmd && command != expected_cmd)
@@ -466,12 +505,14 @@ sr_read_from_server_expect (struct sr_instance *sr /* borrowed */ ,
       sr_log_packet (sr, buf + sizeof (c_packet_header),
 		     ntohl (sr_pkt->mLen) - sizeof (c_packet_header));
 
-      /* -- pass to router, student's code should take over here -- */
-      sr_handlepacket (sr,
-		       (buf + sizeof (c_packet_header)),
-		       len - sizeof (c_packet_ethernet_header) +
-		       sizeof (struct sr_ethernet_hdr),
-		       (char *) (buf + sizeof (c_base)));
+      /* -- pass to router with the other packets of the ring; packets
+	 are answered in place, short ones are copied so they do not grow
+	 over the next command -- */
+      sr_burst_add (sr,
+		    (buf + sizeof (c_packet_header)),
+		    len - sizeof (c_packet_ethernet_header) +
+		    sizeof (struct sr_ethernet_hdr),
+		    (char *) (buf + sizeof (c_base)));
 
       break;
 
@@ -481,10 +522,6 @@ sr_read_from_server_expect (struct sr_instance *sr /* borrowed */ ,
       fprintf (stderr, "VNS server closed session.\n");
       fprintf (stderr, "Reason: %s\n", ((c_close *) buf)->mErrorMessage);
 
-/*
-            if(buf)
-            { free(buf); }
-*/
       return 0;
       break;
 
@@ -529,12 +566,28 @@ sr_read_from_server_expect (struct sr_instance *sr /* borrowed */ ,
       break;
 
     }				/* -- switch -- */
-/*
-    if(buf)
-    { free(buf); }
-*/
   return ret;
-}				/* -- sr_read_from_server -- */
+}				/* -- sr_handle_command -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_print_stats(..)
+ * Scope: Global
+ *
+ * Print the commands read from the server per recv, and the packets
+ * sent per write (SIGUSR1)
+ *
+ *---------------------------------------------------------------------------*/
+
+void
+sr_vns_print_stats (struct sr_instance *sr /* borrowed */ )
+{
+  printf ("VNS: %lu commands in %lu reads (%.2f per read)\n",
+	  (unsigned long) sr->rx_commands, (unsigned long) sr->rx_reads,
+	  sr->rx_reads ? (double) sr->rx_commands / sr->rx_reads : 0.0);
+  printf ("VNS: %lu packets sent in %lu writes (%.2f per write)\n",
+	  (unsigned long) sr->tx_frames, (unsigned long) sr->tx_writes,
+	  sr->tx_writes ? (double) sr->tx_frames / sr->tx_writes : 0.0);
+}				/* -- sr_vns_print_stats -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
@@ -584,26 +637,84 @@ sr_ether_addrs_match_interface (struct sr_instance *sr,	/* borrowed */
 }				/* -- sr_ether_addrs_match_interface -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_send_packet(..)
+ * Method: sr_vns_flush(..)
  * Scope: Global
  *
- * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * Write the packets queued for the server with one writev.
  *
  *---------------------------------------------------------------------------*/
 
 int
-sr_send_packet (struct sr_instance *sr /* borrowed */ ,
-		uint8_t * buf /* borrowed */ ,
-		unsigned int len, const char *iface /* borrowed */ )
+sr_vns_flush (struct sr_instance *sr /* borrowed */ )
 {
-  c_packet_header sr_pkt[VNSCMDSIZE + sizeof (c_packet_header) + MPADDING];
-  unsigned int total_len = len + (sizeof (c_packet_header));
+  struct iovec *iov = sr->tx_iov;
+  int count = sr->tx_count, ret = 0;
+  struct pollfd pfd;
+  ssize_t n;
 
   /* REQUIRES */
   assert (sr);
-  assert (buf);
-  assert (iface);
+
+  while (count)
+    {
+      if ((n = writev (sr->sockfd, iov, count)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  /* -- nonblocking socket: wait for room -- */
+	  if (errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      pfd.fd = sr->sockfd;
+	      pfd.events = POLLOUT;
+	      poll (&pfd, 1, -1);
+	      continue;
+	    }
+	  perror ("writev(..):sr_vns_flush");
+	  ret = -1;
+	  break;
+	}
+      sr->tx_writes++;
+
+      /* -- skip what was written, a signal may cut the write short -- */
+      for (; count && (size_t) n >= iov->iov_len; iov++, count--)
+	n -= iov->iov_len;
+      if (count)
+	{
+	  iov->iov_base = (uint8_t *) iov->iov_base + n;
+	  iov->iov_len -= n;
+	}
+    }
+
+  sr->tx_count = 0;
+  sr->tx_bytes = 0;
+  sr->tx_copied = 0;
+  return ret;
+}				/* -- sr_vns_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_queue_packet(..)
+ * Scope: Local
+ *
+ * Queue a packet (ethernet header included!) of length 'len' for the
+ * server. Packets in the receive ring are queued in place, with their
+ * command header in front of them (headroom); others are copied, as
+ * their memory may be reused before the queue is written. The queue is
+ * written once it is full, holds VNS_TX_BYTES bytes, or its first packet
+ * waited more than the flush delay.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int
+sr_queue_packet (struct sr_instance *sr /* borrowed */ ,
+		 uint8_t * buf /* borrowed */ ,
+		 unsigned int len, const char *iface /* borrowed */ ,
+		 int headroom)
+{
+  unsigned int total_len = len + (sizeof (c_packet_header));
+  c_packet_header *sr_pkt;
+  struct iovec *last;
+  struct timespec ts;
+  uint64_t now;
 
   /* don't waste my time ... */
   if (len < sizeof (struct sr_ethernet_hdr))
@@ -611,16 +722,11 @@ sr_send_packet (struct sr_instance *sr /* borrowed */ ,
       fprintf (stderr, "** Error: packet is wayy to short \n");
       return -1;
     }
-
-  /* Create packet */
-/*
-    sr_pkt = (c_packet_header *)malloc(total_len + MPADDING);
-    assert(sr_pkt);
-*/
-  sr_pkt->mLen = htonl (total_len);
-  sr_pkt->mType = htonl (VNSPACKET);
-  strncpy (sr_pkt->mInterfaceName, iface, 16);
-  memcpy (((uint8_t *) sr_pkt) + sizeof (c_packet_header), buf, len);
+  if (len > VNSCMDSIZE)
+    {
+      fprintf (stderr, "** Error: packet is too long \n");
+      return -1;
+    }
 
   /* -- log packet -- */
   sr_log_packet (sr, buf, len);
@@ -629,27 +735,105 @@ sr_send_packet (struct sr_instance *sr /* borrowed */ ,
     {
       fprintf (stderr,
 	       "*** Error: problem with ethernet header, check log\n");
-/*
-        free ( sr_pkt );
-*/
       return -1;
     }
 
-  if (write (sr->sockfd, sr_pkt, total_len) < total_len)
+  /* -- make room for the copy -- */
+  if (sr->tx_count == VNS_TX_IOV
+      || (!headroom && sr->tx_copied + total_len > VNS_TX_BYTES + VNSCMDSIZE))
+    sr_vns_flush (sr);
+  if (!sr->tx_buf
+      && !(sr->tx_buf = malloc (VNS_TX_BYTES + VNSCMDSIZE + MPADDING)))
     {
-      fprintf (stderr, "Error writing packet\n");
-/*
-        free(sr_pkt);
-*/
+      fprintf (stderr, "Error: out of memory (sr_queue_packet)\n");
       return -1;
     }
 
-/*
-    free(sr_pkt);
-*/
+  if (headroom && buf >= sr->rx_ring && buf < sr->rx_ring + VNS_RX_SIZE)
+    sr_pkt = (c_packet_header *) (buf - BUF_HEADROOM);
+  else
+    {
+      sr_pkt = (c_packet_header *) (sr->tx_buf + sr->tx_copied);
+      memcpy (sr_pkt + 1, buf, len);
+      sr->tx_copied += total_len;
+    }
+  sr_pkt->mLen = htonl (total_len);
+  sr_pkt->mType = htonl (VNSPACKET);
+  strncpy (sr_pkt->mInterfaceName, iface, 16);
+
+  /* -- packets following each other in memory are written as one -- */
+  last = sr->tx_count ? &sr->tx_iov[sr->tx_count - 1] : 0;
+  if (last && (uint8_t *) last->iov_base + last->iov_len == (uint8_t *) sr_pkt)
+    last->iov_len += total_len;
+  else
+    {
+      sr->tx_iov[sr->tx_count].iov_base = sr_pkt;
+      sr->tx_iov[sr->tx_count].iov_len = total_len;
+      sr->tx_count++;
+    }
+  sr->tx_bytes += total_len;
+  sr->tx_frames++;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (sr->tx_bytes == total_len)
+    sr->tx_first = now;
+  if (sr->tx_bytes >= VNS_TX_BYTES || now - sr->tx_first >= sr->tx_delay_us)
+    return sr_vns_flush (sr);
 
   return 0;
-}				/* -- sr_send_packet -- */
+}				/* -- sr_queue_packet -- */
+
+#ifdef _LINUX_
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_event(..)
+ * Scope: Local
+ *
+ * The server socket is readable (event loop)
+ *
+ *---------------------------------------------------------------------------*/
+
+static void
+sr_vns_event (struct sr_instance *sr /* borrowed */ ,
+	      struct sr_event *ev /* borrowed */ )
+{
+  int ret = sr_read_from_server (sr);
+
+  if (ret != 1)
+    sr->loop.stop = ret == 0 ? 1 : -1;
+}				/* -- sr_vns_event -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_start(..)
+ * Scope: Local
+ *
+ * Make the server socket nonblocking, now that the session is set up, and
+ * watch it in the event loop.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int
+sr_vns_start (struct sr_instance *sr /* borrowed */ )
+{
+  fcntl (sr->sockfd, F_SETFL, fcntl (sr->sockfd, F_GETFL) | O_NONBLOCK);
+  return sr_event_add (sr, &sr->loop.vns, sr->sockfd, sr_vns_event);
+}				/* -- sr_vns_start -- */
+#endif /* _LINUX_ */
+
+/** the VNS server backend, interfaces come from the server */
+const struct sr_io_ops sr_io_vns = {
+  "vns",
+  0,
+#ifdef _LINUX_
+  sr_vns_start,
+#else
+  0,
+#endif /* _LINUX_ */
+  sr_queue_packet,
+  sr_vns_flush,
+  sr_vns_print_stats,
+  0,
+};
 
 /*-----------------------------------------------------------------------------
  * Method: sr_log_packet()
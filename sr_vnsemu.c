@@ -0,0 +1,1010 @@
+/**
+ * Local stand-in for the VNS server, built by 'make sr_vnsemu', so the
+ * router can be run and load tested without the remote service.
+ *
+ * It accepts one router, authenticates it (against an auth key file if
+ * given), sends the routing table of its topology when the router asks
+ * for a template, and the hardware information of the topology. Each
+ * router interface has one host on its link, which answers ARP requests
+ * and pings. Once the router is up, the hosts send UDP flows to each other
+ * through the router at a given rate, or replay the frames of a pcap file,
+ * and the frames the router forwards are counted per flow, with their
+ * latency, until the end of the test, when the session is closed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_dumper.h"
+#include "vnscommand.h"
+#include "sha1.h"
+
+#define EMU_PORT 3250
+#define EMU_IFACES 32
+#define EMU_FLOWS 1024
+#define EMU_FRAMES 65536	/** frames of a pcap file kept at most */
+
+/** generated frames carry EMU_MAGIC, their flow, sequence and send time */
+#define EMU_MAGIC 0x56454d55
+#define EMU_UDP_PORT 9000
+#define EMU_MIN_SIZE 64
+#define EMU_MAX_SIZE 1514
+
+/** bytes queued for the router at most, frames generated per pass */
+#define EMU_OUT_SIZE (1 << 20)
+#define EMU_BURST 64
+
+/** latency histogram: bucket n counts latencies below 2^n us */
+#define EMU_LAT_BUCKETS 32
+
+#define AUTH_KEY_LEN 64
+#define SHA1_LEN 20
+
+/** a router interface and the host on its link */
+struct emu_iface
+{
+  char name[16];
+  uint32_t ip;			/** router, network byte order */
+  uint32_t mask;
+  uint8_t mac[ETHER_ADDR_LEN];
+  uint32_t host_ip;
+  uint8_t host_mac[ETHER_ADDR_LEN];
+  uint64_t rx;			/** frames the router sent on the link */
+};
+
+struct emu_flow
+{
+  int src;			/** interface of the sending host */
+  int dst;
+  uint32_t seq;			/** next to send */
+  uint32_t last;		/** highest received */
+  uint64_t sent;
+  uint64_t received;
+  uint64_t reordered;
+  uint64_t lat_sum;		/** us */
+  uint64_t lat_max;
+  uint64_t lat[EMU_LAT_BUCKETS];
+};
+
+/** payload of the generated frames */
+struct emu_stamp
+{
+  uint32_t magic;
+  uint32_t flow;
+  uint32_t seq;
+  uint64_t sent;		/** us */
+} __attribute__ ((packed));
+
+struct emu
+{
+  int fd;
+  struct emu_iface ifs[EMU_IFACES];
+  int nifs;
+  struct emu_flow flows[EMU_FLOWS];
+  int nflows;
+
+  /* -- load -- */
+  double rate;			/** frames/s, 0 as fast as possible */
+  uint64_t count;		/** frames to send */
+  int size;			/** frame size */
+  uint64_t sent;
+  uint64_t sent_bytes;
+  uint8_t **frames;		/** pcap frames, sent instead of flows */
+  uint32_t *frame_lens;
+  uint32_t nframes;
+
+  /* -- frames from the router -- */
+  uint64_t received;
+  uint64_t received_bytes;
+  uint64_t forwarded;		/** IP frames */
+  uint64_t arp_replies;
+  uint64_t echo_replies;
+  uint64_t icmp;		/** ICMP the router sent to the hosts */
+  uint64_t other;		/** not generated here, e.g. pcap frames */
+  uint64_t misaddressed;	/** not to the MAC of the host */
+
+  uint8_t out[EMU_OUT_SIZE];	/** commands to write to the router */
+  uint32_t out_len;
+  uint8_t in[2 * VNSCMDSIZE];	/** commands read from the router */
+  uint32_t in_len;
+};
+
+static struct emu emu;
+
+static uint64_t
+emu_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint16_t
+emu_checksum (const uint8_t * p, int len)
+{
+  uint32_t sum = 0;
+
+  for (; len > 1; len -= 2, p += 2)
+    sum += (p[0] << 8) | p[1];
+  if (len)
+    sum += p[0] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return htons (~sum & 0xFFFF);
+}
+
+/** interface named name, -1 if none */
+static int
+emu_iface (const char *name)
+{
+  int i;
+
+  for (i = 0; i < emu.nifs; i++)
+    if (!strncmp (emu.ifs[i].name, name, sizeof (emu.ifs[i].name)))
+      return i;
+  return -1;
+}
+
+/** interface whose subnet holds ip (network byte order), -1 if none */
+static int
+emu_iface_of (uint32_t ip)
+{
+  int i;
+
+  for (i = 0; i < emu.nifs; i++)
+    if ((ip & emu.ifs[i].mask) == (emu.ifs[i].ip & emu.ifs[i].mask))
+      return i;
+  return -1;
+}
+
+/** add interface name with router address ip/mask and its host */
+static void
+emu_add_iface (const char *name, uint32_t ip, uint32_t mask,
+	       uint32_t host_ip)
+{
+  struct emu_iface *e = &emu.ifs[emu.nifs];
+
+  memset (e, 0, sizeof (*e));
+  strncpy (e->name, name, sizeof (e->name) - 1);
+  e->ip = ip;
+  e->mask = mask;
+  e->host_ip = host_ip;
+  memcpy (e->mac, "\x02\x00\x00\x00\x01", 5);
+  memcpy (e->host_mac, "\x02\x00\x00\x00\x02", 5);
+  e->mac[5] = e->host_mac[5] = emu.nifs;
+  emu.nifs++;
+}
+
+/**
+ * Read the topology, one interface per line:
+ *
+ *   <interface> <router ip> <mask> <host ip>
+ *
+ * Without a file, eth0 to eth2 are 10.0.N.1/24 with host 10.0.N.2.
+ */
+static int
+emu_load_topology (const char *filename)
+{
+  char line[256], name[16], ip[32], mask[32], host[32];
+  struct in_addr a, m, h;
+  FILE *fp;
+  int i;
+
+  if (!filename)
+    {
+      for (i = 0; i < 3; i++)
+	{
+	  snprintf (name, sizeof (name), "eth%d", i);
+	  emu_add_iface (name, htonl (0x0A000001 | (i + 1) << 8),
+			 htonl (0xFFFFFF00),
+			 htonl (0x0A000002 | (i + 1) << 8));
+	}
+      return 0;
+    }
+  if (!(fp = fopen (filename, "r")))
+    {
+      perror (filename);
+      return -1;
+    }
+  while (fgets (line, sizeof (line), fp) && emu.nifs < EMU_IFACES)
+    {
+      if (line[0] == '#'
+	  || sscanf (line, "%15s %31s %31s %31s", name, ip, mask, host) != 4)
+	continue;
+      if (!inet_aton (ip, &a) || !inet_aton (mask, &m)
+	  || !inet_aton (host, &h))
+	{
+	  fprintf (stderr, "%s: bad line %s", filename, line);
+	  fclose (fp);
+	  return -1;
+	}
+      emu_add_iface (name, a.s_addr, m.s_addr, h.s_addr);
+    }
+  fclose (fp);
+  return emu.nifs ? 0 : -1;
+}
+
+/** routing table of the topology: each subnet through its host */
+static int
+emu_rtable (char *buf, int size)
+{
+  struct in_addr a;
+  int i, n = 0;
+
+  /* -- the output is cut at size, each piece checked before the next -- */
+  for (i = 0; i < emu.nifs; i++)
+    {
+      a.s_addr = emu.ifs[i].ip & emu.ifs[i].mask;
+      if ((n += snprintf (buf + n, size - n, "%s ", inet_ntoa (a))) >= size)
+	return size;
+      a.s_addr = emu.ifs[i].host_ip;
+      if ((n += snprintf (buf + n, size - n, "%s ", inet_ntoa (a))) >= size)
+	return size;
+      a.s_addr = emu.ifs[i].mask;
+      if ((n += snprintf (buf + n, size - n, "%s %s\n", inet_ntoa (a),
+			  emu.ifs[i].name)) >= size)
+	return size;
+    }
+  return n;
+}
+
+/** flows from every host to every other host, in turn */
+static void
+emu_make_flows (int n)
+{
+  int i, src, dst;
+
+  if (emu.nifs < 2)
+    n = 0;
+  for (i = 0; i < n && i < EMU_FLOWS; i++)
+    {
+      src = i % emu.nifs;
+      dst = (src + 1 + (i / emu.nifs) % (emu.nifs - 1)) % emu.nifs;
+      memset (&emu.flows[i], 0, sizeof (struct emu_flow));
+      emu.flows[i].src = src;
+      emu.flows[i].dst = dst;
+    }
+  emu.nflows = i;
+}
+
+/** keep the IP frames of a pcap file (as written by sr -l) */
+static int
+emu_load_pcap (const char *filename)
+{
+  struct pcap_file_header fh;
+  struct pcap_sf_pkthdr ph;
+  struct sr_ethernet_hdr *eth;
+  FILE *fp;
+
+  if (!(fp = fopen (filename, "r")))
+    {
+      perror (filename);
+      return -1;
+    }
+  if (fread (&fh, sizeof (fh), 1, fp) != 1 || fh.magic != TCPDUMP_MAGIC
+      || fh.linktype != LINKTYPE_ETHERNET)
+    {
+      fprintf (stderr, "%s: not an ethernet pcap file\n", filename);
+      fclose (fp);
+      return -1;
+    }
+  emu.frames = calloc (EMU_FRAMES, sizeof (uint8_t *));
+  emu.frame_lens = calloc (EMU_FRAMES, sizeof (uint32_t));
+  while (emu.nframes < EMU_FRAMES && fread (&ph, sizeof (ph), 1, fp) == 1)
+    {
+      if (ph.caplen > VNSCMDSIZE - sizeof (c_packet_header))
+	break;
+      free (emu.frames[emu.nframes]);
+      emu.frames[emu.nframes] = malloc (ph.caplen);
+      if (fread (emu.frames[emu.nframes], ph.caplen, 1, fp) != 1)
+	break;
+
+      /* -- IP only: ARP is answered here, replayed it would mislead -- */
+      eth = (struct sr_ethernet_hdr *) emu.frames[emu.nframes];
+      if (ph.caplen < sizeof (*eth) + sizeof (struct ip)
+	  || ntohs (eth->ether_type) != ETHERTYPE_IP)
+	continue;
+      emu.frame_lens[emu.nframes++] = ph.caplen;
+    }
+  fclose (fp);
+  printf ("EMU: %u frames from %s\n", emu.nframes, filename);
+  return emu.nframes ? 0 : -1;
+}
+
+/** room for a command of len bytes in the output queue, 0 if full */
+static uint8_t *
+emu_queue (uint32_t len)
+{
+  uint8_t *p;
+
+  if (emu.out_len + len > EMU_OUT_SIZE)
+    return 0;
+  p = emu.out + emu.out_len;
+  emu.out_len += len;
+  return p;
+}
+
+/** room for a frame of len bytes sent by the host of interface i */
+static uint8_t *
+emu_queue_frame (int i, uint32_t len)
+{
+  c_packet_header *h;
+
+  if (!(h = (c_packet_header *) emu_queue (sizeof (*h) + len)))
+    return 0;
+  h->mLen = htonl (sizeof (*h) + len);
+  h->mType = htonl (VNSPACKET);
+  memset (h->mInterfaceName, 0, sizeof (h->mInterfaceName));
+  strncpy (h->mInterfaceName, emu.ifs[i].name,
+	   sizeof (h->mInterfaceName) - 1);
+  return (uint8_t *) (h + 1);
+}
+
+/** queue the next frame of flow f */
+static int
+emu_send_flow (int f)
+{
+  struct emu_flow *fl = &emu.flows[f];
+  struct emu_iface *src = &emu.ifs[fl->src];
+  struct sr_ethernet_hdr *eth;
+  struct ip *ip;
+  struct emu_stamp st;
+  uint8_t *frame, *udp;
+  uint16_t v;
+
+  if (!(frame = emu_queue_frame (fl->src, emu.size)))
+    return 0;
+  memset (frame, 0, emu.size);
+  eth = (struct sr_ethernet_hdr *) frame;
+  memcpy (eth->ether_dhost, src->mac, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, src->host_mac, ETHER_ADDR_LEN);
+  eth->ether_type = htons (ETHERTYPE_IP);
+
+  ip = (struct ip *) (eth + 1);
+  ip->ip_v = 4;
+  ip->ip_hl = 5;
+  ip->ip_len = htons (emu.size - sizeof (*eth));
+  ip->ip_id = htons (fl->seq);
+  ip->ip_ttl = 64;
+  ip->ip_p = IPPROTO_UDP;
+  ip->ip_src.s_addr = src->host_ip;
+  ip->ip_dst.s_addr = emu.ifs[fl->dst].host_ip;
+  ip->ip_sum = emu_checksum ((uint8_t *) ip, sizeof (*ip));
+
+  udp = (uint8_t *) (ip + 1);
+  v = htons (EMU_UDP_PORT + f);
+  memcpy (udp, &v, 2);
+  memcpy (udp + 2, &v, 2);
+  v = htons (emu.size - sizeof (*eth) - sizeof (*ip));
+  memcpy (udp + 4, &v, 2);
+
+  st.magic = htonl (EMU_MAGIC);
+  st.flow = htonl (f);
+  st.seq = htonl (fl->seq++);
+  st.sent = emu_now ();
+  memcpy (udp + 8, &st, sizeof (st));
+
+  fl->sent++;
+  emu.sent++;
+  emu.sent_bytes += emu.size;
+  return 1;
+}
+
+/** queue the next pcap frame, from the host of the source's subnet */
+static int
+emu_send_pcap (void)
+{
+  uint32_t n = emu.sent % emu.nframes, len = emu.frame_lens[n];
+  struct sr_ethernet_hdr *eth;
+  struct ip *ip;
+  uint8_t *frame;
+  int i;
+
+  ip = (struct ip *) (emu.frames[n] + sizeof (*eth));
+  if ((i = emu_iface_of (ip->ip_src.s_addr)) < 0)
+    i = 0;
+  if (!(frame = emu_queue_frame (i, len)))
+    return 0;
+  memcpy (frame, emu.frames[n], len);
+  eth = (struct sr_ethernet_hdr *) frame;
+  memcpy (eth->ether_dhost, emu.ifs[i].mac, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, emu.ifs[i].host_mac, ETHER_ADDR_LEN);
+
+  emu.sent++;
+  emu.sent_bytes += len;
+  return 1;
+}
+
+/** answer the ARP request of the router for the host of interface i */
+static void
+emu_arp (int i, struct sr_arphdr *req)
+{
+  struct sr_ethernet_hdr *eth;
+  struct sr_arphdr *rep;
+  uint8_t *frame;
+
+  if (ntohs (req->ar_op) != ARP_REQUEST || req->ar_tip != emu.ifs[i].host_ip
+      || !(frame = emu_queue_frame (i, sizeof (*eth) + sizeof (*rep))))
+    return;
+  eth = (struct sr_ethernet_hdr *) frame;
+  memcpy (eth->ether_dhost, req->ar_sha, ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, emu.ifs[i].host_mac, ETHER_ADDR_LEN);
+  eth->ether_type = htons (ETHERTYPE_ARP);
+  rep = (struct sr_arphdr *) (eth + 1);
+  *rep = *req;
+  rep->ar_op = htons (ARP_REPLY);
+  memcpy (rep->ar_sha, emu.ifs[i].host_mac, ETHER_ADDR_LEN);
+  rep->ar_sip = emu.ifs[i].host_ip;
+  memcpy (rep->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+  rep->ar_tip = req->ar_sip;
+  emu.arp_replies++;
+}
+
+/** answer a ping of the host of interface i */
+static void
+emu_echo (int i, uint8_t * in, uint32_t len)
+{
+  struct sr_ethernet_hdr *eth;
+  struct ip *ip;
+  uint8_t *frame, *icmp;
+  uint16_t sum;
+  int hl;
+
+  if (!(frame = emu_queue_frame (i, len)))
+    return;
+  memcpy (frame, in, len);
+  eth = (struct sr_ethernet_hdr *) frame;
+  memcpy (eth->ether_dhost, ((struct sr_ethernet_hdr *) in)->ether_shost,
+	  ETHER_ADDR_LEN);
+  memcpy (eth->ether_shost, emu.ifs[i].host_mac, ETHER_ADDR_LEN);
+  ip = (struct ip *) (eth + 1);
+  hl = ip->ip_hl * 4;
+  ip->ip_dst = ip->ip_src;
+  ip->ip_src.s_addr = emu.ifs[i].host_ip;
+  ip->ip_ttl = 64;
+  ip->ip_sum = 0;
+  ip->ip_sum = emu_checksum ((uint8_t *) ip, hl);
+  icmp = (uint8_t *) ip + hl;
+  icmp[0] = 0;			/* echo reply */
+  icmp[2] = icmp[3] = 0;
+  sum = emu_checksum (icmp, ntohs (ip->ip_len) - hl);
+  memcpy (icmp + 2, &sum, 2);
+  emu.echo_replies++;
+}
+
+/** a generated frame came back through the router */
+static void
+emu_stamped (int i, struct emu_stamp *st)
+{
+  struct emu_flow *fl;
+  uint32_t f = ntohl (st->flow), seq = ntohl (st->seq);
+  uint64_t lat = emu_now () - st->sent;
+  int n;
+
+  if (f >= (uint32_t) emu.nflows || emu.flows[f].dst != i)
+    {
+      emu.other++;
+      return;
+    }
+  fl = &emu.flows[f];
+  if (fl->received && seq < fl->last)
+    fl->reordered++;
+  else
+    fl->last = seq;
+  fl->received++;
+  fl->lat_sum += lat;
+  if (lat > fl->lat_max)
+    fl->lat_max = lat;
+  for (n = 0; n < EMU_LAT_BUCKETS - 1 && lat >> n; n++)
+    ;
+  fl->lat[n]++;
+}
+
+/** a frame the router sent on interface i */
+static void
+emu_frame (int i, uint8_t * frame, uint32_t len)
+{
+  struct sr_ethernet_hdr *eth = (struct sr_ethernet_hdr *) frame;
+  struct emu_stamp st;
+  struct ip *ip;
+  uint8_t *l4;
+  int hl;
+
+  emu.received++;
+  emu.received_bytes += len;
+  emu.ifs[i].rx++;
+  if (len < sizeof (*eth))
+    return;
+
+  if (ntohs (eth->ether_type) == ETHERTYPE_ARP
+      && len >= sizeof (*eth) + sizeof (struct sr_arphdr))
+    {
+      emu_arp (i, (struct sr_arphdr *) (eth + 1));
+      return;
+    }
+  if (memcmp (eth->ether_dhost, emu.ifs[i].host_mac, ETHER_ADDR_LEN))
+    {
+      emu.misaddressed++;
+      return;
+    }
+  ip = (struct ip *) (eth + 1);
+  if (ntohs (eth->ether_type) == ETHERTYPE_IP)
+    emu.forwarded++;
+  if (ntohs (eth->ether_type) != ETHERTYPE_IP
+      || len < sizeof (*eth) + sizeof (*ip)
+      || len < sizeof (*eth) + (hl = ip->ip_hl * 4) + 8 + sizeof (st))
+    {
+      emu.other++;
+      return;
+    }
+  l4 = (uint8_t *) ip + hl;
+  if (ip->ip_p == IPPROTO_UDP)
+    {
+      memcpy (&st, l4 + 8, sizeof (st));
+      if (ntohl (st.magic) == EMU_MAGIC)
+	{
+	  emu_stamped (i, &st);
+	  return;
+	}
+    }
+  else if (ip->ip_p == IPPROTO_ICMP)
+    {
+      if (l4[0] == 8 && ip->ip_dst.s_addr == emu.ifs[i].host_ip)
+	emu_echo (i, frame, len);
+      else
+	emu.icmp++;
+      return;
+    }
+  emu.other++;
+}
+
+/** send the hardware information of the topology */
+static void
+emu_hwinfo (void)
+{
+  c_hwinfo *hw;
+  c_hw_entry *e;
+  uint32_t speed = htonl (1000);
+  int i, n = 0;
+
+  hw = calloc (1, sizeof (*hw));
+  for (i = 0; i < emu.nifs && n + 5 <= MAXHWENTRIES; i++)
+    {
+      e = &hw->mHWInfo[n++];
+      e->mKey = htonl (HWINTERFACE);
+      strncpy (e->value, emu.ifs[i].name, sizeof (e->value) - 1);
+      e = &hw->mHWInfo[n++];
+      e->mKey = htonl (HWSPEED);
+      memcpy (e->value, &speed, 4);
+      e = &hw->mHWInfo[n++];
+      e->mKey = htonl (HWETHER);
+      memcpy (e->value, emu.ifs[i].mac, ETHER_ADDR_LEN);
+      e = &hw->mHWInfo[n++];
+      e->mKey = htonl (HWETHIP);
+      memcpy (e->value, &emu.ifs[i].ip, 4);
+      e = &hw->mHWInfo[n++];
+      e->mKey = htonl (HWMASK);
+      memcpy (e->value, &emu.ifs[i].mask, 4);
+    }
+  hw->mLen = htonl (2 * sizeof (uint32_t) + n * sizeof (c_hw_entry));
+  hw->mType = htonl (VNSHWINFO);
+  memcpy (emu_queue (ntohl (hw->mLen)), hw, ntohl (hw->mLen));
+  free (hw);
+}
+
+/** write what is queued for the router, without blocking */
+static int
+emu_write (void)
+{
+  ssize_t n;
+
+  if (!emu.out_len)
+    return 0;
+  if ((n = send (emu.fd, emu.out, emu.out_len, MSG_DONTWAIT)) == -1)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+	return 0;
+      perror ("send");
+      return -1;
+    }
+  memmove (emu.out, emu.out + n, emu.out_len - n);
+  emu.out_len -= n;
+  return 0;
+}
+
+/** read a whole command of the router (setup), 0 if the router left */
+static c_base *
+emu_read_command (void)
+{
+  uint32_t len;
+  ssize_t n;
+
+  for (;;)
+    {
+      if (emu.in_len >= sizeof (c_base))
+	{
+	  memcpy (&len, emu.in, 4);
+	  len = ntohl (len);
+	  if (len < sizeof (c_base) || len > VNSCMDSIZE)
+	    return 0;
+	  if (emu.in_len >= len)
+	    return (c_base *) emu.in;
+	}
+      if ((n = recv (emu.fd, emu.in + emu.in_len,
+		     sizeof (emu.in) - emu.in_len, 0)) <= 0)
+	{
+	  if (n == -1 && errno == EINTR)
+	    continue;
+	  return 0;
+	}
+      emu.in_len += n;
+    }
+}
+
+/** drop the command returned by emu_read_command */
+static void
+emu_consume (void)
+{
+  uint32_t len;
+
+  memcpy (&len, emu.in, 4);
+  len = ntohl (len);
+  memmove (emu.in, emu.in + len, emu.in_len - len);
+  emu.in_len -= len;
+}
+
+/**
+ * Authenticate the router, open its session and send its interfaces
+ */
+static int
+emu_session (const char *auth_key)
+{
+  uint8_t salt[20];
+  char key[AUTH_KEY_LEN + 1], status[64];
+  c_auth_request *req;
+  c_auth_reply *rep;
+  c_auth_status *st;
+  c_rtable *rt;
+  c_base *cmd;
+  SHA1Context sha1;
+  FILE *fp;
+  uint32_t ulen, i;
+  int ok = 1, len;
+
+  for (i = 0; i < sizeof (salt); i++)
+    salt[i] = random ();
+  req = (c_auth_request *) emu_queue (sizeof (*req) + sizeof (salt));
+  req->mLen = htonl (sizeof (*req) + sizeof (salt));
+  req->mType = htonl (VNS_AUTH_REQUEST);
+  memcpy (req->salt, salt, sizeof (salt));
+  emu_write ();
+
+  if (!(cmd = emu_read_command ()) || ntohl (cmd->mType) != VNS_AUTH_REPLY)
+    return -1;
+  rep = (c_auth_reply *) cmd;
+  ulen = ntohl (rep->usernameLen);
+  if (ulen > ntohl (rep->mLen) - sizeof (*rep) - SHA1_LEN)
+    return -1;
+  if (auth_key)
+    {
+      memset (key, 0, sizeof (key));
+      if (!(fp = fopen (auth_key, "r")) || !fgets (key, sizeof (key), fp))
+	{
+	  perror (auth_key);
+	  return -1;
+	}
+      fclose (fp);
+      SHA1Reset (&sha1);
+      SHA1Input (&sha1, salt, sizeof (salt));
+      SHA1Input (&sha1, (unsigned char *) key, AUTH_KEY_LEN);
+      SHA1Result (&sha1);
+      for (i = 0; i < 5; i++)
+	sha1.Message_Digest[i] = htonl (sha1.Message_Digest[i]);
+      ok = !memcmp (rep->username + ulen, sha1.Message_Digest, SHA1_LEN);
+    }
+  printf ("EMU: router of %.*s %s\n", (int) ulen, rep->username,
+	  ok ? "authenticated" : "failed to authenticate");
+  emu_consume ();
+
+  len = snprintf (status, sizeof (status), "%s",
+		  ok ? "welcome to the emulator" : "bad auth key");
+  st = (c_auth_status *) emu_queue (sizeof (*st) + len + 1);
+  st->mLen = htonl (sizeof (*st) + len + 1);
+  st->mType = htonl (VNS_AUTH_STATUS);
+  st->auth_ok = ok;
+  memcpy (st->msg, status, len + 1);
+  emu_write ();
+  if (!ok)
+    return -1;
+
+  /* -- open, or open a template: then the router wants its rtable -- */
+  if (!(cmd = emu_read_command ()))
+    return -1;
+  if (ntohl (cmd->mType) == VNS_OPEN_TEMPLATE)
+    {
+      rt = (c_rtable *) emu_queue (sizeof (*rt) + 4096);
+      len = emu_rtable (rt->rtable, 4096);
+      emu.out_len -= 4096 - len;
+      rt->mLen = htonl (sizeof (*rt) + len);
+      rt->mType = htonl (VNS_RTABLE);
+      strncpy (rt->mVirtualHostID,
+	       ((c_open_template *) cmd)->mVirtualHostID, IDSIZE);
+    }
+  else if (ntohl (cmd->mType) != VNSOPEN)
+    return -1;
+  emu_consume ();
+  emu_hwinfo ();
+  emu_write ();
+  return 0;
+}
+
+/** handle the commands read from the router */
+static int
+emu_commands (void)
+{
+  c_packet_header *h;
+  uint32_t len, off = 0;
+  char name[17];
+  int i;
+
+  while (emu.in_len - off >= sizeof (c_base))
+    {
+      memcpy (&len, emu.in + off, 4);
+      len = ntohl (len);
+      if (len < sizeof (c_base) || len > VNSCMDSIZE)
+	return -1;
+      if (emu.in_len - off < len)
+	break;
+      h = (c_packet_header *) (emu.in + off);
+      if (ntohl (h->mType) == VNSPACKET && len > sizeof (*h))
+	{
+	  memcpy (name, h->mInterfaceName, 16);
+	  name[16] = 0;
+	  if ((i = emu_iface (name)) >= 0)
+	    emu_frame (i, (uint8_t *) (h + 1), len - sizeof (*h));
+	}
+      off += len;
+    }
+  memmove (emu.in, emu.in + off, emu.in_len - off);
+  emu.in_len -= off;
+  return 0;
+}
+
+/**
+ * Send the load, paced to the rate, while reading what the router
+ * forwards; stop once nothing came from the router for grace_ms after
+ * the last frame was sent. Returns the seconds spent sending.
+ */
+static double
+emu_run (uint64_t warmup_ms, uint64_t grace_ms)
+{
+  struct pollfd pfd;
+  uint64_t start, now, due, done = 0, last = 0;
+  ssize_t n;
+  int burst, timeout;
+
+  pfd.fd = emu.fd;
+  start = emu_now () + warmup_ms * 1000;
+  for (;;)
+    {
+      now = emu_now ();
+      if (now >= start && emu.sent < emu.count)
+	{
+	  due = emu.rate ? (uint64_t) ((now - start) * emu.rate / 1e6) + 1
+	    : emu.count;
+	  for (burst = 0; burst < EMU_BURST && emu.sent < due
+	       && emu.sent < emu.count; burst++)
+	    if (!(emu.nframes ? emu_send_pcap ()
+		  : emu_send_flow (emu.sent % emu.nflows)))
+	      break;
+	}
+      /* -- also right away if there is nothing to send -- */
+      if (now >= start && !done && emu.sent >= emu.count)
+	done = now;
+      if (done && now - (last > done ? last : done) >= grace_ms * 1000)
+	break;
+
+      pfd.events = POLLIN | (emu.out_len ? POLLOUT : 0);
+      timeout = emu.sent < emu.count && (!emu.rate || now < start) ? 0 : 1;
+      if (poll (&pfd, 1, timeout) == -1 && errno != EINTR)
+	break;
+      if (pfd.revents & POLLIN)
+	{
+	  if ((n = recv (emu.fd, emu.in + emu.in_len,
+			 sizeof (emu.in) - emu.in_len, MSG_DONTWAIT)) == 0)
+	    {
+	      fprintf (stderr, "EMU: the router closed the session\n");
+	      break;
+	    }
+	  if (n > 0)
+	    {
+	      last = now;
+	      emu.in_len += n;
+	      if (emu_commands ())
+		break;
+	    }
+	}
+      if (emu_write ())
+	break;
+    }
+  done = (done ? done : emu_now ()) - start;
+  printf ("EMU: sent %lu frames in %.3f s\n", (unsigned long) emu.sent,
+	  done / 1e6);
+  return done ? done / 1e6 : 1e-6;
+}
+
+/** bound of the latency under which pct % of the frames came (bucket) */
+static uint64_t
+emu_percentile (struct emu_flow *fl, int pct)
+{
+  uint64_t n = 0;
+  int i;
+
+  if (!fl->received)
+    return 0;
+  for (i = 0; i < EMU_LAT_BUCKETS - 1; i++)
+    if ((n += fl->lat[i]) * 100 >= fl->received * pct)
+      break;
+  return (1ULL << i) < fl->lat_max ? 1ULL << i : fl->lat_max;
+}
+
+static void
+emu_report (double seconds)
+{
+  struct emu_flow *fl;
+  int f;
+
+  printf ("flow  src             dst              sent      recv   loss%%"
+	  "  reord    avg_us  p50_us  p99_us  max_us\n");
+  for (f = 0; f < emu.nflows; f++)
+    {
+      fl = &emu.flows[f];
+      printf ("%4d  %-15s ", f,
+	      inet_ntoa (*(struct in_addr *) &emu.ifs[fl->src].host_ip));
+      printf ("%-15s %9lu %9lu %6.2f %6lu %9.1f %7lu %7lu %7lu\n",
+	      inet_ntoa (*(struct in_addr *) &emu.ifs[fl->dst].host_ip),
+	      (unsigned long) fl->sent, (unsigned long) fl->received,
+	      fl->sent ? 100.0 * (fl->sent - fl->received) / fl->sent : 0.0,
+	      (unsigned long) fl->reordered,
+	      fl->received ? (double) fl->lat_sum / fl->received : 0.0,
+	      (unsigned long) emu_percentile (fl, 50),
+	      (unsigned long) emu_percentile (fl, 99),
+	      (unsigned long) fl->lat_max);
+    }
+  printf ("EMU: offered %.0f frames/s, forwarded %.0f frames/s "
+	  "(%.1f Mbit/s received)\n", emu.sent / seconds,
+	  emu.forwarded / seconds,
+	  emu.received_bytes * 8 / seconds / 1e6);
+  printf ("EMU: from the router: %lu frames, %lu ARP requests answered, "
+	  "%lu pings answered, %lu ICMP, %lu other, %lu misaddressed\n",
+	  (unsigned long) emu.received, (unsigned long) emu.arp_replies,
+	  (unsigned long) emu.echo_replies, (unsigned long) emu.icmp,
+	  (unsigned long) emu.other, (unsigned long) emu.misaddressed);
+}
+
+static void
+usage (char *argv0)
+{
+  printf ("Format: %s [-p port] [-a auth key file] [-c topology file]\n",
+	  argv0);
+  printf ("           [-r frames/s] [-n frames] [-s frame size] "
+	  "[-f flows]\n");
+  printf ("           [-P pcap file to send instead of flows]\n");
+  printf ("           [-W ms before sending] [-g ms to wait after]\n");
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  c_close bye;
+  char *auth_key = 0, *topology = 0, *pcap = 0;
+  int c, lfd, port = EMU_PORT, flows = 4, one = 1;
+  uint64_t warmup = 1000, grace = 500;
+
+  emu.count = 100000;
+  emu.size = 128;
+  emu.rate = 10000;
+  while ((c = getopt (argc, argv, "hp:a:c:r:n:s:f:P:W:g:")) != EOF)
+    {
+      switch (c)
+	{
+	case 'p':
+	  port = atoi (optarg);
+	  break;
+	case 'a':
+	  auth_key = optarg;
+	  break;
+	case 'c':
+	  topology = optarg;
+	  break;
+	case 'r':
+	  emu.rate = atof (optarg);
+	  break;
+	case 'n':
+	  emu.count = strtoull (optarg, 0, 10);
+	  break;
+	case 's':
+	  emu.size = atoi (optarg);
+	  break;
+	case 'f':
+	  flows = atoi (optarg);
+	  break;
+	case 'P':
+	  pcap = optarg;
+	  break;
+	case 'W':
+	  warmup = atoi (optarg);
+	  break;
+	case 'g':
+	  grace = atoi (optarg);
+	  break;
+	default:
+	  usage (argv[0]);
+	  exit (c != 'h');
+	}
+    }
+  if (emu.size < EMU_MIN_SIZE || emu.size > EMU_MAX_SIZE || flows < 1
+      || emu_load_topology (topology) || (pcap && emu_load_pcap (pcap)))
+    {
+      usage (argv[0]);
+      exit (1);
+    }
+  if (!pcap && emu.nifs < 2)
+    {
+      fprintf (stderr, "EMU: flows need at least two interfaces\n");
+      exit (1);
+    }
+  emu_make_flows (pcap ? 0 : flows);
+  if (!emu.nflows && !emu.nframes)
+    emu.count = 0;
+
+  if ((lfd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+      perror ("socket");
+      exit (1);
+    }
+  setsockopt (lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  if (bind (lfd, (struct sockaddr *) &addr, sizeof (addr))
+      || listen (lfd, 1))
+    {
+      perror ("bind");
+      exit (1);
+    }
+  printf ("EMU: waiting for the router on port %d\n", port);
+  fflush (stdout);
+  if ((emu.fd = accept (lfd, 0, 0)) == -1)
+    {
+      perror ("accept");
+      exit (1);
+    }
+  close (lfd);
+  srandom (time (0));
+  if (emu_session (auth_key))
+    {
+      fprintf (stderr, "EMU: session setup failed\n");
+      exit (1);
+    }
+
+  emu_report (emu_run (warmup, grace));
+
+  memset (&bye, 0, sizeof (bye));
+  bye.mLen = htonl (sizeof (bye));
+  bye.mType = htonl (VNSCLOSE);
+  strcpy (bye.mErrorMessage, "load test done");
+  send (emu.fd, &bye, sizeof (bye), 0);
+  close (emu.fd);
+  return 0;
+}